@@ -0,0 +1,215 @@
+package caddysnake
+
+import (
+	"container/list"
+	"context"
+	"errors"
+	"math"
+	"sync"
+	"time"
+)
+
+// Priority is the class of a request for admission control, it's taken from
+// the python_priority variable that routes set with the vars directive.
+type Priority uint8
+
+const (
+	// PRIORITY_CRITICAL requests, like health checks, are never queued or
+	// rejected
+	PRIORITY_CRITICAL Priority = iota
+	PRIORITY_HIGH
+	PRIORITY_NORMAL
+	PRIORITY_LOW
+	priorityClasses
+)
+
+// parsePriority returns the class of a python_priority value, unknown values
+// are normal.
+func parsePriority(value any) Priority {
+	switch value {
+	case "critical":
+		return PRIORITY_CRITICAL
+	case "high":
+		return PRIORITY_HIGH
+	case "low":
+		return PRIORITY_LOW
+	}
+	return PRIORITY_NORMAL
+}
+
+const (
+	// When the queue hasn't been empty for codelInterval the app is
+	// overloaded, then requests only wait up to codelTarget so the queue
+	// drains instead of every request waiting max_wait.
+	codelInterval = 100 * time.Millisecond
+	codelTarget   = 5 * time.Millisecond
+)
+
+var errAdmissionLimit = errors.New("python admission limit reached")
+
+// admissionController limits the requests that run in the app at once. The
+// ones above the limit wait in a queue for each priority class, higher
+// classes are admitted first and requests are rejected when they waited
+// max_wait. With adaptive on the limit follows the latency of the app: it
+// shrinks when requests get slower than usual and grows back up to
+// max_limit when they recover.
+type admissionController struct {
+	mu        sync.Mutex
+	limit     float64
+	max_limit int
+	in_flight int
+	max_wait  time.Duration
+	adaptive  bool
+	queues    [priorityClasses]list.List
+	waiting   int
+	// last_empty is the last time that no request was waiting
+	last_empty time.Time
+	// long_latency and short_latency are moving averages of the latency
+	// of the app over many and over few requests
+	long_latency  float64
+	short_latency float64
+	now           func() time.Time
+}
+
+// admissionWaiter is a queued request, ready is closed when it's admitted.
+type admissionWaiter struct {
+	ready    chan struct{}
+	admitted bool
+}
+
+func newAdmissionController(max_in_flight int, max_wait time.Duration, adaptive bool) *admissionController {
+	return &admissionController{
+		limit:      float64(max_in_flight),
+		max_limit:  max_in_flight,
+		max_wait:   max_wait,
+		adaptive:   adaptive,
+		last_empty: time.Now(),
+		now:        time.Now,
+	}
+}
+
+// admit waits until a request can run in the app, release must be called
+// with the time it was admitted once it finishes. It returns
+// errAdmissionLimit when the request waited too long or the context error
+// if the client went away.
+func (a *admissionController) admit(ctx context.Context, priority Priority) (time.Time, error) {
+	a.mu.Lock()
+	now := a.now()
+	if a.waiting == 0 {
+		a.last_empty = now
+	}
+	if priority == PRIORITY_CRITICAL || (a.in_flight < a.currentLimit() && !a.waitingBefore(priority)) {
+		a.in_flight++
+		a.mu.Unlock()
+		return now, nil
+	}
+	wait := a.max_wait
+	if a.adaptive && now.Sub(a.last_empty) > codelInterval && wait > codelTarget {
+		wait = codelTarget
+	}
+	if wait <= 0 {
+		a.mu.Unlock()
+		return time.Time{}, errAdmissionLimit
+	}
+	waiter := &admissionWaiter{ready: make(chan struct{})}
+	element := a.queues[priority].PushBack(waiter)
+	a.waiting++
+	a.mu.Unlock()
+
+	timer := time.NewTimer(wait)
+	defer timer.Stop()
+	var err error
+	select {
+	case <-waiter.ready:
+		return a.now(), nil
+	case <-timer.C:
+		err = errAdmissionLimit
+	case <-ctx.Done():
+		err = ctx.Err()
+	}
+	a.mu.Lock()
+	defer a.mu.Unlock()
+	if waiter.admitted {
+		// Admitted while the timer fired, hand the slot to the next one
+		a.in_flight--
+		a.admitNext()
+		return time.Time{}, err
+	}
+	a.queues[priority].Remove(element)
+	a.waiting--
+	if a.waiting == 0 {
+		a.last_empty = a.now()
+	}
+	return time.Time{}, err
+}
+
+// release frees the slot of a request that was admitted at start, and
+// admits the requests that fit in the limit.
+func (a *admissionController) release(start time.Time) {
+	a.mu.Lock()
+	defer a.mu.Unlock()
+	if a.adaptive {
+		a.update(float64(a.now().Sub(start)))
+	}
+	a.in_flight--
+	a.admitNext()
+}
+
+func (a *admissionController) currentLimit() int {
+	return int(a.limit)
+}
+
+// waitingBefore tells if there are requests of the same or higher priority
+// waiting, new requests don't overtake them.
+func (a *admissionController) waitingBefore(priority Priority) bool {
+	for class := PRIORITY_HIGH; class <= priority; class++ {
+		if a.queues[class].Len() > 0 {
+			return true
+		}
+	}
+	return false
+}
+
+// admitNext wakes up the waiting requests by priority while there is room,
+// the lock must be held.
+func (a *admissionController) admitNext() {
+	for class := PRIORITY_HIGH; class < priorityClasses && a.in_flight < a.currentLimit(); {
+		element := a.queues[class].Front()
+		if element == nil {
+			class++
+			continue
+		}
+		waiter := a.queues[class].Remove(element).(*admissionWaiter)
+		a.waiting--
+		a.in_flight++
+		waiter.admitted = true
+		close(waiter.ready)
+	}
+	if a.waiting == 0 {
+		a.last_empty = a.now()
+	}
+}
+
+// update adjusts the limit with the latency of a request, in the style of
+// the gradient limiters: the ratio between the long and the short term
+// latency scales the limit, plus some room for the queue. The lock must be
+// held.
+func (a *admissionController) update(latency float64) {
+	if a.long_latency == 0 {
+		a.long_latency, a.short_latency = latency, latency
+		return
+	}
+	a.long_latency += (latency - a.long_latency) / 600
+	a.short_latency += (latency - a.short_latency) / 10
+	// Recover faster when the app gets quicker than it used to be
+	if a.short_latency < a.long_latency {
+		a.long_latency = a.short_latency
+	}
+	gradient := math.Max(0.5, math.Min(1, a.long_latency/a.short_latency))
+	limit := a.limit*gradient + math.Sqrt(a.limit)
+	// Only grow when the limit is actually being used
+	if limit > a.limit && float64(a.in_flight) < a.limit/2 {
+		return
+	}
+	a.limit = math.Max(1, math.Min(float64(a.max_limit), 0.8*a.limit+0.2*limit))
+}
@@ -0,0 +1,163 @@
+package caddysnake
+
+import (
+	"context"
+	"errors"
+	"net/http"
+	"net/http/httptest"
+	"sync"
+	"testing"
+	"time"
+
+	"github.com/caddyserver/caddy/v2/modules/caddyhttp"
+)
+
+func TestAdmissionLimit(t *testing.T) {
+	a := newAdmissionController(2, 0, false)
+	ctx := context.Background()
+	first, err := a.admit(ctx, PRIORITY_NORMAL)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if _, err := a.admit(ctx, PRIORITY_NORMAL); err != nil {
+		t.Fatal(err)
+	}
+	if _, err := a.admit(ctx, PRIORITY_NORMAL); !errors.Is(err, errAdmissionLimit) {
+		t.Errorf("expected errAdmissionLimit, got %v", err)
+	}
+	if _, err := a.admit(ctx, PRIORITY_CRITICAL); err != nil {
+		t.Errorf("expected critical requests to bypass the limit, got %v", err)
+	}
+	a.release(first)
+	a.release(first)
+	if _, err := a.admit(ctx, PRIORITY_NORMAL); err != nil {
+		t.Errorf("expected a free slot after release, got %v", err)
+	}
+}
+
+func TestAdmissionQueue(t *testing.T) {
+	a := newAdmissionController(1, time.Second, false)
+	ctx := context.Background()
+	start, _ := a.admit(ctx, PRIORITY_NORMAL)
+
+	order := make(chan Priority, 2)
+	var wg sync.WaitGroup
+	for _, priority := range []Priority{PRIORITY_LOW, PRIORITY_HIGH} {
+		wg.Add(1)
+		go func(priority Priority) {
+			defer wg.Done()
+			start, err := a.admit(ctx, priority)
+			if err != nil {
+				t.Error(err)
+				return
+			}
+			order <- priority
+			a.release(start)
+		}(priority)
+		time.Sleep(20 * time.Millisecond)
+	}
+	a.release(start)
+	if first, second := <-order, <-order; first != PRIORITY_HIGH || second != PRIORITY_LOW {
+		t.Errorf("expected the high priority request first, got %d then %d", first, second)
+	}
+	wg.Wait()
+	if a.in_flight != 0 || a.waiting != 0 {
+		t.Errorf("expected no requests left, got %d in flight and %d waiting", a.in_flight, a.waiting)
+	}
+}
+
+func TestAdmissionQueueWait(t *testing.T) {
+	a := newAdmissionController(1, 20*time.Millisecond, false)
+	ctx := context.Background()
+	a.admit(ctx, PRIORITY_NORMAL)
+	begin := time.Now()
+	if _, err := a.admit(ctx, PRIORITY_NORMAL); !errors.Is(err, errAdmissionLimit) {
+		t.Errorf("expected errAdmissionLimit, got %v", err)
+	}
+	if time.Since(begin) < 20*time.Millisecond {
+		t.Errorf("expected the request to wait before it's rejected")
+	}
+	cancelled, cancel := context.WithCancel(ctx)
+	cancel()
+	if _, err := a.admit(cancelled, PRIORITY_NORMAL); !errors.Is(err, context.Canceled) {
+		t.Errorf("expected context.Canceled, got %v", err)
+	}
+	if a.waiting != 0 {
+		t.Errorf("expected the queue to be empty, got %d", a.waiting)
+	}
+}
+
+func TestAdmissionAdaptive(t *testing.T) {
+	a := newAdmissionController(100, 0, true)
+	now := time.Now()
+	a.now = func() time.Time { return now }
+	run := func(latency time.Duration) {
+		var started []time.Time
+		for i := 0; i < 80; i++ {
+			if start, err := a.admit(context.Background(), PRIORITY_NORMAL); err == nil {
+				started = append(started, start)
+			}
+		}
+		now = now.Add(latency)
+		for _, start := range started {
+			a.release(start)
+		}
+	}
+	for i := 0; i < 20; i++ {
+		run(10 * time.Millisecond)
+	}
+	if a.currentLimit() != 100 {
+		t.Errorf("expected the limit to stay at 100, got %d", a.currentLimit())
+	}
+	for i := 0; i < 5; i++ {
+		run(50 * time.Millisecond)
+	}
+	slow := a.currentLimit()
+	if slow >= 80 {
+		t.Errorf("expected the limit to go down when latency goes up, got %d", slow)
+	}
+	for i := 0; i < 50; i++ {
+		run(10 * time.Millisecond)
+	}
+	if a.currentLimit() <= slow {
+		t.Errorf("expected the limit to recover, got %d", a.currentLimit())
+	}
+}
+
+func TestAdmissionUpgrade(t *testing.T) {
+	f := &CaddySnake{app: &fakeReloadable{}, admission: newAdmissionController(1, 0, false)}
+	start, _ := f.admission.admit(context.Background(), PRIORITY_NORMAL)
+	defer f.admission.release(start)
+
+	websocket := func(method string, connection string, upgrade string) *http.Request {
+		r := httptest.NewRequest(method, "/", nil)
+		r.Header.Set("Connection", connection)
+		r.Header.Set("Upgrade", upgrade)
+		return r
+	}
+	for _, r := range []*http.Request{
+		websocket(http.MethodGet, "Upgrade", "x"),
+		// Only ASGI apps serve websockets
+		websocket(http.MethodGet, "keep-alive, Upgrade", "websocket"),
+	} {
+		var handler_err caddyhttp.HandlerError
+		err := f.handle(httptest.NewRecorder(), r)
+		if !errors.As(err, &handler_err) || handler_err.StatusCode != http.StatusServiceUnavailable {
+			t.Errorf("Upgrade %q: expected a 503, got %v", r.Header.Get("Upgrade"), err)
+		}
+	}
+
+	for _, test := range []struct {
+		r         *http.Request
+		websocket bool
+	}{
+		{websocket(http.MethodGet, "keep-alive, Upgrade", "WebSocket"), true},
+		{websocket(http.MethodGet, "Upgrade", "h2c"), false},
+		{websocket(http.MethodGet, "keep-alive", "websocket"), false},
+		{websocket(http.MethodPost, "Upgrade", "websocket"), false},
+	} {
+		if isWebsocketRequest(test.r) != test.websocket {
+			t.Errorf("%s %q %q: expected websocket to be %v", test.r.Method, test.r.Header.Get("Connection"), test.r.Header.Get("Upgrade"), test.websocket)
+		}
+	}
+}
@@ -0,0 +1,236 @@
+package caddysnake
+
+import (
+	"bytes"
+	"context"
+	"fmt"
+	"net"
+	"net/http"
+	"net/http/httptest"
+	"os"
+	"path/filepath"
+	"runtime"
+	"strings"
+	"sync"
+	"testing"
+
+	"github.com/gorilla/websocket"
+)
+
+// The benchmarks serve these apps in-process, they do as little as possible
+// so the time is spent in the bridge. Run them with:
+//
+//	go test -run '^$' -bench . -benchmem
+const benchmarkApps = `
+def wsgi_app(environ, start_response):
+    path = environ["PATH_INFO"]
+    if path == "/body":
+        size = 0
+        chunk = environ["wsgi.input"].read(65536)
+        while chunk:
+            size += len(chunk)
+            chunk = environ["wsgi.input"].read(65536)
+        start_response("200 OK", [("Content-Type", "text/plain")])
+        return [str(size).encode()]
+    if path == "/stream":
+        start_response("200 OK", [("Content-Type", "text/plain")])
+        return (b"chunk %d\n" % i for i in range(16))
+    start_response("200 OK", [("Content-Type", "text/plain")])
+    return [b"Hello, world!"]
+
+
+wsgi_direct = wsgi_app
+
+
+async def asgi_app(scope, receive, send):
+    if scope["type"] == "websocket":
+        await receive()
+        await send({"type": "websocket.accept"})
+        while True:
+            message = await receive()
+            if message["type"] == "websocket.disconnect":
+                return
+            if message.get("text") is not None:
+                await send({"type": "websocket.send", "text": message["text"]})
+            else:
+                await send({"type": "websocket.send", "bytes": message["bytes"]})
+    path = scope["path"]
+    if path == "/body":
+        size = 0
+        more_body = True
+        while more_body:
+            message = await receive()
+            size += len(message.get("body", b""))
+            more_body = message.get("more_body", False)
+        await send({"type": "http.response.start", "status": 200})
+        await send({"type": "http.response.body", "body": str(size).encode()})
+        return
+    await send({
+        "type": "http.response.start",
+        "status": 200,
+        "headers": [(b"content-type", b"text/plain")],
+    })
+    if path == "/stream":
+        for i in range(16):
+            await send({
+                "type": "http.response.body",
+                "body": b"chunk %d\n" % i,
+                "more_body": True,
+            })
+        await send({"type": "http.response.body"})
+        return
+    await send({"type": "http.response.body", "body": b"Hello, world!"})
+`
+
+var benchmarkVenv struct {
+	once sync.Once
+	path string
+	err  error
+}
+
+// benchmarkSetup writes the apps in a directory that looks like a venv and
+// returns its path.
+func benchmarkSetup(b *testing.B) string {
+	benchmarkVenv.once.Do(func() {
+		dir, err := os.MkdirTemp("", "caddysnake-bench")
+		if err != nil {
+			benchmarkVenv.err = err
+			return
+		}
+		site_packages := filepath.Join(dir, "lib", "python3.x", "site-packages")
+		if err := os.MkdirAll(site_packages, 0755); err != nil {
+			benchmarkVenv.err = err
+			return
+		}
+		benchmarkVenv.err = os.WriteFile(filepath.Join(site_packages, "caddysnake_bench.py"), []byte(benchmarkApps), 0644)
+		benchmarkVenv.path = dir
+	})
+	if benchmarkVenv.err != nil {
+		b.Fatal(benchmarkVenv.err)
+	}
+	return benchmarkVenv.path
+}
+
+// benchmarkCase is a kind of request that the apps serve.
+type benchmarkCase struct {
+	name    string
+	method  string
+	path    string
+	headers int
+	body    int
+}
+
+var benchmarkCases = []benchmarkCase{
+	{name: "hello", method: "GET", path: "/hello"},
+	{name: "headers", method: "GET", path: "/hello", headers: 30},
+	{name: "body_1MB", method: "POST", path: "/body", body: 1 << 20},
+	{name: "body_100MB", method: "POST", path: "/body", body: 100 << 20},
+	{name: "stream", method: "GET", path: "/stream"},
+}
+
+// request builds the request of the case, like the one that Caddy passes to
+// the handler.
+func (c *benchmarkCase) request(body []byte) *http.Request {
+	r := httptest.NewRequest(c.method, c.path, bytes.NewReader(body))
+	for i := 0; i < c.headers; i++ {
+		r.Header.Set(fmt.Sprintf("X-Benchmark-%d", i), "some value for the header")
+	}
+	return r.WithContext(context.WithValue(r.Context(), http.LocalAddrContextKey, &net.TCPAddr{Port: 80}))
+}
+
+// bridgeCounts are the cgo calls and GIL acquisitions at the start of a
+// benchmark.
+type bridgeCounts struct {
+	cgo_calls int64
+	gil       uint64
+}
+
+func startCounts(b *testing.B) bridgeCounts {
+	b.ReportAllocs()
+	b.ResetTimer()
+	return bridgeCounts{runtime.NumCgoCall(), gilAcquisitions()}
+}
+
+// report adds the counts per operation to the results of the benchmark.
+func (c bridgeCounts) report(b *testing.B) {
+	b.StopTimer()
+	b.ReportMetric(float64(runtime.NumCgoCall()-c.cgo_calls)/float64(b.N), "cgo-calls/op")
+	b.ReportMetric(float64(gilAcquisitions()-c.gil)/float64(b.N), "gil/op")
+}
+
+func runBenchmarkCases(b *testing.B, app AppServer) {
+	for _, c := range benchmarkCases {
+		c := c
+		b.Run(c.name, func(b *testing.B) {
+			body := bytes.Repeat([]byte("x"), c.body)
+			b.SetBytes(int64(c.body))
+			counts := startCounts(b)
+			for i := 0; i < b.N; i++ {
+				w := httptest.NewRecorder()
+				if err := app.HandleRequest(w, c.request(body)); err != nil {
+					b.Fatal(err)
+				}
+				if w.Code != http.StatusOK {
+					b.Fatalf("expected status 200, got %d", w.Code)
+				}
+			}
+			counts.report(b)
+		})
+	}
+}
+
+func BenchmarkWsgi(b *testing.B) {
+	venv := benchmarkSetup(b)
+	for _, direct := range []bool{false, true} {
+		pattern, name := "caddysnake_bench:wsgi_app", "queue"
+		if direct {
+			pattern, name = "caddysnake_bench:wsgi_direct", "direct"
+		}
+		app, err := NewWsgi(pattern, venv, WsgiOptions{Direct: direct})
+		if err != nil {
+			b.Fatal(err)
+		}
+		b.Run(name, func(b *testing.B) {
+			runBenchmarkCases(b, app)
+		})
+		app.Cleanup()
+	}
+}
+
+func BenchmarkAsgi(b *testing.B) {
+	app, err := NewAsgi("caddysnake_bench:asgi_app", benchmarkSetup(b), AsgiOptions{})
+	if err != nil {
+		b.Fatal(err)
+	}
+	defer app.Cleanup()
+	runBenchmarkCases(b, app)
+}
+
+func BenchmarkAsgiWebsocket(b *testing.B) {
+	app, err := NewAsgi("caddysnake_bench:asgi_app", benchmarkSetup(b), AsgiOptions{})
+	if err != nil {
+		b.Fatal(err)
+	}
+	defer app.Cleanup()
+	server := httptest.NewServer(http.HandlerFunc(func(w http.ResponseWriter, r *http.Request) {
+		app.HandleRequest(w, r)
+	}))
+	defer server.Close()
+	conn, _, err := websocket.DefaultDialer.Dial("ws://"+strings.TrimPrefix(server.URL, "http://")+"/ws", nil)
+	if err != nil {
+		b.Fatal(err)
+	}
+	defer conn.Close()
+
+	message := []byte("hello")
+	counts := startCounts(b)
+	for i := 0; i < b.N; i++ {
+		if err := conn.WriteMessage(websocket.TextMessage, message); err != nil {
+			b.Fatal(err)
+		}
+		if _, echo, err := conn.ReadMessage(); err != nil || !bytes.Equal(echo, message) {
+			b.Fatalf("expected the message back, got %q: %v", echo, err)
+		}
+	}
+	counts.report(b)
+}
@@ -0,0 +1,416 @@
+package caddysnake
+
+import (
+	"bytes"
+	"container/list"
+	"io"
+	"net/http"
+	"strconv"
+	"strings"
+	"sync"
+	"time"
+)
+
+// cacheableStatus has the status codes that can be stored, the ones that are
+// cacheable by default in RFC 9110.
+var cacheableStatus = map[int]bool{
+	http.StatusOK:                   true,
+	http.StatusNonAuthoritativeInfo: true,
+	http.StatusNoContent:            true,
+	http.StatusMultipleChoices:      true,
+	http.StatusMovedPermanently:     true,
+	http.StatusPermanentRedirect:    true,
+	http.StatusNotFound:             true,
+	http.StatusMethodNotAllowed:     true,
+	http.StatusGone:                 true,
+	http.StatusRequestURITooLong:    true,
+	http.StatusNotImplemented:       true,
+}
+
+// responseCache keeps the responses of the app that allow it with a max-age
+// or s-maxage directive in memory, so the requests that hit them don't reach
+// Python. Concurrent misses of the same key are coalesced: one request calls
+// the app and the others wait for its response.
+type responseCache struct {
+	mu       sync.Mutex
+	max_size int64
+	size     int64
+	// vary are the canonical names of the request headers that are part
+	// of the key
+	vary     []string
+	entries  map[string]*list.Element
+	lru      *list.List
+	inflight map[string]*cacheFill
+	now      func() time.Time
+}
+
+type cacheEntry struct {
+	key     string
+	status  int
+	header  http.Header
+	body    []byte
+	size    int64
+	stored  time.Time
+	expires time.Time
+}
+
+// cacheFill is a miss that is being served by the app, entry is set before
+// done is closed if the response was stored. done is closed as soon as the
+// response turns out not to be storable, so the requests that wait for it
+// go to the app without waiting for it to finish.
+type cacheFill struct {
+	done  chan struct{}
+	entry *cacheEntry
+}
+
+func newResponseCache(max_size int64, vary []string) *responseCache {
+	canonical := make([]string, len(vary))
+	for i, name := range vary {
+		canonical[i] = http.CanonicalHeaderKey(name)
+	}
+	return &responseCache{
+		max_size: max_size,
+		vary:     canonical,
+		entries:  map[string]*list.Element{},
+		lru:      list.New(),
+		inflight: map[string]*cacheFill{},
+		now:      time.Now,
+	}
+}
+
+// serve responds from the cache or passes the request to handler, storing
+// its response when it can be reused.
+func (c *responseCache) serve(w http.ResponseWriter, r *http.Request, handler func(http.ResponseWriter, *http.Request) error) error {
+	if !cacheableRequest(r) {
+		return handler(w, r)
+	}
+	key := c.key(r)
+
+	c.mu.Lock()
+	if entry := c.lookup(key); entry != nil {
+		c.mu.Unlock()
+		c.write(w, r, entry)
+		return nil
+	}
+	if fill, ok := c.inflight[key]; ok {
+		c.mu.Unlock()
+		select {
+		case <-fill.done:
+		case <-r.Context().Done():
+			return r.Context().Err()
+		}
+		if fill.entry != nil {
+			c.write(w, r, fill.entry)
+			return nil
+		}
+		// The response couldn't be stored, so it can't be shared either
+		return handler(w, r)
+	}
+	fill := &cacheFill{done: make(chan struct{})}
+	c.inflight[key] = fill
+	c.mu.Unlock()
+
+	recorder := &cacheRecorder{ResponseWriter: w, limit: c.max_size / 8, cache: c, key: key, fill: fill}
+	var err error
+	defer func() {
+		if recorder.abandoned {
+			return
+		}
+		var entry *cacheEntry
+		if err == nil {
+			entry = c.entryFor(key, recorder)
+		}
+		c.finishFill(key, fill, entry)
+	}()
+	err = handler(recorder, r)
+	return err
+}
+
+// finishFill stores the response of a miss, when entry isn't nil, and wakes
+// up the requests that wait for it.
+func (c *responseCache) finishFill(key string, fill *cacheFill, entry *cacheEntry) {
+	c.mu.Lock()
+	delete(c.inflight, key)
+	if entry != nil {
+		c.insert(entry)
+	}
+	c.mu.Unlock()
+	fill.entry = entry
+	close(fill.done)
+}
+
+// cacheableRequest tells if a request can be served from the cache, requests
+// with credentials or that ask for a fresh response always reach the app.
+func cacheableRequest(r *http.Request) bool {
+	if r.Method != http.MethodGet && r.Method != http.MethodHead {
+		return false
+	}
+	if r.Header.Get("Authorization") != "" || r.Header.Get("Upgrade") != "" {
+		return false
+	}
+	cache_control := r.Header.Values("Cache-Control")
+	_, no_cache := cacheDirective(cache_control, "no-cache")
+	_, no_store := cacheDirective(cache_control, "no-store")
+	return !no_cache && !no_store
+}
+
+func (c *responseCache) key(r *http.Request) string {
+	var key strings.Builder
+	key.WriteString(r.Method)
+	key.WriteByte(0)
+	key.WriteString(r.Host)
+	key.WriteByte(0)
+	key.WriteString(r.URL.EscapedPath())
+	key.WriteByte('?')
+	key.WriteString(r.URL.RawQuery)
+	for _, name := range c.vary {
+		key.WriteByte(0)
+		key.WriteString(strings.Join(r.Header.Values(name), ", "))
+	}
+	return key.String()
+}
+
+// lookup returns the entry of a key if it's still fresh, the lock must be
+// held.
+func (c *responseCache) lookup(key string) *cacheEntry {
+	element, ok := c.entries[key]
+	if !ok {
+		return nil
+	}
+	entry := element.Value.(*cacheEntry)
+	if !c.now().Before(entry.expires) {
+		c.remove(element)
+		return nil
+	}
+	c.lru.MoveToFront(element)
+	return entry
+}
+
+// insert stores an entry and evicts the least recently used ones until the
+// cache fits in max_size, the lock must be held.
+func (c *responseCache) insert(entry *cacheEntry) {
+	if element, ok := c.entries[entry.key]; ok {
+		c.remove(element)
+	}
+	c.entries[entry.key] = c.lru.PushFront(entry)
+	c.size += entry.size
+	for c.size > c.max_size {
+		c.remove(c.lru.Back())
+	}
+}
+
+func (c *responseCache) remove(element *list.Element) {
+	entry := c.lru.Remove(element).(*cacheEntry)
+	delete(c.entries, entry.key)
+	c.size -= entry.size
+}
+
+// entryFor builds the entry of a response, it returns nil if the response
+// can't be stored.
+func (c *responseCache) entryFor(key string, recorder *cacheRecorder) *cacheEntry {
+	if recorder.status == 0 {
+		// The app didn't write anything
+		recorder.status = http.StatusOK
+		recorder.header = recorder.Header().Clone()
+	}
+	if recorder.overflow {
+		return nil
+	}
+	header := recorder.header
+	seconds, ok := c.storable(recorder.status, recorder.Header())
+	if !ok {
+		return nil
+	}
+
+	body := bytes.Clone(recorder.body.Bytes())
+	size := int64(len(key) + len(body))
+	for name, values := range header {
+		size += int64(len(name))
+		for _, value := range values {
+			size += int64(len(value))
+		}
+	}
+	now := c.now()
+	return &cacheEntry{
+		key:     key,
+		status:  recorder.status,
+		header:  header,
+		body:    body,
+		size:    size,
+		stored:  now,
+		expires: now.Add(time.Duration(seconds) * time.Second),
+	}
+}
+
+// storable tells if a response with status and header can be stored, and
+// for how many seconds. The header of the ResponseWriter is checked, which
+// also has the trailers that the app set.
+func (c *responseCache) storable(status int, header http.Header) (int, bool) {
+	if !cacheableStatus[status] || header.Get("Set-Cookie") != "" {
+		return 0, false
+	}
+	// Trailers are set after the body, the copy doesn't have them
+	for name := range header {
+		if name == "Trailer" || strings.HasPrefix(name, http.TrailerPrefix) {
+			return 0, false
+		}
+	}
+	cache_control := header.Values("Cache-Control")
+	for _, directive := range []string{"no-store", "no-cache", "private"} {
+		if _, ok := cacheDirective(cache_control, directive); ok {
+			return 0, false
+		}
+	}
+	max_age, ok := cacheDirective(cache_control, "s-maxage")
+	if !ok {
+		max_age, ok = cacheDirective(cache_control, "max-age")
+	}
+	seconds, err := strconv.Atoi(max_age)
+	if !ok || err != nil || seconds <= 0 {
+		return 0, false
+	}
+	// Responses that vary on headers that aren't part of the key can't be
+	// shared
+	for _, value := range header.Values("Vary") {
+		for _, name := range strings.Split(value, ",") {
+			name = http.CanonicalHeaderKey(strings.TrimSpace(name))
+			if name == "" {
+				continue
+			}
+			if name == "*" || !c.varies(name) {
+				return 0, false
+			}
+		}
+	}
+	return seconds, true
+}
+
+func (c *responseCache) varies(name string) bool {
+	for _, vary := range c.vary {
+		if vary == name {
+			return true
+		}
+	}
+	return false
+}
+
+// write sends a stored response, entries are never modified so they are
+// shared by concurrent hits.
+func (c *responseCache) write(w http.ResponseWriter, r *http.Request, entry *cacheEntry) {
+	response_header := w.Header()
+	for name, values := range entry.header {
+		response_header[name] = values
+	}
+	response_header.Set("Age", strconv.Itoa(int(c.now().Sub(entry.stored).Seconds())))
+	w.WriteHeader(entry.status)
+	if r.Method != http.MethodHead {
+		w.Write(entry.body)
+	}
+}
+
+// cacheDirective finds a directive in the values of a Cache-Control header,
+// it returns its argument without quotes.
+func cacheDirective(values []string, name string) (string, bool) {
+	for _, value := range values {
+		for _, directive := range strings.Split(value, ",") {
+			directive = strings.TrimSpace(directive)
+			directive_name, argument, _ := strings.Cut(directive, "=")
+			if strings.EqualFold(directive_name, name) {
+				return strings.Trim(argument, `"`), true
+			}
+		}
+	}
+	return "", false
+}
+
+// cacheRecorder passes a response through to the client and keeps a copy of
+// it. Bodies bigger than limit aren't kept.
+type cacheRecorder struct {
+	http.ResponseWriter
+	status   int
+	header   http.Header
+	body     bytes.Buffer
+	limit    int64
+	overflow bool
+	// fill is the miss of key that the response serves. abandoned is set
+	// when the response turns out not to be storable and the fill was
+	// finished before the response.
+	cache     *responseCache
+	key       string
+	fill      *cacheFill
+	abandoned bool
+}
+
+func (r *cacheRecorder) WriteHeader(status int) {
+	// Informational responses are sent before the final one
+	if r.status == 0 && status >= 200 {
+		r.status = status
+		r.header = r.ResponseWriter.Header().Clone()
+		if length, err := strconv.ParseInt(r.header.Get("Content-Length"), 10, 64); err == nil && length > r.limit {
+			r.overflow = true
+		}
+		if _, ok := r.cache.storable(status, r.header); !ok {
+			r.overflow = true
+		}
+		if r.overflow {
+			r.abandon()
+		}
+	}
+	r.ResponseWriter.WriteHeader(status)
+}
+
+// abandon stops keeping a copy of the response, the requests that wait for
+// it are sent to the app.
+func (r *cacheRecorder) abandon() {
+	if r.abandoned {
+		return
+	}
+	r.abandoned = true
+	r.cache.finishFill(r.key, r.fill, nil)
+}
+
+func (r *cacheRecorder) Write(b []byte) (int, error) {
+	if r.status == 0 {
+		r.WriteHeader(http.StatusOK)
+	}
+	if !r.overflow {
+		if int64(r.body.Len()+len(b)) > r.limit {
+			r.overflow = true
+			r.body = bytes.Buffer{}
+			r.abandon()
+		} else {
+			r.body.Write(b)
+		}
+	}
+	return r.ResponseWriter.Write(b)
+}
+
+// ReadFrom keeps sending files with sendfile when they are too big to be
+// stored.
+func (r *cacheRecorder) ReadFrom(src io.Reader) (int64, error) {
+	if r.status == 0 {
+		r.WriteHeader(http.StatusOK)
+	}
+	if from, ok := r.ResponseWriter.(io.ReaderFrom); ok && r.overflow {
+		return from.ReadFrom(src)
+	}
+	return io.Copy(struct{ io.Writer }{r}, src)
+}
+
+func (r *cacheRecorder) Flush() {
+	if f, ok := r.ResponseWriter.(http.Flusher); ok {
+		f.Flush()
+	}
+}
+
+// Push lets apps push resources of responses that go through the cache.
+func (r *cacheRecorder) Push(target string, opts *http.PushOptions) error {
+	if pusher, ok := r.ResponseWriter.(http.Pusher); ok {
+		return pusher.Push(target, opts)
+	}
+	return http.ErrNotSupported
+}
+
+func (r *cacheRecorder) Unwrap() http.ResponseWriter {
+	return r.ResponseWriter
+}
@@ -0,0 +1,271 @@
+package caddysnake
+
+import (
+	"errors"
+	"net/http"
+	"net/http/httptest"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"testing"
+	"time"
+)
+
+func cacheGet(t *testing.T, c *responseCache, handler func(http.ResponseWriter, *http.Request) error, target string, header http.Header) *httptest.ResponseRecorder {
+	t.Helper()
+	r := httptest.NewRequest("GET", target, nil)
+	for name, values := range header {
+		r.Header[name] = values
+	}
+	w := httptest.NewRecorder()
+	if err := c.serve(w, r, handler); err != nil {
+		t.Fatal(err)
+	}
+	return w
+}
+
+func TestResponseCache(t *testing.T) {
+	var calls atomic.Int64
+	handler := func(w http.ResponseWriter, r *http.Request) error {
+		calls.Add(1)
+		switch r.URL.Path {
+		case "/public":
+			w.Header().Set("Cache-Control", "public, max-age=60")
+		case "/shared":
+			w.Header().Set("Cache-Control", "max-age=0, s-maxage=60")
+		case "/no-store":
+			w.Header().Set("Cache-Control", "no-store, max-age=60")
+		case "/private":
+			w.Header().Set("Cache-Control", "private, max-age=60")
+		case "/cookie":
+			w.Header().Set("Cache-Control", "max-age=60")
+			w.Header().Set("Set-Cookie", "a=b")
+		case "/vary":
+			w.Header().Set("Cache-Control", "max-age=60")
+			w.Header().Set("Vary", "Accept-Language")
+		case "/vary-other":
+			w.Header().Set("Cache-Control", "max-age=60")
+			w.Header().Set("Vary", "Accept-Encoding")
+		case "/error":
+			w.Header().Set("Cache-Control", "max-age=60")
+			w.WriteHeader(http.StatusInternalServerError)
+		case "/trailers":
+			w.Header().Set("Cache-Control", "max-age=60")
+			defer w.Header().Set(http.TrailerPrefix+"Grpc-Status", "0")
+		}
+		w.Write([]byte(r.URL.Path + " " + r.Header.Get("Accept-Language")))
+		return nil
+	}
+	now := time.Now()
+	c := newResponseCache(1<<20, []string{"accept-language"})
+	c.now = func() time.Time { return now }
+
+	for _, test := range []struct {
+		path   string
+		cached bool
+	}{
+		{"/public", true},
+		{"/shared", true},
+		{"/vary", true},
+		{"/no-store", false},
+		{"/private", false},
+		{"/cookie", false},
+		{"/vary-other", false},
+		{"/error", false},
+		{"/trailers", false},
+		{"/none", false},
+	} {
+		calls.Store(0)
+		first := cacheGet(t, c, handler, test.path, nil)
+		second := cacheGet(t, c, handler, test.path, nil)
+		if first.Body.String() != second.Body.String() || first.Code != second.Code {
+			t.Errorf("%s: different responses %q and %q", test.path, first.Body, second.Body)
+		}
+		expected := int64(2)
+		if test.cached {
+			expected = 1
+		}
+		if calls.Load() != expected {
+			t.Errorf("%s: expected %d calls, got %d", test.path, expected, calls.Load())
+		}
+	}
+
+	calls.Store(0)
+	es := cacheGet(t, c, handler, "/vary", http.Header{"Accept-Language": {"es"}})
+	if es.Body.String() != "/vary es" || calls.Load() != 1 {
+		t.Errorf("expected a separate entry for each Accept-Language, got %q", es.Body)
+	}
+	if w := cacheGet(t, c, handler, "/public?page=2", nil); calls.Load() != 2 || w.Body.String() != "/public " {
+		t.Errorf("expected the query to be part of the key")
+	}
+	if w := cacheGet(t, c, handler, "/public", http.Header{"Cache-Control": {"no-cache"}}); calls.Load() != 3 || w.Header().Get("Age") != "" {
+		t.Errorf("expected no-cache requests to reach the app")
+	}
+	if w := cacheGet(t, c, handler, "/public", http.Header{"Authorization": {"Basic eA=="}}); calls.Load() != 4 || w.Header().Get("Age") != "" {
+		t.Errorf("expected requests with credentials to reach the app")
+	}
+
+	now = now.Add(30 * time.Second)
+	if w := cacheGet(t, c, handler, "/public", nil); w.Header().Get("Age") != "30" {
+		t.Errorf("expected Age 30, got %q", w.Header().Get("Age"))
+	}
+	now = now.Add(31 * time.Second)
+	cacheGet(t, c, handler, "/public", nil)
+	if calls.Load() != 5 {
+		t.Errorf("expected expired entries to reach the app")
+	}
+}
+
+func TestResponseCacheEviction(t *testing.T) {
+	var calls atomic.Int64
+	handler := func(w http.ResponseWriter, r *http.Request) error {
+		calls.Add(1)
+		w.Header().Set("Cache-Control", "max-age=60")
+		w.Write([]byte(strings.Repeat("x", 100)))
+		return nil
+	}
+	c := newResponseCache(1000, nil)
+	for _, path := range []string{"/a", "/b", "/c", "/d", "/e", "/f", "/g", "/h", "/i", "/j", "/a"} {
+		cacheGet(t, c, handler, path, nil)
+	}
+	if c.size > c.max_size {
+		t.Errorf("cache is over its size: %d", c.size)
+	}
+	// /a was evicted before it was requested again
+	if calls.Load() != 11 {
+		t.Errorf("expected 11 calls, got %d", calls.Load())
+	}
+
+	calls.Store(0)
+	big := func(w http.ResponseWriter, r *http.Request) error {
+		calls.Add(1)
+		w.Header().Set("Cache-Control", "max-age=60")
+		w.Write([]byte(strings.Repeat("x", 200)))
+		return nil
+	}
+	cacheGet(t, c, big, "/big", nil)
+	cacheGet(t, c, big, "/big", nil)
+	if calls.Load() != 2 {
+		t.Errorf("expected responses bigger than an eighth of the cache to not be stored")
+	}
+}
+
+func TestResponseCacheCoalescing(t *testing.T) {
+	var calls atomic.Int64
+	release := make(chan struct{})
+	handler := func(w http.ResponseWriter, r *http.Request) error {
+		calls.Add(1)
+		<-release
+		w.Header().Set("Cache-Control", "max-age=60")
+		w.Write([]byte("slow"))
+		return nil
+	}
+	c := newResponseCache(1<<20, nil)
+	var wg sync.WaitGroup
+	for i := 0; i < 10; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			if w := cacheGet(t, c, handler, "/slow", nil); w.Body.String() != "slow" {
+				t.Errorf("unexpected body %q", w.Body)
+			}
+		}()
+	}
+	time.Sleep(50 * time.Millisecond)
+	close(release)
+	wg.Wait()
+	if calls.Load() != 1 {
+		t.Errorf("expected one call for concurrent misses, got %d", calls.Load())
+	}
+}
+
+func TestResponseCacheCoalescingUncacheable(t *testing.T) {
+	for _, path := range []string{"/stream", "/big"} {
+		var calls atomic.Int64
+		started := make(chan struct{})
+		release := make(chan struct{})
+		handler := func(w http.ResponseWriter, r *http.Request) error {
+			first := calls.Add(1) == 1
+			if r.URL.Path == "/big" {
+				w.Header().Set("Cache-Control", "max-age=60")
+				w.Write([]byte(strings.Repeat("x", 200)))
+			} else {
+				w.Header().Set("Content-Type", "text/event-stream")
+				w.WriteHeader(http.StatusOK)
+			}
+			if first {
+				// The leader keeps streaming after its headers
+				close(started)
+				<-release
+			}
+			return nil
+		}
+		c := newResponseCache(1000, nil)
+		leader := make(chan struct{})
+		go func() {
+			defer close(leader)
+			cacheGet(t, c, handler, path, nil)
+		}()
+		<-started
+
+		var wg sync.WaitGroup
+		for i := 0; i < 5; i++ {
+			wg.Add(1)
+			go func() {
+				defer wg.Done()
+				cacheGet(t, c, handler, path, nil)
+			}()
+		}
+		waiters := make(chan struct{})
+		go func() {
+			wg.Wait()
+			close(waiters)
+		}()
+		select {
+		case <-waiters:
+		case <-time.After(time.Second):
+			t.Errorf("%s: requests waited for a response that can't be stored", path)
+		}
+		close(release)
+		<-leader
+		<-waiters
+		if calls.Load() != 6 {
+			t.Errorf("%s: expected 6 calls, got %d", path, calls.Load())
+		}
+		if len(c.inflight) != 0 {
+			t.Errorf("%s: expected no misses in flight", path)
+		}
+	}
+}
+
+type pushRecorder struct {
+	*httptest.ResponseRecorder
+	pushed []string
+}
+
+func (w *pushRecorder) Push(target string, opts *http.PushOptions) error {
+	w.pushed = append(w.pushed, target)
+	return nil
+}
+
+func TestResponseCachePush(t *testing.T) {
+	handler := func(w http.ResponseWriter, r *http.Request) error {
+		pusher, ok := w.(http.Pusher)
+		if !ok {
+			return errors.New("expected a pusher")
+		}
+		return pusher.Push("/style.css", nil)
+	}
+	c := newResponseCache(1<<20, nil)
+	w := &pushRecorder{ResponseRecorder: httptest.NewRecorder()}
+	if err := c.serve(w, httptest.NewRequest("GET", "/", nil), handler); err != nil {
+		t.Fatal(err)
+	}
+	if len(w.pushed) != 1 || w.pushed[0] != "/style.css" {
+		t.Errorf("expected the push to reach the client, got %v", w.pushed)
+	}
+	// Writers that can't push report it
+	if err := c.serve(httptest.NewRecorder(), httptest.NewRequest("GET", "/other", nil), handler); !errors.Is(err, http.ErrNotSupported) {
+		t.Errorf("expected ErrNotSupported, got %v", err)
+	}
+}
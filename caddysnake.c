@@ -1,68 +1,326 @@
 #include "caddysnake.h"
 #include <Python.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #if PY_MAJOR_VERSION != 3 || PY_MINOR_VERSION < 10 || PY_MINOR_VERSION > 13
 #error "This code requires Python 3.10, 3.11, 3.12 or 3.13"
 #endif
 
+// Sub-interpreters with their own GIL are available since Python 3.12
+#if PY_VERSION_HEX >= 0x030C0000
+#define CADDYSNAKE_SUBINTERPRETERS
+#endif
+
+// Critical sections lock an object in the free-threaded build and do nothing
+// when there's a GIL. They are part of the API since Python 3.13.
+#ifndef Py_BEGIN_CRITICAL_SECTION
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
+#endif
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+// Nanoseconds of a monotonic clock, used to time the stages of requests.
+static int64_t monotonic_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Times that requests took the GIL in the bridge, either to call into Python
+// or coming back from a callback into Go. The benchmarks report it per
+// request, the acquisitions that Python does on its own aren't counted.
+static atomic_uint_fast64_t gil_acquisitions;
+
+static void count_gil_acquisition(void) {
+  atomic_fetch_add_explicit(&gil_acquisitions, 1, memory_order_relaxed);
+}
+
+// Names used by most requests, their Python objects are created once and
+// reused. Each table must be sorted, names are looked up with bsearch.
+static const char *const environ_key_names[] = {
+    "CONTENT_LENGTH",
+    "CONTENT_TYPE",
+    "HTTP_ACCEPT",
+    "HTTP_ACCEPT_ENCODING",
+    "HTTP_ACCEPT_LANGUAGE",
+    "HTTP_AUTHORIZATION",
+    "HTTP_CACHE_CONTROL",
+    "HTTP_CONNECTION",
+    "HTTP_COOKIE",
+    "HTTP_HOST",
+    "HTTP_IF_MODIFIED_SINCE",
+    "HTTP_IF_NONE_MATCH",
+    "HTTP_ORIGIN",
+    "HTTP_REFERER",
+    "HTTP_USER_AGENT",
+    "HTTP_X_FORWARDED_FOR",
+    "HTTP_X_FORWARDED_HOST",
+    "HTTP_X_FORWARDED_PROTO",
+    "HTTP_X_REAL_IP",
+    "HTTP_X_REQUEST_ID",
+    "PATH_INFO",
+    "QUERY_STRING",
+    "REQUEST_METHOD",
+    "SCRIPT_NAME",
+    "SERVER_NAME",
+    "SERVER_PORT",
+    "SERVER_PROTOCOL",
+    "X_FROM",
+    "wsgi.errors",
+    "wsgi.file_wrapper",
+    "wsgi.input",
+    "wsgi.multiprocess",
+    "wsgi.multithread",
+    "wsgi.run_once",
+    "wsgi.url_scheme",
+    "wsgi.version",
+};
+
+// Values of the environ and the scope, like methods, protocols and schemes
+static const char *const value_names[] = {
+    "",
+    "1.0",
+    "1.1",
+    "2.0",
+    "443",
+    "80",
+    "DELETE",
+    "GET",
+    "HEAD",
+    "HTTP/1.0",
+    "HTTP/1.1",
+    "HTTP/2.0",
+    "OPTIONS",
+    "PATCH",
+    "POST",
+    "PUT",
+    "caddy-snake",
+    "http",
+    "https",
+    "websocket",
+    "ws",
+    "wss",
+};
+
+static const char *const scope_key_names[] = {
+    "asgi",
+    "client",
+    "extensions",
+    "headers",
+    "http_version",
+    "method",
+    "path",
+    "query_string",
+    "raw_path",
+    "root_path",
+    "scheme",
+    "server",
+    "state",
+    "subprotocols",
+    "type",
+};
+
+// ASGI header names are lowercase bytes
+static const char *const header_names[] = {
+    "accept",
+    "accept-encoding",
+    "accept-language",
+    "authorization",
+    "cache-control",
+    "connection",
+    "content-length",
+    "content-type",
+    "cookie",
+    "host",
+    "if-modified-since",
+    "if-none-match",
+    "origin",
+    "referer",
+    "sec-websocket-extensions",
+    "sec-websocket-key",
+    "sec-websocket-protocol",
+    "sec-websocket-version",
+    "upgrade",
+    "user-agent",
+    "x-forwarded-for",
+    "x-forwarded-host",
+    "x-forwarded-proto",
+    "x-real-ip",
+    "x-request-id",
+};
+
+// WsgiState holds the objects used to serve WSGI apps. Objects can't be
+// shared between interpreters, so each interpreter has its own.
+typedef struct {
+  PyObject *wsgi_version;
+  PyObject *sys_stderr;
+  PyObject *BytesIO;
+  PyObject *wsgi_setup;
+  PyObject *response_callback_fn;
+  PyTypeObject *ResponseType;
+  PyTypeObject *WsgiInputType;
+  PyTypeObject *FileWrapperType;
+  // Holds the entries that are the same for every request
+  PyObject *environ_template;
+  PyObject *environ_keys[ARRAY_SIZE(environ_key_names)];
+  PyObject *environ_values[ARRAY_SIZE(value_names)];
+} WsgiState;
+
+typedef struct WsgiTask WsgiTask;
+
 struct WsgiApp {
   PyObject *handler;
+  PyObject *task_queue_put;
+  PyObject *threads;
+  size_t workers;
+  WsgiState *state;
+  uint8_t subinterpreter;
+#ifdef CADDYSNAKE_SUBINTERPRETERS
+  pthread_t owner;
+  pthread_mutex_t lock;
+  pthread_cond_t tasks_ready;
+  pthread_cond_t state_changed;
+  WsgiTask *tasks_head;
+  WsgiTask *tasks_tail;
+  // 1 while the app is loading, then 0 or -1 on failure
+  int load_result;
+  uint8_t closing;
+#endif
 };
 
+// Global variables are written once by Py_init_and_release_gil and only read
+// afterwards, so they are safe to use without a GIL.
+
 // WSGI: global variables
-static PyObject *wsgi_version;
-static PyObject *sys_stderr;
-static PyObject *BytesIO;
-static PyObject *task_queue_put;
+static WsgiState main_wsgi_state;
+static char *caddysnake_setup_py;
 
 // ASGI: global variables
 static PyObject *asgi_version;
-static PyObject *asyncio_Event_ts;
-static PyObject *asyncio_Loop;
 static PyObject *asyncio_run_coroutine_threadsafe;
 static PyObject *build_receive;
 static PyObject *build_send;
 static PyObject *build_lifespan;
+static PyObject *start_loop;
 static PyObject *websocket_closed;
+static PyObject *scope_keys[ARRAY_SIZE(scope_key_names)];
+static PyObject *scope_values[ARRAY_SIZE(value_names)];
+static PyObject *scope_header_names[ARRAY_SIZE(header_names)];
+
+// PROFILE: helpers of caddysnake_setup_profiler. profile_stop is set when a
+// profile starts, profiles run one at a time.
+static PyObject *profile_start;
+static PyObject *profile_stop;
+static PyObject *profiled;
+static PyObject *profile_threads;
+static atomic_int profiling;
+
+// RELOAD: helper of caddysnake_setup_reload
+static PyObject *forget_modules;
+
+static int compare_names(const void *name, const void *item) {
+  return strcmp(name, *(const char *const *)item);
+}
 
-char *concatenate_strings(const char *str1, const char *str2) {
-  size_t new_str_len = strlen(str1) + strlen(str2) + 1;
-  char *result = malloc(new_str_len * sizeof(char));
-  if (result == NULL) {
-    return NULL;
+// Creates the objects of a table of names, returns -1 on failure.
+static int NameCache_init(const char *const *names, size_t count,
+                          PyObject **objects,
+                          PyObject *(*create)(const char *)) {
+  for (size_t i = 0; i < count; i++) {
+    objects[i] = create(names[i]);
+    if (objects[i] == NULL) {
+      return -1;
+    }
   }
-  strcpy(result, str1);
-  strcat(result, str2);
-  return result;
+  return 0;
 }
 
-char *concatenate_bytes(const char *buffer1, size_t size1, const char *buffer2,
-                        size_t size2, size_t *out_size) {
-  if (buffer1 == NULL || buffer2 == NULL || out_size == NULL) {
-    return NULL;
+// Returns a new reference to the cached object of name, or a new object made
+// with create when the name isn't in the table.
+static PyObject *NameCache_get(const char *const *names, size_t count,
+                               PyObject *const *objects,
+                               PyObject *(*create)(const char *, Py_ssize_t),
+                               const char *name, size_t size) {
+  const char *const *found =
+      bsearch(name, names, count, sizeof(char *), compare_names);
+  // Names that contain a NUL byte only match up to it
+  if (found == NULL || strlen(*found) != size) {
+    return create(name, size);
   }
-  size_t total_size = size1 + size2;
-  char *result = (char *)malloc(total_size);
-  if (result == NULL) {
-    return NULL;
+  PyObject *object = objects[found - names];
+  Py_INCREF(object);
+  return object;
+}
+
+// Decodes strings of the environ and the scope. Header values that are not
+// valid UTF-8 are decoded as ISO-8859-1 like PEP 3333 does, instead of
+// failing the request.
+static PyObject *decode_string(const char *data, Py_ssize_t size) {
+  PyObject *result = PyUnicode_DecodeUTF8(data, size, NULL);
+  if (result == NULL && PyErr_ExceptionMatches(PyExc_UnicodeDecodeError)) {
+    PyErr_Clear();
+    result = PyUnicode_DecodeLatin1(data, size, NULL);
   }
-  memcpy(result, buffer1, size1);
-  memcpy(result + size1, buffer2, size2);
-  *out_size = total_size;
   return result;
 }
 
-char *copy_pystring(PyObject *pystr) {
+static PyObject *environ_key(WsgiState *state, const char *name, size_t size) {
+  return NameCache_get(environ_key_names, ARRAY_SIZE(environ_key_names),
+                       state->environ_keys, decode_string, name, size);
+}
+
+static PyObject *environ_value(WsgiState *state, const char *value,
+                               size_t size) {
+  return NameCache_get(value_names, ARRAY_SIZE(value_names),
+                       state->environ_values, decode_string, value, size);
+}
+
+static PyObject *scope_key(const char *name) {
+  return NameCache_get(scope_key_names, ARRAY_SIZE(scope_key_names),
+                       scope_keys, decode_string, name, strlen(name));
+}
+
+static PyObject *scope_value(const char *value, size_t size) {
+  return NameCache_get(value_names, ARRAY_SIZE(value_names), scope_values,
+                       decode_string, value, size);
+}
+
+static PyObject *header_name(const char *name, size_t size) {
+  return NameCache_get(header_names, ARRAY_SIZE(header_names),
+                       scope_header_names, PyBytes_FromStringAndSize, name,
+                       size);
+}
+
+static void scope_set_item(PyObject *scope, const char *name,
+                           PyObject *value) {
+  PyObject *key = scope_key(name);
+  PyDict_SetItem(scope, key, value);
+  Py_DECREF(key);
+}
+
+// Copies the UTF-8 encoding of a string, size gets its length when it's not
+// NULL. The string can contain NUL characters.
+char *copy_pystring(PyObject *pystr, size_t *size) {
   Py_ssize_t og_size = 0;
   const char *og_str = PyUnicode_AsUTF8AndSize(pystr, &og_size);
-  size_t new_str_len = og_size + 1;
-  char *result = malloc(new_str_len * sizeof(char));
+  if (og_str == NULL) {
+    return NULL;
+  }
+  char *result = malloc((og_size + 1) * sizeof(char));
   if (result == NULL) {
     return NULL;
   }
-  strcpy(result, og_str);
+  memcpy(result, og_str, og_size + 1);
+  if (size) {
+    *size = (size_t)og_size;
+  }
   return result;
 }
 
@@ -83,12 +341,94 @@ char *copy_pybytes(PyObject *pybytes, size_t *size) {
   return result;
 }
 
-MapKeyVal *MapKeyVal_new(size_t count) {
-  MapKeyVal *new_map = (MapKeyVal *)malloc(sizeof(MapKeyVal));
-  new_map->count = count;
-  new_map->keys = malloc(sizeof(char *) * count);
-  new_map->values = malloc(sizeof(char *) * count);
-  return new_map;
+// Allocates a map of count pairs with room for data_size bytes of keys and
+// values, not counting their terminators.
+MapKeyVal *MapKeyVal_new(size_t count, size_t data_size) {
+  size_t size = sizeof(MapKeyVal) + count * (2 * sizeof(char *)) +
+                count * (2 * sizeof(size_t)) + data_size + 2 * count;
+  MapKeyVal *map = malloc(size);
+  if (map == NULL) {
+    return NULL;
+  }
+  map->count = count;
+  map->keys = (char **)(map + 1);
+  map->values = map->keys + count;
+  map->key_sizes = (size_t *)(map->values + count);
+  map->value_sizes = map->key_sizes + count;
+  map->data = (char *)(map->value_sizes + count);
+  return map;
+}
+
+// Copies the pair at position i, pairs have to be set in order.
+void MapKeyVal_set(MapKeyVal *map, size_t i, const char *key, size_t key_size,
+                   const char *value, size_t value_size) {
+  map->keys[i] = map->data;
+  map->key_sizes[i] = key_size;
+  memcpy(map->data, key, key_size);
+  map->data[key_size] = '\0';
+  map->data += key_size + 1;
+
+  map->values[i] = map->data;
+  map->value_sizes[i] = value_size;
+  memcpy(map->data, value, value_size);
+  map->data[value_size] = '\0';
+  map->data += value_size + 1;
+}
+
+static int pair_item(PyObject *item, uint8_t as_bytes, char **data,
+                     Py_ssize_t *size) {
+  if (as_bytes) {
+    return PyBytes_AsStringAndSize(item, data, size);
+  }
+  *data = (char *)PyUnicode_AsUTF8AndSize(item, size);
+  return *data == NULL ? -1 : 0;
+}
+
+// Packs a list or tuple of (key, value) pairs, which are str for WSGI and
+// bytes for ASGI. Returns NULL with an exception set when they are invalid.
+static MapKeyVal *MapKeyVal_from_pairs(PyObject *pairs, uint8_t as_bytes,
+                                       const char *error) {
+  PyObject *items = PySequence_Fast(pairs, error);
+  if (items == NULL) {
+    return NULL;
+  }
+  Py_ssize_t count = PySequence_Fast_GET_SIZE(items);
+  size_t data_size = 0;
+  char *key, *value;
+  Py_ssize_t key_size, value_size;
+  // Validate and measure the pairs first, then copy them
+  for (Py_ssize_t i = 0; i < count; i++) {
+    PyObject *pair = PySequence_Fast_GET_ITEM(items, i);
+    if ((!PyTuple_Check(pair) && !PyList_Check(pair)) ||
+        PySequence_Fast_GET_SIZE(pair) != 2) {
+      PyErr_SetString(PyExc_RuntimeError, error);
+      Py_DECREF(items);
+      return NULL;
+    }
+    if (pair_item(PySequence_Fast_GET_ITEM(pair, 0), as_bytes, &key,
+                  &key_size) < 0 ||
+        pair_item(PySequence_Fast_GET_ITEM(pair, 1), as_bytes, &value,
+                  &value_size) < 0) {
+      Py_DECREF(items);
+      return NULL;
+    }
+    data_size += key_size + value_size;
+  }
+  MapKeyVal *map = MapKeyVal_new(count, data_size);
+  if (map == NULL) {
+    Py_DECREF(items);
+    PyErr_NoMemory();
+    return NULL;
+  }
+  for (Py_ssize_t i = 0; i < count; i++) {
+    PyObject *pair = PySequence_Fast_GET_ITEM(items, i);
+    pair_item(PySequence_Fast_GET_ITEM(pair, 0), as_bytes, &key, &key_size);
+    pair_item(PySequence_Fast_GET_ITEM(pair, 1), as_bytes, &value,
+              &value_size);
+    MapKeyVal_set(map, i, key, key_size, value, value_size);
+  }
+  Py_DECREF(items);
+  return map;
 }
 
 typedef struct {
@@ -98,6 +438,9 @@ typedef struct {
   PyObject *response_headers;
   PyObject *response_body;
   int response_status;
+  RequestTimings timings;
+  // When the request was queued, then when its response started to be sent
+  int64_t stage_start;
 } RequestResponse;
 
 static void Debug_obj(PyObject *obj) {
@@ -116,15 +459,19 @@ static PyObject *Response_new(PyTypeObject *type, PyObject *args,
     self->response_headers = NULL;
     self->response_body = NULL;
     self->response_status = 500;
+    self->timings = (RequestTimings){0};
+    self->stage_start = 0;
   }
   return (PyObject *)self;
 }
 
 static void Response_dealloc(RequestResponse *self) {
+  PyTypeObject *type = Py_TYPE(self);
   Py_XDECREF(self->request_environ);
   Py_XDECREF(self->response_headers);
   Py_XDECREF(self->response_body);
-  Py_TYPE(self)->tp_free((PyObject *)self);
+  type->tp_free((PyObject *)self);
+  Py_DECREF(type);
 }
 
 static PyObject *Response_start(RequestResponse *self, PyObject *args) {
@@ -173,15 +520,52 @@ static PyObject *Response_start(RequestResponse *self, PyObject *args) {
   Py_RETURN_NONE;
 }
 
+// While a profile runs, the threads that serve WSGI requests in the main
+// interpreter are registered so their Python stacks are attributed to the
+// request.
+static void profile_thread_enter(RequestResponse *r) {
+  if (!atomic_load_explicit(&profiling, memory_order_relaxed) ||
+      r->app->state != &main_wsgi_state) {
+    return;
+  }
+  PyObject *thread = PyLong_FromUnsignedLong(PyThread_get_thread_ident());
+  PyObject *request = PyLong_FromLongLong(r->request_id);
+  if (!thread || !request || PyDict_SetItem(profile_threads, thread, request)) {
+    PyErr_Clear();
+  }
+  Py_XDECREF(thread);
+  Py_XDECREF(request);
+}
+
+static void profile_thread_exit(RequestResponse *r) {
+  if (!atomic_load_explicit(&profiling, memory_order_relaxed) ||
+      r->app->state != &main_wsgi_state) {
+    return;
+  }
+  PyObject *thread = PyLong_FromUnsignedLong(PyThread_get_thread_ident());
+  // The thread isn't found when the profile started during the request
+  if (!thread || PyDict_DelItem(profile_threads, thread)) {
+    PyErr_Clear();
+  }
+  Py_XDECREF(thread);
+}
+
 static PyObject *Response_call_wsgi(RequestResponse *self, PyObject *args) {
+  int64_t start = monotonic_ns();
+  profile_thread_enter(self);
+  if (self->stage_start != 0) {
+    self->timings.queue_wait = start - self->stage_start;
+  }
   PyObject *start_response_fn =
       PyObject_GetAttrString((PyObject *)self, "start_response");
   PyObject *new_args = PyTuple_New(2);
   PyTuple_SetItem(new_args, 0, self->request_environ);
   PyTuple_SetItem(new_args, 1, start_response_fn);
   self->response_body = PyObject_Call(self->app->handler, new_args, NULL);
+  self->timings.app = monotonic_ns() - start;
   Py_INCREF(self->request_environ);
   Py_DECREF(new_args);
+  Py_INCREF(self);
   return (PyObject *)self;
 }
 
@@ -193,252 +577,1258 @@ static PyMethodDef Response_methods[] = {
     {NULL} /* Sentinel */
 };
 
-static PyTypeObject ResponseType = {
-    .ob_base = PyVarObject_HEAD_INIT(NULL, 0).tp_name =
-        "caddysnake.RequestResponse",
-    .tp_doc = PyDoc_STR("Request RequestResponse object"),
-    .tp_basicsize = sizeof(RequestResponse),
-    .tp_itemsize = 0,
-    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
-    .tp_new = Response_new,
-    .tp_dealloc = (destructor)Response_dealloc,
-    .tp_methods = Response_methods,
+static PyType_Slot Response_slots[] = {
+    {Py_tp_doc, PyDoc_STR("Request RequestResponse object")},
+    {Py_tp_new, Response_new},
+    {Py_tp_dealloc, Response_dealloc},
+    {Py_tp_methods, Response_methods},
+    {0, NULL} /* Sentinel */
 };
 
-WsgiApp *WsgiApp_import(const char *module_name, const char *app_name,
-                        const char *venv_path) {
-  WsgiApp *app = malloc(sizeof(WsgiApp));
-  if (app == NULL) {
+static PyType_Spec ResponseType_spec = {
+    .name = "caddysnake.RequestResponse",
+    .basicsize = sizeof(RequestResponse),
+    .itemsize = 0,
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .slots = Response_slots,
+};
+
+// WsgiInput is the wsgi.input object used when the request body is streamed.
+// Data is pulled from the Go request body on demand with wsgi_read_body.
+typedef struct {
+  PyObject_HEAD int64_t request_id;
+  // Bytes left to read according to Content-Length, -1 if unknown
+  int64_t remaining;
+  // Data read ahead by readline that hasn't been consumed yet
+  char *buffer;
+  size_t buffer_capacity;
+  size_t buffer_start;
+  size_t buffer_end;
+  uint8_t eof;
+  uint8_t busy;
+} WsgiInput;
+
+#define WSGI_INPUT_CHUNK_SIZE (64 * 1024)
+
+static PyObject *WsgiInput_new(PyTypeObject *type, PyObject *args,
+                               PyObject *kwds) {
+  WsgiInput *self;
+  self = (WsgiInput *)type->tp_alloc(type, 0);
+  if (self != NULL) {
+    self->request_id = 0;
+    self->remaining = -1;
+    self->buffer = NULL;
+    self->buffer_capacity = 0;
+    self->buffer_start = 0;
+    self->buffer_end = 0;
+    self->eof = 0;
+    self->busy = 0;
+  }
+  return (PyObject *)self;
+}
+
+static void WsgiInput_dealloc(WsgiInput *self) {
+  PyTypeObject *type = Py_TYPE(self);
+  free(self->buffer);
+  type->tp_free((PyObject *)self);
+  Py_DECREF(type);
+}
+
+// Reads at most size bytes from the Go request body into buf. Returns the
+// amount of bytes read, 0 at the end of the body or -1 with an exception set.
+static Py_ssize_t WsgiInput_raw_read(WsgiInput *self, char *buf, size_t size) {
+  if (self->eof || size == 0) {
+    return 0;
+  }
+  if (self->remaining >= 0 && (int64_t)size > self->remaining) {
+    size = (size_t)self->remaining;
+  }
+  if (size == 0) {
+    self->eof = 1;
+    return 0;
+  }
+  int64_t n;
+  Py_BEGIN_ALLOW_THREADS n = wsgi_read_body(self->request_id, buf, size);
+  Py_END_ALLOW_THREADS count_gil_acquisition();
+  if (n < 0) {
+    PyErr_SetString(PyExc_OSError, "failed to read request body");
+    return -1;
+  }
+  if (n == 0) {
+    self->eof = 1;
+  }
+  if (self->remaining >= 0) {
+    self->remaining -= n;
+  }
+  return (Py_ssize_t)n;
+}
+
+// Marks the input as being read, the GIL is released while waiting for data
+// and another thread could try to read at the same time. Returns -1 with an
+// exception set when the input is already being read.
+static int WsgiInput_acquire(WsgiInput *self) {
+  uint8_t busy;
+  Py_BEGIN_CRITICAL_SECTION(self);
+  busy = self->busy;
+  self->busy = 1;
+  Py_END_CRITICAL_SECTION();
+  if (busy) {
+    PyErr_SetString(PyExc_RuntimeError,
+                    "concurrent reads of wsgi.input are not supported");
+    return -1;
+  }
+  return 0;
+}
+
+static void WsgiInput_release(WsgiInput *self) {
+  Py_BEGIN_CRITICAL_SECTION(self);
+  self->busy = 0;
+  Py_END_CRITICAL_SECTION();
+}
+
+// Moves up to size bytes of buffered data into dst, returns the amount moved.
+static size_t WsgiInput_take_buffered(WsgiInput *self, char *dst,
+                                      size_t size) {
+  size_t pending = self->buffer_end - self->buffer_start;
+  if (size > pending) {
+    size = pending;
+  }
+  memcpy(dst, self->buffer + self->buffer_start, size);
+  self->buffer_start += size;
+  return size;
+}
+
+// Reads size bytes or until the end of the body when size is negative. The
+// result starts with room for one chunk and grows as data arrives, so a
+// client that announces a large Content-Length can't make it allocate more
+// than it sends.
+static PyObject *WsgiInput_read_bytes(WsgiInput *self, Py_ssize_t size) {
+  size_t pending = self->buffer_end - self->buffer_start;
+  size_t capacity = pending + WSGI_INPUT_CHUNK_SIZE;
+  if (self->remaining >= 0 && self->remaining < WSGI_INPUT_CHUNK_SIZE) {
+    capacity = pending + (size_t)self->remaining;
+  }
+  if (size >= 0 && (size_t)size < capacity) {
+    capacity = (size_t)size;
+  }
+  PyObject *result = PyBytes_FromStringAndSize(NULL, capacity);
+  if (result == NULL) {
     return NULL;
   }
-  PyGILState_STATE gstate = PyGILState_Ensure();
+  size_t got = WsgiInput_take_buffered(self, PyBytes_AS_STRING(result),
+                                       capacity);
+  while (size < 0 || got < (size_t)size) {
+    if (got == capacity) {
+      if (self->eof || self->remaining == 0) {
+        break;
+      }
+      capacity *= 2;
+      if (capacity < WSGI_INPUT_CHUNK_SIZE) {
+        capacity = WSGI_INPUT_CHUNK_SIZE;
+      }
+      if (size >= 0 && capacity > (size_t)size) {
+        capacity = (size_t)size;
+      }
+      if (_PyBytes_Resize(&result, capacity) < 0) {
+        return NULL;
+      }
+    }
+    Py_ssize_t n = WsgiInput_raw_read(self, PyBytes_AS_STRING(result) + got,
+                                      capacity - got);
+    if (n < 0) {
+      Py_DECREF(result);
+      return NULL;
+    }
+    if (n == 0) {
+      break;
+    }
+    got += n;
+  }
+  if (got != capacity && _PyBytes_Resize(&result, got) < 0) {
+    return NULL;
+  }
+  return result;
+}
+
+static PyObject *WsgiInput_read(WsgiInput *self, PyObject *args) {
+  Py_ssize_t size = -1;
+  if (!PyArg_ParseTuple(args, "|n", &size)) {
+    return NULL;
+  }
+  if (WsgiInput_acquire(self) < 0) {
+    return NULL;
+  }
+  PyObject *result = WsgiInput_read_bytes(self, size);
+  WsgiInput_release(self);
+  return result;
+}
+
+static PyObject *WsgiInput_readline_size(WsgiInput *self, Py_ssize_t size) {
+  for (;;) {
+    size_t pending = self->buffer_end - self->buffer_start;
+    size_t limit = pending;
+    if (size >= 0 && (size_t)size < limit) {
+      limit = (size_t)size;
+    }
+    char *start = self->buffer + self->buffer_start;
+    char *newline = limit > 0 ? memchr(start, '\n', limit) : NULL;
+    if (newline != NULL || (size >= 0 && pending >= (size_t)size) ||
+        self->eof) {
+      size_t line_size = newline != NULL ? (size_t)(newline - start) + 1 : limit;
+      PyObject *line = PyBytes_FromStringAndSize(start, line_size);
+      self->buffer_start += line_size;
+      return line;
+    }
+    // Make room at the end of the buffer to read more data
+    if (self->buffer_start > 0) {
+      memmove(self->buffer, start, pending);
+      self->buffer_start = 0;
+      self->buffer_end = pending;
+    }
+    if (self->buffer_end == self->buffer_capacity) {
+      size_t capacity = self->buffer_capacity * 2;
+      if (capacity < WSGI_INPUT_CHUNK_SIZE) {
+        capacity = WSGI_INPUT_CHUNK_SIZE;
+      }
+      char *buffer = realloc(self->buffer, capacity);
+      if (buffer == NULL) {
+        return PyErr_NoMemory();
+      }
+      self->buffer = buffer;
+      self->buffer_capacity = capacity;
+    }
+    Py_ssize_t n =
+        WsgiInput_raw_read(self, self->buffer + self->buffer_end,
+                           self->buffer_capacity - self->buffer_end);
+    if (n < 0) {
+      return NULL;
+    }
+    self->buffer_end += n;
+  }
+}
 
-  // Add venv_path into sys.path list
-  if (venv_path) {
+static PyObject *WsgiInput_readline(WsgiInput *self, PyObject *args) {
+  Py_ssize_t size = -1;
+  if (!PyArg_ParseTuple(args, "|n", &size)) {
+    return NULL;
+  }
+  if (WsgiInput_acquire(self) < 0) {
+    return NULL;
+  }
+  PyObject *line = WsgiInput_readline_size(self, size);
+  WsgiInput_release(self);
+  return line;
+}
+
+static PyObject *WsgiInput_readlines_hint(WsgiInput *self, Py_ssize_t hint) {
+  PyObject *lines = PyList_New(0);
+  if (lines == NULL) {
+    return NULL;
+  }
+  Py_ssize_t total = 0;
+  for (;;) {
+    PyObject *line = WsgiInput_readline_size(self, -1);
+    if (line == NULL) {
+      Py_DECREF(lines);
+      return NULL;
+    }
+    Py_ssize_t line_size = PyBytes_GET_SIZE(line);
+    if (line_size == 0) {
+      Py_DECREF(line);
+      break;
+    }
+    PyList_Append(lines, line);
+    Py_DECREF(line);
+    total += line_size;
+    if (hint > 0 && total >= hint) {
+      break;
+    }
+  }
+  return lines;
+}
+
+static PyObject *WsgiInput_readlines(WsgiInput *self, PyObject *args) {
+  Py_ssize_t hint = -1;
+  if (!PyArg_ParseTuple(args, "|n", &hint)) {
+    return NULL;
+  }
+  if (WsgiInput_acquire(self) < 0) {
+    return NULL;
+  }
+  PyObject *lines = WsgiInput_readlines_hint(self, hint);
+  WsgiInput_release(self);
+  return lines;
+}
+
+static PyObject *WsgiInput_readinto(WsgiInput *self, PyObject *args) {
+  Py_buffer view;
+  if (!PyArg_ParseTuple(args, "w*", &view)) {
+    return NULL;
+  }
+  if (WsgiInput_acquire(self) < 0) {
+    PyBuffer_Release(&view);
+    return NULL;
+  }
+  size_t got = WsgiInput_take_buffered(self, view.buf, view.len);
+  if (got == 0) {
+    Py_ssize_t n = WsgiInput_raw_read(self, view.buf, view.len);
+    if (n < 0) {
+      WsgiInput_release(self);
+      PyBuffer_Release(&view);
+      return NULL;
+    }
+    got = n;
+  }
+  WsgiInput_release(self);
+  PyBuffer_Release(&view);
+  return PyLong_FromSize_t(got);
+}
+
+static PyObject *WsgiInput_iternext(WsgiInput *self) {
+  if (WsgiInput_acquire(self) < 0) {
+    return NULL;
+  }
+  PyObject *line = WsgiInput_readline_size(self, -1);
+  WsgiInput_release(self);
+  if (line != NULL && PyBytes_GET_SIZE(line) == 0) {
+    Py_DECREF(line);
+    return NULL;
+  }
+  return line;
+}
+
+static PyMethodDef WsgiInput_methods[] = {
+    {"read", (PyCFunction)WsgiInput_read, METH_VARARGS,
+     "Read up to size bytes, or the whole body if size is not given."},
+    {"readline", (PyCFunction)WsgiInput_readline, METH_VARARGS,
+     "Read one line of the body."},
+    {"readlines", (PyCFunction)WsgiInput_readlines, METH_VARARGS,
+     "Read the remaining lines of the body."},
+    {"readinto", (PyCFunction)WsgiInput_readinto, METH_VARARGS,
+     "Read bytes into a writable buffer."},
+    {NULL} /* Sentinel */
+};
+
+static PyType_Slot WsgiInput_slots[] = {
+    {Py_tp_doc, PyDoc_STR("Streaming WSGI request body")},
+    {Py_tp_new, WsgiInput_new},
+    {Py_tp_dealloc, WsgiInput_dealloc},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, WsgiInput_iternext},
+    {Py_tp_methods, WsgiInput_methods},
+    {0, NULL} /* Sentinel */
+};
+
+static PyType_Spec WsgiInputType_spec = {
+    .name = "caddysnake.WsgiInput",
+    .basicsize = sizeof(WsgiInput),
+    .itemsize = 0,
+    .flags = Py_TPFLAGS_DEFAULT,
+    .slots = WsgiInput_slots,
+};
+
+// FileWrapper is the wsgi.file_wrapper type. When a file wrapper is returned as
+// the response body the file descriptor is handed to Go, so the file is sent
+// without going through Python. Otherwise it iterates over the file in blocks.
+typedef struct {
+  PyObject_HEAD PyObject *filelike;
+  Py_ssize_t blksize;
+} FileWrapper;
+
+static PyObject *FileWrapper_new(PyTypeObject *type, PyObject *args,
+                                 PyObject *kwds) {
+  PyObject *filelike;
+  Py_ssize_t blksize = 8192;
+  if (!PyArg_ParseTuple(args, "O|n", &filelike, &blksize)) {
+    return NULL;
+  }
+  if (blksize <= 0) {
+    PyErr_SetString(PyExc_ValueError, "block size must be positive");
+    return NULL;
+  }
+  FileWrapper *self = (FileWrapper *)type->tp_alloc(type, 0);
+  if (self != NULL) {
+    Py_INCREF(filelike);
+    self->filelike = filelike;
+    self->blksize = blksize;
+  }
+  return (PyObject *)self;
+}
+
+static void FileWrapper_dealloc(FileWrapper *self) {
+  PyTypeObject *type = Py_TYPE(self);
+  Py_XDECREF(self->filelike);
+  type->tp_free((PyObject *)self);
+  Py_DECREF(type);
+}
+
+static PyObject *FileWrapper_iternext(FileWrapper *self) {
+  PyObject *data = PyObject_CallMethod(self->filelike, "read", "n",
+                                       self->blksize);
+  if (data == NULL) {
+    return NULL;
+  }
+  if (PyObject_Length(data) <= 0) {
+    Py_DECREF(data);
+    return NULL;
+  }
+  return data;
+}
+
+static PyObject *FileWrapper_close(FileWrapper *self, PyObject *args) {
+  if (PyObject_HasAttrString(self->filelike, "close")) {
+    return PyObject_CallMethod(self->filelike, "close", NULL);
+  }
+  Py_RETURN_NONE;
+}
+
+static PyMethodDef FileWrapper_methods[] = {
+    {"close", (PyCFunction)FileWrapper_close, METH_NOARGS,
+     "Close the wrapped file."},
+    {NULL} /* Sentinel */
+};
+
+static PyType_Slot FileWrapper_slots[] = {
+    {Py_tp_doc, PyDoc_STR("WSGI file wrapper")},
+    {Py_tp_new, FileWrapper_new},
+    {Py_tp_dealloc, FileWrapper_dealloc},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, FileWrapper_iternext},
+    {Py_tp_methods, FileWrapper_methods},
+    {0, NULL} /* Sentinel */
+};
+
+static PyType_Spec FileWrapperType_spec = {
+    .name = "caddysnake.FileWrapper",
+    .basicsize = sizeof(FileWrapper),
+    .itemsize = 0,
+    .flags = Py_TPFLAGS_DEFAULT,
+    .slots = FileWrapper_slots,
+};
+
+static int WsgiState_init(WsgiState *state);
+
+// Where an app is imported from and what is prepared before it
+typedef struct {
+  const char *module_name;
+  const char *app_name;
+  const char *venv_path;
+  // Comma separated modules that are imported before the app, or NULL
+  const char *preload;
+  // Directory of the bytecode cache, NULL keeps it next to the sources
+  const char *pycache_prefix;
+} AppImport;
+
+// Prepares the current interpreter to import an app: adds the venv to
+// sys.path, sets the bytecode cache and imports the preload modules.
+// Returns -1 on failure, the GIL must be held.
+static int AppImport_prepare(const AppImport *import) {
+  // Add venv_path into sys.path list, once when the app is reloaded
+  if (import->venv_path) {
     PyObject *sysPath = PySys_GetObject("path");
-    PyList_Append(sysPath, PyUnicode_FromString(venv_path));
+    PyObject *path = PyUnicode_FromString(import->venv_path);
+    if (PySequence_Contains(sysPath, path) == 0) {
+      PyList_Append(sysPath, path);
+    }
+    Py_DECREF(path);
   }
 
-  PyObject *module = PyImport_ImportModule(module_name);
-  if (module == NULL) {
+  // A bytecode cache is written even with PYTHONDONTWRITEBYTECODE, which
+  // images set to keep bytecode out of their layers
+  if (import->pycache_prefix) {
+    PyObject *prefix = PyUnicode_FromString(import->pycache_prefix);
+    PySys_SetObject("pycache_prefix", prefix);
+    PySys_SetObject("dont_write_bytecode", Py_False);
+    Py_DECREF(prefix);
+  }
+
+  if (import->preload) {
+    char *modules = strdup(import->preload);
+    char *saveptr = NULL;
+    for (char *name = strtok_r(modules, ",", &saveptr); name != NULL;
+         name = strtok_r(NULL, ",", &saveptr)) {
+      PyObject *module = PyImport_ImportModule(name);
+      if (module == NULL) {
+        free(modules);
+        return -1;
+      }
+      Py_DECREF(module);
+    }
+    free(modules);
+  }
+  return 0;
+}
+
+static int WsgiApp_load(WsgiApp *app, const AppImport *import,
+                        PyObject *get_task);
+
+// Builds the request object of a WSGI call, the GIL of the interpreter of the
+// app must be held.
+static RequestResponse *WsgiApp_new_request(WsgiApp *app, int64_t request_id,
+                                            MapKeyVal *headers,
+                                            const char *body, size_t body_len,
+                                            uint8_t stream_body,
+                                            int64_t content_length) {
+  WsgiState *state = app->state;
+
+  PyObject *environ = PyDict_Copy(state->environ_template);
+  for (size_t i = 0; i < headers->count; i++) {
+    PyObject *key =
+        environ_key(state, headers->keys[i], headers->key_sizes[i]);
+    PyObject *value =
+        environ_value(state, headers->values[i], headers->value_sizes[i]);
+    PyDict_SetItem(environ, key, value);
+    Py_DECREF(key);
+    Py_DECREF(value);
+  }
+  PyObject *input_key = environ_key(state, "wsgi.input", 10);
+  if (stream_body) {
+    WsgiInput *input = (WsgiInput *)PyObject_CallObject(
+        (PyObject *)state->WsgiInputType, NULL);
+    input->request_id = request_id;
+    input->remaining = content_length;
+    PyDict_SetItem(environ, input_key, (PyObject *)input);
+    Py_DECREF(input);
+  } else {
+    // BytesIO shares the buffer of a bytes object until it gets modified,
+    // so the body is copied only once from Go memory into Python memory.
+    PyObject *bytes = PyBytes_FromStringAndSize(body, body_len);
+    PyObject *bytes_file = PyObject_CallOneArg(state->BytesIO, bytes);
+    PyDict_SetItem(environ, input_key, bytes_file);
+    Py_DECREF(bytes);
+    Py_DECREF(bytes_file);
+  }
+  Py_DECREF(input_key);
+
+  RequestResponse *r = (RequestResponse *)PyObject_CallObject(
+      (PyObject *)state->ResponseType, NULL);
+  r->app = app;
+  r->request_id = request_id;
+  r->request_environ = environ;
+  return r;
+}
+
+#ifdef CADDYSNAKE_SUBINTERPRETERS
+/*
+A sub-interpreter is owned by a thread that creates it, waits until the app is
+cleaned up and then ends it, so it stays the main thread of the interpreter.
+Threads of the Go runtime never run Python code in a sub-interpreter, requests
+are queued in C and picked up by the worker threads of the app with next_task.
+*/
+struct WsgiTask {
+  int64_t request_id;
+  MapKeyVal *headers;
+  size_t body_len;
+  uint8_t stream_body;
+  int64_t content_length;
+  int64_t queued;
+  WsgiTask *next;
+  // The body is copied after the task, Go memory can't be kept by C
+  char body[];
+};
+
+typedef struct {
+  WsgiApp *app;
+  const AppImport *import;
+} WsgiAppLoad;
+
+static void WsgiApp_set_load_result(WsgiApp *app, int result) {
+  pthread_mutex_lock(&app->lock);
+  app->load_result = result;
+  pthread_cond_broadcast(&app->state_changed);
+  pthread_mutex_unlock(&app->lock);
+}
+
+static PyObject *WsgiApp_next_task(PyObject *self, PyObject *args) {
+  WsgiApp *app = PyCapsule_GetPointer(self, NULL);
+  WsgiTask *task;
+  Py_BEGIN_ALLOW_THREADS pthread_mutex_lock(&app->lock);
+  while (app->tasks_head == NULL && !app->closing) {
+    pthread_cond_wait(&app->tasks_ready, &app->lock);
+  }
+  task = app->tasks_head;
+  if (task != NULL) {
+    app->tasks_head = task->next;
+    if (app->tasks_head == NULL) {
+      app->tasks_tail = NULL;
+    }
+  }
+  pthread_mutex_unlock(&app->lock);
+  Py_END_ALLOW_THREADS count_gil_acquisition();
+
+  // Pending tasks are served before the workers stop
+  if (task == NULL) {
+    Py_RETURN_NONE;
+  }
+  int64_t start = monotonic_ns();
+  RequestResponse *r = WsgiApp_new_request(
+      app, task->request_id, task->headers, task->body, task->body_len,
+      task->stream_body, task->content_length);
+  r->timings.queue_wait = start - task->queued;
+  r->timings.setup = monotonic_ns() - start;
+  free(task);
+  return (PyObject *)r;
+}
+
+static PyMethodDef WsgiApp_next_task_def = {
+    "next_task", (PyCFunction)WsgiApp_next_task, METH_NOARGS,
+    "Wait for the next request of a sub-interpreter."};
+
+static void *WsgiApp_run_interpreter(void *arg) {
+  WsgiAppLoad *load = arg;
+  WsgiApp *app = load->app;
+
+  PyInterpreterConfig config = {
+      .use_main_obmalloc = 0,
+      .allow_fork = 0,
+      .allow_exec = 1,
+      .allow_threads = 1,
+      .allow_daemon_threads = 0,
+      .check_multi_interp_extensions = 1,
+      .gil = PyInterpreterConfig_OWN_GIL,
+  };
+  PyThreadState *tstate = NULL;
+  PyStatus status = Py_NewInterpreterFromConfig(&tstate, &config);
+  if (PyStatus_Exception(status)) {
+    fprintf(stderr, "failed to create sub-interpreter: %s\n",
+            status.err_msg ? status.err_msg : "unknown error");
+    WsgiApp_set_load_result(app, -1);
+    return NULL;
+  }
+
+  // Configure python path to recognize modules in the current directory
+  PyObject *sys_path = PySys_GetObject("path");
+  PyObject *current_dir = PyUnicode_FromString("");
+  PyList_Insert(sys_path, 0, current_dir);
+  Py_DECREF(current_dir);
+
+  app->state = calloc(1, sizeof(WsgiState));
+  PyObject *app_capsule = PyCapsule_New(app, NULL, NULL);
+  PyObject *get_task = app_capsule ? PyCFunction_New(&WsgiApp_next_task_def,
+                                                     app_capsule)
+                                   : NULL;
+  Py_XDECREF(app_capsule);
+  if (app->state == NULL || get_task == NULL ||
+      WsgiState_init(app->state) < 0 ||
+      WsgiApp_load(app, load->import, get_task) < 0) {
+    if (PyErr_Occurred()) {
+      PyErr_Print();
+    }
+    Py_XDECREF(get_task);
+    Py_EndInterpreter(tstate);
+    free(app->state);
+    WsgiApp_set_load_result(app, -1);
+    return NULL;
+  }
+  Py_DECREF(get_task);
+  WsgiApp_set_load_result(app, 0);
+
+  // Wait for WsgiApp_cleanup, the worker threads serve requests meanwhile
+  Py_BEGIN_ALLOW_THREADS pthread_mutex_lock(&app->lock);
+  while (!app->closing) {
+    pthread_cond_wait(&app->state_changed, &app->lock);
+  }
+  pthread_mutex_unlock(&app->lock);
+  Py_END_ALLOW_THREADS
+
+  for (Py_ssize_t i = 0; i < PyList_Size(app->threads); i++) {
+    PyObject *result =
+        PyObject_CallMethod(PyList_GetItem(app->threads, i), "join", NULL);
+    if (!result) {
+      PyErr_Print();
+    }
+    Py_XDECREF(result);
+  }
+  Py_DECREF(app->threads);
+  Py_XDECREF(app->task_queue_put);
+  Py_DECREF(app->handler);
+  Py_EndInterpreter(tstate);
+  free(app->state);
+  return NULL;
+}
+
+static int WsgiApp_start_interpreter(WsgiApp *app, const AppImport *import) {
+  WsgiAppLoad load = {app, import};
+  pthread_mutex_init(&app->lock, NULL);
+  pthread_cond_init(&app->tasks_ready, NULL);
+  pthread_cond_init(&app->state_changed, NULL);
+  app->tasks_head = NULL;
+  app->tasks_tail = NULL;
+  app->closing = 0;
+  app->load_result = 1;
+
+  int result = -1;
+  if (pthread_create(&app->owner, NULL, WsgiApp_run_interpreter, &load) == 0) {
+    pthread_mutex_lock(&app->lock);
+    while (app->load_result == 1) {
+      pthread_cond_wait(&app->state_changed, &app->lock);
+    }
+    result = app->load_result;
+    pthread_mutex_unlock(&app->lock);
+    if (result < 0) {
+      pthread_join(app->owner, NULL);
+    }
+  }
+
+  if (result < 0) {
+    pthread_cond_destroy(&app->state_changed);
+    pthread_cond_destroy(&app->tasks_ready);
+    pthread_mutex_destroy(&app->lock);
+  }
+  return result;
+}
+
+static void WsgiApp_stop_interpreter(WsgiApp *app) {
+  pthread_mutex_lock(&app->lock);
+  app->closing = 1;
+  pthread_cond_broadcast(&app->tasks_ready);
+  pthread_cond_broadcast(&app->state_changed);
+  pthread_mutex_unlock(&app->lock);
+  pthread_join(app->owner, NULL);
+  pthread_cond_destroy(&app->state_changed);
+  pthread_cond_destroy(&app->tasks_ready);
+  pthread_mutex_destroy(&app->lock);
+}
+
+static void WsgiApp_queue_task(WsgiApp *app, int64_t request_id,
+                               MapKeyVal *headers, const char *body,
+                               size_t body_len, uint8_t stream_body,
+                               int64_t content_length) {
+  WsgiTask *task = malloc(sizeof(WsgiTask) + body_len);
+  if (task == NULL) {
+    wsgi_write_response(request_id, 500, NULL, NULL, 0, NULL);
+    return;
+  }
+  task->request_id = request_id;
+  task->headers = headers;
+  task->body_len = body_len;
+  task->stream_body = stream_body;
+  task->content_length = content_length;
+  task->queued = monotonic_ns();
+  task->next = NULL;
+  if (body_len > 0) {
+    memcpy(task->body, body, body_len);
+  }
+
+  pthread_mutex_lock(&app->lock);
+  if (app->tasks_tail != NULL) {
+    app->tasks_tail->next = task;
+  } else {
+    app->tasks_head = task;
+  }
+  app->tasks_tail = task;
+  pthread_cond_signal(&app->tasks_ready);
+  pthread_mutex_unlock(&app->lock);
+}
+#else
+static int WsgiApp_start_interpreter(WsgiApp *app, const AppImport *import) {
+  fprintf(stderr, "sub-interpreters require Python 3.12 or newer\n");
+  return -1;
+}
+#endif
+
+uint64_t Py_gil_acquisitions(void) {
+  return atomic_load_explicit(&gil_acquisitions, memory_order_relaxed);
+}
+
+// Starts sampling the Python stacks of requests hz times a second. Returns 0
+// if the sampler couldn't start.
+uint8_t Py_profile_start(int hz) {
+  PyGILState_STATE gstate = PyGILState_Ensure();
+  profile_stop = PyObject_CallFunction(profile_start, "i", hz);
+  if (profile_stop == NULL) {
     PyErr_Print();
     PyGILState_Release(gstate);
-    return NULL;
+    return 0;
   }
+  atomic_store_explicit(&profiling, 1, memory_order_relaxed);
+  PyGILState_Release(gstate);
+  return 1;
+}
 
-  app->handler = PyObject_GetAttrString(module, app_name);
+// Stops the sampler and returns the samples as JSON, the string is released
+// with free. Returns NULL on failure.
+char *Py_profile_stop(void) {
+  PyGILState_STATE gstate = PyGILState_Ensure();
+  atomic_store_explicit(&profiling, 0, memory_order_relaxed);
+  PyObject *samples = PyObject_CallNoArgs(profile_stop);
+  Py_CLEAR(profile_stop);
+  char *result = NULL;
+  if (samples) {
+    size_t size;
+    result = copy_pystring(samples, &size);
+    Py_DECREF(samples);
+  }
+  if (result == NULL) {
+    PyErr_Print();
+  }
+  PyGILState_Release(gstate);
+  return result;
+}
+
+// Removes the modules of an app from sys.modules of the main interpreter, the
+// next import of the app runs the code that is on disk.
+void Py_forget_modules(const char *module_name) {
+  PyGILState_STATE gstate = PyGILState_Ensure();
+  PyObject *result = PyObject_CallFunction(forget_modules, "s", module_name);
+  if (result == NULL) {
+    PyErr_Print();
+  }
+  Py_XDECREF(result);
+  PyGILState_Release(gstate);
+}
+
+uint8_t Py_subinterpreters_supported(void) {
+#ifdef CADDYSNAKE_SUBINTERPRETERS
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+// Imports the app in the current interpreter and starts its worker threads,
+// requests are taken from get_task or from a new task queue when it's None.
+// Returns -1 on failure, the GIL must be held.
+static int WsgiApp_load(WsgiApp *app, const AppImport *import,
+                        PyObject *get_task) {
+  if (AppImport_prepare(import) < 0) {
+    PyErr_Print();
+    return -1;
+  }
+
+  PyObject *module = PyImport_ImportModule(import->module_name);
+  if (module == NULL) {
+    PyErr_Print();
+    return -1;
+  }
+
+  app->handler = PyObject_GetAttrString(module, import->app_name);
+  Py_DECREF(module);
   if (!app->handler || !PyCallable_Check(app->handler)) {
     if (PyErr_Occurred()) {
       PyErr_Print();
     }
+    Py_CLEAR(app->handler);
+    return -1;
+  }
+
+  // Start the pool of worker threads that serve this app
+  PyObject *py_workers = PyLong_FromSize_t(app->workers);
+  PyObject *setup_result = PyObject_CallFunctionObjArgs(
+      app->state->wsgi_setup, app->state->response_callback_fn, py_workers,
+      get_task, NULL);
+  Py_DECREF(py_workers);
+  if (setup_result == NULL) {
+    PyErr_Print();
+    Py_CLEAR(app->handler);
+    return -1;
+  }
+  PyObject *task_queue = PyTuple_GetItem(setup_result, 0);
+  if (task_queue != Py_None) {
+    app->task_queue_put = PyObject_GetAttrString(task_queue, "put");
+  }
+  app->threads = PyTuple_GetItem(setup_result, 1);
+  Py_INCREF(app->threads);
+  Py_DECREF(setup_result);
+  return 0;
+}
+
+WsgiApp *WsgiApp_import(const char *module_name, const char *app_name,
+                        const char *venv_path, const char *preload,
+                        const char *pycache_prefix, size_t workers,
+                        uint8_t subinterpreter) {
+  WsgiApp *app = malloc(sizeof(WsgiApp));
+  if (app == NULL) {
+    return NULL;
+  }
+  app->handler = NULL;
+  app->task_queue_put = NULL;
+  app->threads = NULL;
+  app->workers = workers;
+  app->state = &main_wsgi_state;
+  app->subinterpreter = subinterpreter;
+
+  AppImport import = {module_name, app_name, venv_path, preload,
+                      pycache_prefix};
+  int result;
+  if (subinterpreter) {
+    result = WsgiApp_start_interpreter(app, &import);
+  } else {
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    result = WsgiApp_load(app, &import, Py_None);
     PyGILState_Release(gstate);
+  }
+  if (result < 0) {
+    free(app);
     return NULL;
   }
-
-  PyGILState_Release(gstate);
   return app;
 }
 
 void WsgiApp_cleanup(WsgiApp *app) {
+#ifdef CADDYSNAKE_SUBINTERPRETERS
+  if (app->subinterpreter) {
+    WsgiApp_stop_interpreter(app);
+    free(app);
+    return;
+  }
+#endif
   PyGILState_STATE gstate = PyGILState_Ensure();
+  if (app->task_queue_put) {
+    // Send one stop sentinel per worker thread
+    for (size_t i = 0; i < app->workers; i++) {
+      PyObject *result = PyObject_CallOneArg(app->task_queue_put, Py_None);
+      Py_XDECREF(result);
+    }
+    Py_DECREF(app->task_queue_put);
+  }
+  Py_XDECREF(app->threads);
   Py_XDECREF(app->handler);
   PyGILState_Release(gstate);
   free(app);
 }
 
 void WsgiApp_handle_request(WsgiApp *app, int64_t request_id,
-                            MapKeyVal *headers, const char *body) {
+                            MapKeyVal *headers, const char *body,
+                            size_t body_len, uint8_t stream_body,
+                            int64_t content_length) {
+#ifdef CADDYSNAKE_SUBINTERPRETERS
+  if (app->subinterpreter) {
+    WsgiApp_queue_task(app, request_id, headers, body, body_len, stream_body,
+                       content_length);
+    return;
+  }
+#endif
+  int64_t start = monotonic_ns();
   PyGILState_STATE gstate = PyGILState_Ensure();
+  int64_t acquired = monotonic_ns();
+  count_gil_acquisition();
+  RequestResponse *r =
+      WsgiApp_new_request(app, request_id, headers, body, body_len,
+                          stream_body, content_length);
+  r->stage_start = monotonic_ns();
+  r->timings.gil_wait = acquired - start;
+  r->timings.setup = r->stage_start - acquired;
+  PyObject *result = PyObject_CallOneArg(app->task_queue_put, (PyObject *)r);
+  Py_XDECREF(result);
+  Py_DECREF(r);
+  PyGILState_Release(gstate);
+}
 
-  PyObject *environ = PyDict_New();
-  for (size_t i = 0; i < headers->count; i++) {
-    PyObject *key = PyUnicode_FromString(headers->keys[i]);
-    PyObject *value = PyUnicode_FromString(headers->values[i]);
-    PyDict_SetItem(environ, key, value);
-    Py_DECREF(key);
-    Py_DECREF(value);
+// Builds the response headers of a WSGI app, returns NULL with an exception
+// set if they are not valid.
+static MapKeyVal *RequestResponse_headers(RequestResponse *response) {
+  if (!response->response_headers) {
+    PyErr_SetString(PyExc_RuntimeError,
+                    "expected response headers to be non-empty");
+    return NULL;
   }
-  PyObject *input_key = PyUnicode_FromString("wsgi.input");
-  PyObject *bytes = PyBytes_FromString(body);
-  PyObject *bytes_file = PyObject_CallOneArg(BytesIO, bytes);
-  PyDict_SetItem(environ, input_key, bytes_file);
-  Py_DECREF(input_key);
-  Py_DECREF(bytes);
-  Py_DECREF(bytes_file);
-
-  char *extra_keys[] = {"wsgi.multithread", "wsgi.multiprocess",
-                        "wsgi.run_once", "wsgi.version", "wsgi.errors"};
-  PyObject *extra_values[] = {Py_True, Py_True, Py_False, wsgi_version,
-                              sys_stderr};
-  for (size_t i = 0; i < 5; i++) {
-    PyObject *key = PyUnicode_FromString(extra_keys[i]);
-    PyDict_SetItem(environ, key, extra_values[i]);
-    Py_DECREF(key);
+  if (!PyTuple_Check(response->response_headers) &&
+      !PyList_Check(response->response_headers)) {
+    PyErr_SetString(PyExc_RuntimeError,
+                    "response headers is not list or tuple");
+    return NULL;
   }
-  RequestResponse *r =
-      (RequestResponse *)PyObject_CallObject((PyObject *)&ResponseType, NULL);
-  r->app = app;
-  r->request_id = request_id;
-  r->request_environ = environ;
-  PyObject_CallOneArg(task_queue_put, (PyObject *)r);
+  return MapKeyVal_from_pairs(
+      response->response_headers, 0,
+      "expected response headers to be tuples with 2 items");
+}
 
-  PyGILState_Release(gstate);
+static void close_response_iterator(PyObject *close_iterator) {
+  if (close_iterator) {
+    PyObject *result = PyObject_CallNoArgs(close_iterator);
+    if (!result) {
+      PyErr_Print();
+    }
+    Py_XDECREF(result);
+    Py_DECREF(close_iterator);
+  }
 }
 
-static void MapKeyVal_free(MapKeyVal *map, size_t pos) {
-  if (pos > map->count) {
-    pos = map->count;
+/*
+response_send_file sends a FileWrapper response body from its file descriptor.
+The descriptor is duplicated because Go closes it when the copy is done.
+Returns 1 when the response was sent, 0 when the file doesn't have a usable
+descriptor and must be iterated, or -1 with an exception set.
+*/
+static int response_send_file(RequestResponse *response) {
+  FileWrapper *wrapper = (FileWrapper *)response->response_body;
+  int fd = PyObject_AsFileDescriptor(wrapper->filelike);
+  if (fd < 0) {
+    PyErr_Clear();
+    return 0;
+  }
+  // Start from the current position, like iterating the file would
+  PyObject *position = PyObject_CallMethod(wrapper->filelike, "tell", NULL);
+  if (!position) {
+    PyErr_Clear();
+    return 0;
+  }
+  long long offset = PyLong_AsLongLong(position);
+  Py_DECREF(position);
+  if (offset < 0) {
+    PyErr_Clear();
+    return 0;
+  }
+  int file_fd = dup(fd);
+  if (file_fd < 0) {
+    return 0;
+  }
+  if (lseek(file_fd, (off_t)offset, SEEK_SET) < 0) {
+    close(file_fd);
+    return 0;
   }
-  for (size_t i = 0; i < pos; i++) {
-    free(map->keys[i]);
-    free(map->values[i]);
+  MapKeyVal *http_headers = RequestResponse_headers(response);
+  if (!http_headers) {
+    close(file_fd);
+    return -1;
   }
-  free(map);
+  response->timings.marshal = monotonic_ns() - response->stage_start;
+  Py_BEGIN_ALLOW_THREADS wsgi_write_file(response->request_id,
+                                         response->response_status,
+                                         http_headers, file_fd,
+                                         &response->timings);
+  Py_END_ALLOW_THREADS count_gil_acquisition();
+  return 1;
 }
 
+// Takes the next chunk of a response body. Generators run code of the app, so
+// the time that it takes is counted as app time and added to excluded.
+static PyObject *response_next(RequestResponse *response, PyObject *iterator,
+                               int64_t *excluded) {
+  int64_t start = monotonic_ns();
+  PyObject *item = PyIter_Next(iterator);
+  int64_t elapsed = monotonic_ns() - start;
+  response->timings.app += elapsed;
+  *excluded += elapsed;
+  return item;
+}
+
+/*
+response_callback writes the response of a WSGI app to Go as soon as each
+chunk of the body is produced. Headers are sent along with the first non-empty
+chunk, as required by PEP 3333. When the body is a list or tuple the last chunk
+is sent together with the end of the response to save one call into Go.
+The time spent here is marshalling, except for iterating the body and waiting
+for Go to write the chunks.
+*/
 static PyObject *response_callback(PyObject *self, PyObject *args) {
   RequestResponse *response = (RequestResponse *)PyTuple_GetItem(args, 0);
   PyObject *exc_info = PyTuple_GetItem(args, 1);
+  response->stage_start = monotonic_ns();
+  int64_t excluded = 0;
   if (exc_info != Py_None) {
     PyErr_Display(NULL, exc_info, NULL);
     goto finalize_error;
   }
 
-  char *response_body = NULL;
-  size_t response_body_size = 0;
-  if (response->response_body) {
-    PyObject *iterator = PyObject_GetIter(response->response_body);
-    if (iterator) {
-      PyObject *close_iterator = NULL;
-      if (PyObject_HasAttrString(iterator, "close")) {
-        close_iterator = PyObject_GetAttrString(iterator, "close");
-      }
-      PyObject *item;
-      while ((item = PyIter_Next(iterator))) {
-        if (!PyBytes_Check(item)) {
-          PyErr_SetString(PyExc_RuntimeError,
-                          "expected response body items to be bytes");
-          PyErr_Print();
-          Py_DECREF(item);
-          if (close_iterator) {
-            PyObject_CallNoArgs(close_iterator);
-            Py_DECREF(close_iterator);
-          }
-          Py_DECREF(iterator);
-          if (response_body != NULL) {
-            free(response_body);
-          }
-          goto finalize_error;
-        }
-        char *previous_body = response_body;
-        if (previous_body == NULL) {
-          char *og_str;
-          Py_ssize_t og_size;
-          PyBytes_AsStringAndSize(item, &og_str, &og_size);
-          response_body =
-              concatenate_bytes("", 0, og_str, og_size, &response_body_size);
-        } else {
-          char *og_str;
-          Py_ssize_t og_size;
-          PyBytes_AsStringAndSize(item, &og_str, &og_size);
-          response_body =
-              concatenate_bytes(previous_body, response_body_size, og_str,
-                                og_size, &response_body_size);
-          free(previous_body);
-        }
-        Py_DECREF(item);
-      }
-      if (close_iterator) {
-        PyObject_CallNoArgs(close_iterator);
-        Py_DECREF(close_iterator);
-      }
-      Py_DECREF(iterator);
-    } else {
-      PyErr_Print();
-      goto finalize_error;
-    }
-  } else {
+  if (!response->response_body) {
     PyErr_SetString(PyExc_RuntimeError,
                     "expected response body to be non-empty");
     PyErr_Print();
     goto finalize_error;
   }
 
-  if (PyErr_Occurred()) {
-    PyErr_Print();
-    if (response_body != NULL) {
-      free(response_body);
+  if (Py_IS_TYPE(response->response_body,
+                 response->app->state->FileWrapperType)) {
+    int sent = response_send_file(response);
+    if (sent != 0) {
+      close_response_iterator(
+          PyObject_GetAttrString(response->response_body, "close"));
+      if (sent < 0) {
+        PyErr_Print();
+        goto finalize_error;
+      }
+      goto end;
     }
-    goto finalize_error;
   }
 
-  if (!response->response_headers) {
-    PyErr_SetString(PyExc_RuntimeError,
-                    "expected response headers to be non-empty");
-    PyErr_Print();
-    if (response_body != NULL) {
-      free(response_body);
-    }
-    goto finalize_error;
+  Py_ssize_t sequence_size = -1;
+  if (PyList_CheckExact(response->response_body)) {
+    sequence_size = PyList_GET_SIZE(response->response_body);
+  } else if (PyTuple_CheckExact(response->response_body)) {
+    sequence_size = PyTuple_GET_SIZE(response->response_body);
   }
-  PyObject *iterator = PyObject_GetIter(response->response_headers);
+
+  PyObject *iterator = PyObject_GetIter(response->response_body);
   if (!iterator) {
     PyErr_Print();
-    if (response_body != NULL) {
-      free(response_body);
-    }
     goto finalize_error;
   }
-  Py_ssize_t headers_count = 0;
-  if (PyTuple_Check(response->response_headers)) {
-    headers_count = PyTuple_Size(response->response_headers);
-  } else if (PyList_Check(response->response_headers)) {
-    headers_count = PyList_Size(response->response_headers);
-  } else {
-    PyErr_SetString(PyExc_RuntimeError,
-                    "response headers is not list or tuple");
-    PyErr_Print();
-    Py_DECREF(iterator);
-    if (response_body != NULL) {
-      free(response_body);
+  PyObject *close_iterator = NULL;
+  if (PyObject_HasAttrString(response->response_body, "close")) {
+    close_iterator = PyObject_GetAttrString(response->response_body, "close");
+  }
+
+  uint8_t headers_sent = 0;
+  PyObject *last_item = NULL;
+  Py_ssize_t position = 0;
+  PyObject *item;
+  while ((item = response_next(response, iterator, &excluded))) {
+    position++;
+    if (!PyBytes_Check(item)) {
+      PyErr_SetString(PyExc_RuntimeError,
+                      "expected response body items to be bytes");
+      Py_DECREF(item);
+      break;
     }
-    goto finalize_error;
+    if (position == sequence_size) {
+      last_item = item;
+      break;
+    }
+    if (PyBytes_GET_SIZE(item) == 0) {
+      Py_DECREF(item);
+      continue;
+    }
+    MapKeyVal *http_headers = NULL;
+    if (!headers_sent) {
+      http_headers = RequestResponse_headers(response);
+      if (!http_headers) {
+        Py_DECREF(item);
+        break;
+      }
+      headers_sent = 1;
+    }
+    char *chunk = PyBytes_AS_STRING(item);
+    size_t chunk_size = PyBytes_GET_SIZE(item);
+    int64_t write_start = monotonic_ns();
+    Py_BEGIN_ALLOW_THREADS wsgi_write_chunk(response->request_id,
+                                            response->response_status,
+                                            http_headers, chunk, chunk_size);
+    Py_END_ALLOW_THREADS count_gil_acquisition();
+    excluded += monotonic_ns() - write_start;
+    Py_DECREF(item);
   }
+  Py_DECREF(iterator);
 
-  MapKeyVal *http_headers = MapKeyVal_new(headers_count);
+  if (PyErr_Occurred()) {
+    PyErr_Print();
+    Py_XDECREF(last_item);
+    close_response_iterator(close_iterator);
+    goto finalize_error;
+  }
+  close_response_iterator(close_iterator);
 
-  PyObject *key, *value, *item;
-  size_t pos = 0;
-  while ((item = PyIter_Next(iterator))) {
-    if (!PyTuple_Check(item) || PyTuple_Size(item) != 2) {
-      PyErr_SetString(PyExc_RuntimeError,
-                      "expected response headers to be tuples with 2 items");
+  MapKeyVal *http_headers = NULL;
+  if (!headers_sent) {
+    http_headers = RequestResponse_headers(response);
+    if (!http_headers) {
       PyErr_Print();
-      Py_DECREF(item);
-      Py_DECREF(iterator);
-      MapKeyVal_free(http_headers, pos);
+      Py_XDECREF(last_item);
       goto finalize_error;
     }
-    key = PyTuple_GetItem(item, 0);
-    value = PyTuple_GetItem(item, 1);
-    http_headers->keys[pos] = copy_pystring(key);
-    http_headers->values[pos] = copy_pystring(value);
-    Py_DECREF(item);
-    pos++;
   }
-  Py_DECREF(iterator);
-
-  Py_BEGIN_ALLOW_THREADS wsgi_write_response(
-      response->request_id, response->response_status, http_headers,
-      response_body, response_body_size);
-  Py_END_ALLOW_THREADS goto end;
-
-finalize_error:
-  Py_BEGIN_ALLOW_THREADS wsgi_write_response(response->request_id, 500, NULL,
-                                             NULL, 0);
-  Py_END_ALLOW_THREADS
+  char *body = NULL;
+  size_t body_size = 0;
+  if (last_item) {
+    body = PyBytes_AS_STRING(last_item);
+    body_size = PyBytes_GET_SIZE(last_item);
+  }
+  response->timings.marshal =
+      monotonic_ns() - response->stage_start - excluded;
+  Py_BEGIN_ALLOW_THREADS wsgi_write_response(
+      response->request_id, response->response_status, http_headers, body,
+      body_size, &response->timings);
+  Py_END_ALLOW_THREADS count_gil_acquisition();
+  Py_XDECREF(last_item);
+  goto end;
+
+finalize_error:
+  response->timings.marshal =
+      monotonic_ns() - response->stage_start - excluded;
+  Py_BEGIN_ALLOW_THREADS wsgi_write_response(response->request_id, 500, NULL,
+                                             NULL, 0, &response->timings);
+  Py_END_ALLOW_THREADS count_gil_acquisition();
+
+end:
+  profile_thread_exit(response);
+  Py_RETURN_NONE;
+}
+
+// Collects a list or tuple of bytes into a single body, so it can be returned
+// to Go instead of being sent through a callback. Returns 0 when the body can
+// only be sent by response_callback.
+static int RequestResponse_collect(RequestResponse *r, WsgiResponse *response) {
+  PyObject *items = r->response_body;
+  if (!PyList_CheckExact(items) && !PyTuple_CheckExact(items)) {
+    return 0;
+  }
+  Py_ssize_t count = PySequence_Fast_GET_SIZE(items);
+  size_t body_len = 0;
+  for (Py_ssize_t i = 0; i < count; i++) {
+    PyObject *item = PySequence_Fast_GET_ITEM(items, i);
+    if (!PyBytes_Check(item)) {
+      return 0;
+    }
+    body_len += PyBytes_GET_SIZE(item);
+  }
+
+  response->status = 500;
+  response->headers = RequestResponse_headers(r);
+  if (response->headers == NULL) {
+    PyErr_Print();
+    return 1;
+  }
+  response->status = r->response_status;
+  if (body_len > 0) {
+    response->body = malloc(body_len);
+    if (response->body == NULL) {
+      free(response->headers);
+      response->headers = NULL;
+      response->status = 500;
+      return 1;
+    }
+    char *dst = response->body;
+    for (Py_ssize_t i = 0; i < count; i++) {
+      PyObject *item = PySequence_Fast_GET_ITEM(items, i);
+      memcpy(dst, PyBytes_AS_STRING(item), PyBytes_GET_SIZE(item));
+      dst += PyBytes_GET_SIZE(item);
+    }
+    response->body_len = body_len;
+  }
+  return 1;
+}
 
-      end : Py_RETURN_NONE;
+// Serves a request in the calling thread instead of handing it to a worker
+// thread. With the free-threaded build requests served this way run in
+// parallel. Returns 1 when the response was stored in response and has to be
+// written by the caller, or 0 when it was already sent with the callbacks.
+uint8_t WsgiApp_call(WsgiApp *app, int64_t request_id, MapKeyVal *headers,
+                     const char *body, size_t body_len, uint8_t stream_body,
+                     int64_t content_length, WsgiResponse *response) {
+  response->status = 500;
+  response->headers = NULL;
+  response->body = NULL;
+  response->body_len = 0;
+
+  int64_t start = monotonic_ns();
+  PyGILState_STATE gstate = PyGILState_Ensure();
+  int64_t acquired = monotonic_ns();
+  count_gil_acquisition();
+  RequestResponse *r =
+      WsgiApp_new_request(app, request_id, headers, body, body_len,
+                          stream_body, content_length);
+  r->timings.gil_wait = acquired - start;
+  r->timings.setup = monotonic_ns() - acquired;
+  Py_DECREF(Response_call_wsgi(r, NULL));
+  uint8_t returned = 1;
+  int64_t marshal_start = monotonic_ns();
+  if (r->response_body == NULL) {
+    PyErr_Print();
+  } else if (!RequestResponse_collect(r, response)) {
+    PyObject *args = PyTuple_Pack(2, (PyObject *)r, Py_None);
+    Py_XDECREF(response_callback(NULL, args));
+    Py_DECREF(args);
+    returned = 0;
+  }
+  if (returned) {
+    r->timings.marshal = monotonic_ns() - marshal_start;
+  }
+  response->timings = r->timings;
+  profile_thread_exit(r);
+  Py_DECREF(r);
+  PyGILState_Release(gstate);
+  return returned;
 }
 
 static PyMethodDef CaddysnakeMethods[] = {
@@ -448,32 +1838,145 @@ static PyMethodDef CaddysnakeMethods[] = {
 };
 
 static struct PyModuleDef CaddysnakeModule = {
-    PyModuleDef_HEAD_INIT, "caddysnake", NULL, -1, CaddysnakeMethods,
+    PyModuleDef_HEAD_INIT, "caddysnake", NULL, 0, CaddysnakeMethods,
 };
 
+// Creates the objects used to serve WSGI apps in the current interpreter.
+// Returns -1 on failure.
+static int WsgiState_init(WsgiState *state) {
+  // Used for turning bytes-like object into a file-like object
+  PyObject *io_module = PyImport_ImportModule("io");
+  if (io_module == NULL) {
+    return -1;
+  }
+  state->BytesIO = PyObject_GetAttrString(io_module, "BytesIO");
+  Py_DECREF(io_module);
+  if (state->BytesIO == NULL) {
+    return -1;
+  }
+
+  PyObject *caddysnake_module = PyModule_Create(&CaddysnakeModule);
+  if (caddysnake_module == NULL) {
+    return -1;
+  }
+#ifdef Py_GIL_DISABLED
+  // Shared state of the module is either read-only or locked, otherwise
+  // importing it would enable the GIL again in the free-threaded build
+  PyUnstable_Module_SetGIL(caddysnake_module, Py_MOD_GIL_NOT_USED);
+#endif
+  state->response_callback_fn =
+      PyObject_GetAttrString(caddysnake_module, "response_callback");
+  state->ResponseType = (PyTypeObject *)PyType_FromModuleAndSpec(
+      caddysnake_module, &ResponseType_spec, NULL);
+  state->WsgiInputType = (PyTypeObject *)PyType_FromModuleAndSpec(
+      caddysnake_module, &WsgiInputType_spec, NULL);
+  state->FileWrapperType = (PyTypeObject *)PyType_FromModuleAndSpec(
+      caddysnake_module, &FileWrapperType_spec, NULL);
+  Py_DECREF(caddysnake_module);
+  if (!state->response_callback_fn || !state->ResponseType ||
+      !state->WsgiInputType || !state->FileWrapperType) {
+    return -1;
+  }
+
+  // Create setup functions, see file: caddysnake.py
+  if (PyRun_SimpleString(caddysnake_setup_py) != 0) {
+    return -1;
+  }
+  PyObject *main_module = PyImport_AddModule("__main__");
+  // Each app creates its own task queue and pool of worker threads
+  state->wsgi_setup =
+      PyObject_GetAttrString(main_module, "caddysnake_setup_wsgi");
+  if (state->wsgi_setup == NULL) {
+    return -1;
+  }
+  PyRun_SimpleString("del caddysnake_setup_wsgi");
+
+  // Setup WSGI version
+  state->wsgi_version = Py_BuildValue("(ii)", 1, 0);
+
+  // Setup stderr for logging
+  state->sys_stderr = PySys_GetObject("stderr");
+
+  if (NameCache_init(environ_key_names, ARRAY_SIZE(environ_key_names),
+                     state->environ_keys, PyUnicode_InternFromString) < 0 ||
+      NameCache_init(value_names, ARRAY_SIZE(value_names),
+                     state->environ_values, PyUnicode_FromString) < 0) {
+    return -1;
+  }
+  // Entries of the environ that don't depend on the request
+  state->environ_template = PyDict_New();
+  if (state->environ_template == NULL) {
+    return -1;
+  }
+  const char *constant_keys[] = {"wsgi.multithread", "wsgi.multiprocess",
+                                 "wsgi.run_once",    "wsgi.version",
+                                 "wsgi.errors",      "wsgi.file_wrapper"};
+  PyObject *constant_values[] = {
+      Py_True,           Py_True,
+      Py_False,          state->wsgi_version,
+      state->sys_stderr, (PyObject *)state->FileWrapperType};
+  for (size_t i = 0; i < ARRAY_SIZE(constant_keys); i++) {
+    PyObject *key =
+        environ_key(state, constant_keys[i], strlen(constant_keys[i]));
+    int result =
+        PyDict_SetItem(state->environ_template, key, constant_values[i]);
+    Py_DECREF(key);
+    if (result < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
 // ASGI 3.0 protocol implementation
-struct AsgiApp {
-  PyObject *handler;
-  PyObject *state;
 
+// An event loop of an ASGI app, it runs in its own thread. The lifespan of the
+// app runs in every loop and each loop has its own copy of the state.
+//
+// Go pushes completions to the loop without the GIL, even after the app is
+// cleaned up. The loop is freed when the app, the drain callback and every
+// AsgiEvent of the loop released it.
+typedef struct AsgiLoop {
+  PyObject *loop;
+  PyObject *state;
   PyObject *lifespan_startup;
   PyObject *lifespan_shutdown;
+  // Completions pushed by Go for requests of this loop, see
+  // AsgiCompletion_push
+  _Atomic(struct AsgiCompletion *) completions;
+  int wakeup_fds[2];
+  atomic_size_t refs;
+  // Nanoseconds that the last probe of the loop ran late
+  _Atomic int64_t lag;
+} AsgiLoop;
+
+static AsgiLoop *AsgiLoop_new(uint8_t uvloop);
+static void AsgiLoop_release(AsgiLoop *loop);
+
+struct AsgiApp {
+  PyObject *handler;
+  AsgiLoop **loops;
+  size_t loops_count;
 };
 
 AsgiApp *AsgiApp_import(const char *module_name, const char *app_name,
-                        const char *venv_path) {
+                        const char *venv_path, const char *preload,
+                        const char *pycache_prefix, size_t loops_count,
+                        uint8_t uvloop) {
   AsgiApp *app = malloc(sizeof(AsgiApp));
   if (app == NULL) {
     return NULL;
   }
-  app->lifespan_startup = NULL;
-  app->lifespan_shutdown = NULL;
+  app->loops = calloc(loops_count, sizeof(AsgiLoop *));
+  app->loops_count = 0;
   PyGILState_STATE gstate = PyGILState_Ensure();
 
-  // Add venv_path into sys.path list
-  if (venv_path) {
-    PyObject *sysPath = PySys_GetObject("path");
-    PyList_Append(sysPath, PyUnicode_FromString(venv_path));
+  AppImport import = {module_name, app_name, venv_path, preload,
+                      pycache_prefix};
+  if (AppImport_prepare(&import) < 0) {
+    PyErr_Print();
+    PyGILState_Release(gstate);
+    return NULL;
   }
 
   PyObject *module = PyImport_ImportModule(module_name);
@@ -491,7 +1994,16 @@ AsgiApp *AsgiApp_import(const char *module_name, const char *app_name,
     PyGILState_Release(gstate);
     return NULL;
   }
-  app->state = PyDict_New();
+
+  for (; app->loops_count < loops_count; app->loops_count++) {
+    AsgiLoop *loop = AsgiLoop_new(uvloop);
+    if (!loop) {
+      PyErr_Print();
+      PyGILState_Release(gstate);
+      return NULL;
+    }
+    app->loops[app->loops_count] = loop;
+  }
 
   PyGILState_Release(gstate);
   return app;
@@ -500,49 +2012,193 @@ AsgiApp *AsgiApp_import(const char *module_name, const char *app_name,
 uint8_t AsgiApp_lifespan_startup(AsgiApp *app) {
   PyGILState_STATE gstate = PyGILState_Ensure();
 
-  PyObject *args = PyTuple_New(2);
-  PyTuple_SetItem(args, 0, app->handler);
-  PyTuple_SetItem(args, 1, app->state);
-  PyObject *result = PyObject_Call(build_lifespan, args, NULL);
-  Py_DECREF(args);
+  uint8_t status = 1;
+  for (size_t i = 0; i < app->loops_count && status; i++) {
+    AsgiLoop *loop = app->loops[i];
+    PyObject *result = PyObject_CallFunctionObjArgs(
+        build_lifespan, app->handler, loop->state, loop->loop, NULL);
+    if (!result) {
+      PyErr_Print();
+      status = 0;
+      break;
+    }
+    loop->lifespan_startup = Py_NewRef(PyTuple_GetItem(result, 0));
+    loop->lifespan_shutdown = Py_NewRef(PyTuple_GetItem(result, 1));
+    Py_DECREF(result);
+
+    result = PyObject_CallNoArgs(loop->lifespan_startup);
+    status = result == Py_True;
+    Py_XDECREF(result);
+  }
 
-  app->lifespan_startup = PyTuple_GetItem(result, 0);
-  app->lifespan_shutdown = PyTuple_GetItem(result, 1);
+  PyGILState_Release(gstate);
+
+  return status;
+}
 
-  result = PyObject_CallNoArgs(app->lifespan_startup);
+uint8_t AsgiApp_lifespan_shutdown(AsgiApp *app) {
+  PyGILState_STATE gstate = PyGILState_Ensure();
 
-  uint8_t status = result == Py_True;
+  uint8_t status = 1;
+  for (size_t i = 0; i < app->loops_count; i++) {
+    AsgiLoop *loop = app->loops[i];
+    if (loop->lifespan_shutdown == NULL) {
+      continue;
+    }
+    PyObject *result = PyObject_CallNoArgs(loop->lifespan_shutdown);
+    if (result != Py_True) {
+      status = 0;
+    }
+    Py_XDECREF(result);
+  }
 
   PyGILState_Release(gstate);
 
   return status;
 }
 
-uint8_t AsgiApp_lifespan_shutdown(AsgiApp *app) {
-  if (app->lifespan_shutdown == NULL) {
-    return 1;
+// AsgiWaiter is awaited by send and receive until Go completes the operation.
+// It is its own iterator: when it isn't complete yet it yields a future of the
+// event loop to the task, the task resumes it once the future is resolved.
+typedef struct {
+  PyObject_HEAD PyObject *loop;
+  PyObject *future;
+  uint8_t done;
+  // Set with done when the operation failed, the await raises MemoryError
+  uint8_t failed;
+} AsgiWaiter;
+
+static PyObject *AsgiWaiter_await(AsgiWaiter *self) { return Py_NewRef(self); }
+
+static PyObject *AsgiWaiter_next(AsgiWaiter *self) {
+  if (self->done) {
+    // Completed, the next send or receive waits again
+    self->done = 0;
+    Py_CLEAR(self->future);
+    if (self->failed) {
+      self->failed = 0;
+      return PyErr_NoMemory();
+    }
+    return NULL;
+  }
+  if (!self->future) {
+    self->future = PyObject_CallMethod(self->loop, "create_future", NULL);
+    if (!self->future) {
+      return NULL;
+    }
+  }
+  // Tasks only wait for the futures that they find blocking
+  if (PyObject_SetAttrString(self->future, "_asyncio_future_blocking",
+                             Py_True) < 0) {
+    return NULL;
   }
+  return Py_NewRef(self->future);
+}
 
-  PyGILState_STATE gstate = PyGILState_Ensure();
+static void AsgiWaiter_complete(AsgiWaiter *self) {
+  self->done = 1;
+  if (self->future) {
+    PyObject *result =
+        PyObject_CallMethod(self->future, "set_result", "O", Py_None);
+    if (!result) {
+      // The task was cancelled
+      PyErr_Clear();
+    }
+    Py_XDECREF(result);
+  }
+}
 
-  PyObject *result = PyObject_CallNoArgs(app->lifespan_shutdown);
+static int AsgiWaiter_traverse(AsgiWaiter *self, visitproc visit, void *arg) {
+  Py_VISIT(self->loop);
+  Py_VISIT(self->future);
+  return 0;
+}
 
-  uint8_t status = result == Py_True;
+static int AsgiWaiter_clear(AsgiWaiter *self) {
+  Py_CLEAR(self->loop);
+  Py_CLEAR(self->future);
+  return 0;
+}
 
-  PyGILState_Release(gstate);
+static void AsgiWaiter_dealloc(AsgiWaiter *self) {
+  PyObject_GC_UnTrack(self);
+  AsgiWaiter_clear(self);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
 
-  return status;
+static PyAsyncMethods AsgiWaiter_async = {
+    .am_await = (unaryfunc)AsgiWaiter_await,
+};
+
+static PyTypeObject AsgiWaiterType = {
+    .ob_base = PyVarObject_HEAD_INIT(NULL, 0).tp_name = "caddysnake.AsgiWaiter",
+    .tp_doc = PyDoc_STR("Awaitable completed by Go"),
+    .tp_basicsize = sizeof(AsgiWaiter),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .tp_as_async = &AsgiWaiter_async,
+    .tp_iter = PyObject_SelfIter,
+    .tp_iternext = (iternextfunc)AsgiWaiter_next,
+    .tp_traverse = (traverseproc)AsgiWaiter_traverse,
+    .tp_clear = (inquiry)AsgiWaiter_clear,
+    .tp_dealloc = (destructor)AsgiWaiter_dealloc,
+};
+
+static AsgiWaiter *AsgiWaiter_new(PyObject *loop) {
+  AsgiWaiter *self = PyObject_GC_New(AsgiWaiter, &AsgiWaiterType);
+  if (self) {
+    self->loop = Py_NewRef(loop);
+    self->future = NULL;
+    self->done = 0;
+    self->failed = 0;
+    PyObject_GC_Track(self);
+  }
+  return self;
 }
 
+// ASGI: Go completes the operations of the requests from its own threads.
+// Completions are pushed to a lock-free stack of the loop of the request
+// without taking the GIL and the loop runs all the pending ones in a single
+// callback. Only the push
+// that finds the stack empty writes to the wakeup pipe, the rest are picked up
+// by the same drain.
+#define ASGI_COMPLETION_SET 0
+#define ASGI_COMPLETION_SET_WEBSOCKET 1
+#define ASGI_COMPLETION_RELEASE 2
+// The operation failed because its completion couldn't be allocated
+#define ASGI_COMPLETION_FAIL 3
+
+typedef struct AsgiCompletion {
+  struct AsgiCompletion *next;
+  AsgiEvent *event;
+  char *body;
+  size_t body_len;
+  uint8_t kind;
+  // more_body for ASGI_COMPLETION_SET, message type for websockets
+  uint8_t flag;
+  uint8_t is_send;
+  // Set when the completion is part of its event instead of allocated
+  uint8_t embedded;
+} AsgiCompletion;
+
 struct AsgiEvent {
-  PyObject_HEAD AsgiApp *app;
+  PyObject_HEAD AsgiLoop *loop;
   uint64_t request_id;
-  PyObject *event_ts_send;
-  PyObject *event_ts_receive;
+  AsgiWaiter *send_waiter;
+  AsgiWaiter *receive_waiter;
   PyObject *future;
+  // The last body chunk, or the websocket message that receive returns next
   PyObject *request_body;
+  // more_body of the chunk, or the type of the websocket message
   uint8_t more_body;
   uint8_t websockets_state;
+  // Written by the loop, Go reads them once the response is done
+  RequestTimings timings;
+  // Completions that don't need memory: release runs once per event, and the
+  // failures of receive and send are used when a completion can't be
+  // allocated. Each of them waits for one operation at a time.
+  AsgiCompletion release;
+  AsgiCompletion failures[2];
 };
 
 #define WS_NONE 0
@@ -555,19 +2211,21 @@ static PyObject *AsgiEvent_new(PyTypeObject *type, PyObject *args,
   self = (AsgiEvent *)type->tp_alloc(type, 0);
   if (self != NULL) {
     self->request_id = 0;
-    self->event_ts_send = NULL;
-    self->event_ts_receive = NULL;
+    self->loop = NULL;
+    self->send_waiter = NULL;
+    self->receive_waiter = NULL;
     self->future = NULL;
     self->request_body = NULL;
     self->more_body = 0;
     self->websockets_state = WS_NONE;
+    self->timings = (RequestTimings){0};
   }
   return (PyObject *)self;
 }
 
 static void AsgiEvent_dealloc(AsgiEvent *self) {
-  Py_XDECREF(self->event_ts_send);
-  Py_XDECREF(self->event_ts_receive);
+  Py_XDECREF(self->send_waiter);
+  Py_XDECREF(self->receive_waiter);
   // Future is freed in AsgiEvent_result
   // Py_XDECREF(self->future);
   // Request body is also freed in AsgiEvent_set
@@ -575,59 +2233,257 @@ static void AsgiEvent_dealloc(AsgiEvent *self) {
   Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
-void AsgiEvent_cleanup(AsgiEvent *event) {
-  PyGILState_STATE gstate = PyGILState_Ensure();
-  Py_DECREF(event);
-  PyGILState_Release(gstate);
+
+static void AsgiCompletion_push(AsgiEvent *event, char *body, size_t body_len,
+                                uint8_t kind, uint8_t flag, uint8_t is_send) {
+  AsgiCompletion *completion;
+  if (kind == ASGI_COMPLETION_RELEASE) {
+    completion = &event->release;
+  } else {
+    completion = malloc(sizeof(AsgiCompletion));
+  }
+  if (completion == NULL) {
+    // This runs without the GIL, the operation fails in the app instead
+    free(body);
+    body = NULL;
+    body_len = 0;
+    kind = ASGI_COMPLETION_FAIL;
+    completion = &event->failures[is_send != 0];
+  }
+  completion->embedded =
+      kind == ASGI_COMPLETION_RELEASE || kind == ASGI_COMPLETION_FAIL;
+  completion->event = event;
+  completion->body = body;
+  completion->body_len = body_len;
+  completion->kind = kind;
+  completion->flag = flag;
+  completion->is_send = is_send;
+  // The event can be released as soon as the completion is pushed
+  AsgiLoop *loop = event->loop;
+  AsgiCompletion *head = atomic_load(&loop->completions);
+  do {
+    completion->next = head;
+  } while (
+      !atomic_compare_exchange_weak(&loop->completions, &head, completion));
+  if (head == NULL) {
+    // A full pipe means that a wakeup is already pending
+    char byte = 0;
+    ssize_t written = write(loop->wakeup_fds[1], &byte, 1);
+    (void)written;
+  }
+  if (kind == ASGI_COMPLETION_RELEASE) {
+    AsgiLoop_release(loop);
+  }
 }
 
-void AsgiEvent_set(AsgiEvent *self, const char *body, uint8_t more_body,
-                   uint8_t is_send) {
-  PyGILState_STATE gstate = PyGILState_Ensure();
-  if (body) {
-    if (self->request_body) {
-      Py_DECREF(self->request_body);
+static void AsgiCompletion_run(AsgiCompletion *completion) {
+  AsgiEvent *self = completion->event;
+  if (completion->kind == ASGI_COMPLETION_RELEASE) {
+    Py_DECREF(self);
+    return;
+  }
+  if (completion->kind == ASGI_COMPLETION_FAIL) {
+    AsgiWaiter *waiter =
+        completion->is_send ? self->send_waiter : self->receive_waiter;
+    waiter->failed = 1;
+    AsgiWaiter_complete(waiter);
+    return;
+  }
+  const char *body = completion->body;
+  Py_BEGIN_CRITICAL_SECTION(self);
+  if (completion->kind == ASGI_COMPLETION_SET) {
+    if (body) {
+      Py_XDECREF(self->request_body);
+      self->request_body =
+          PyBytes_FromStringAndSize(body, completion->body_len);
     }
-    self->request_body = PyBytes_FromString(body);
+    self->more_body = completion->flag;
+  } else if (body) {
+    // Go queues the messages, receive only gets one at a time
+    Py_XDECREF(self->request_body);
+    if (completion->flag == 0) {
+      self->request_body =
+          PyUnicode_DecodeUTF8(body, completion->body_len, "replace");
+    } else {
+      self->request_body =
+          PyBytes_FromStringAndSize(body, completion->body_len);
+    }
+    self->more_body = completion->flag;
   }
-  self->more_body = more_body;
-  PyObject *set_fn = NULL;
-  if (is_send) {
-    set_fn = PyObject_GetAttrString((PyObject *)self->event_ts_send, "set");
-  } else {
-    set_fn = PyObject_GetAttrString((PyObject *)self->event_ts_receive, "set");
+  Py_END_CRITICAL_SECTION();
+  AsgiWaiter_complete(completion->is_send ? self->send_waiter
+                                          : self->receive_waiter);
+}
+
+// Called by the event loop when the wakeup pipe is readable, self is a capsule
+// with the AsgiLoop.
+static PyObject *asgi_drain_completions(PyObject *self, PyObject *unused) {
+  AsgiLoop *loop = PyCapsule_GetPointer(self, NULL);
+  // The loop took the GIL back to run this drain
+  count_gil_acquisition();
+  // The pipe is emptied first, a push that happens after the exchange writes
+  // to it again and schedules another drain.
+  char buffer[64];
+  while (read(loop->wakeup_fds[0], buffer, sizeof(buffer)) > 0) {
   }
-  PyObject_CallNoArgs(set_fn);
-  Py_DECREF(set_fn);
-  PyGILState_Release(gstate);
+  AsgiCompletion *completion = atomic_exchange(&loop->completions, NULL);
+  // Reverse the stack to run completions in the order they were pushed
+  AsgiCompletion *ordered = NULL;
+  while (completion) {
+    AsgiCompletion *next = completion->next;
+    completion->next = ordered;
+    ordered = completion;
+    completion = next;
+  }
+  while (ordered) {
+    AsgiCompletion *next = ordered->next;
+    // Releasing the event can free its completions
+    char *body = ordered->body;
+    uint8_t embedded = ordered->embedded;
+    AsgiCompletion_run(ordered);
+    free(body);
+    if (!embedded) {
+      free(ordered);
+    }
+    ordered = next;
+  }
+  Py_RETURN_NONE;
 }
 
-void AsgiEvent_set_websocket(AsgiEvent *self, const char *body,
-                             uint8_t message_type, uint8_t is_send) {
-  PyGILState_STATE gstate = PyGILState_Ensure();
-  if (body) {
-    if (!self->request_body) {
-      self->request_body = PyList_New(0);
+static PyMethodDef asgi_drain_completions_def = {
+    "drain_completions", (PyCFunction)asgi_drain_completions, METH_NOARGS,
+    "Run the completions pushed by Go."};
+
+// Called by the lag probe of the event loop with the seconds that it ran
+// late, self is a capsule with the AsgiLoop.
+static PyObject *asgi_record_lag(PyObject *self, PyObject *seconds) {
+  AsgiLoop *loop = PyCapsule_GetPointer(self, NULL);
+  double lag = PyFloat_AsDouble(seconds);
+  if (lag == -1.0 && PyErr_Occurred()) {
+    return NULL;
+  }
+  atomic_store(&loop->lag, (int64_t)(lag * 1e9));
+  Py_RETURN_NONE;
+}
+
+static PyMethodDef asgi_record_lag_def = {
+    "record_lag", (PyCFunction)asgi_record_lag, METH_O,
+    "Store how late the event loop runs callbacks."};
+
+static void AsgiLoop_release(AsgiLoop *loop) {
+  if (atomic_fetch_sub(&loop->refs, 1) != 1) {
+    return;
+  }
+  // Completions that were pushed after the loop stopped never run, the
+  // events they reference are leaked.
+  AsgiCompletion *completion = atomic_exchange(&loop->completions, NULL);
+  while (completion) {
+    AsgiCompletion *next = completion->next;
+    free(completion->body);
+    if (!completion->embedded) {
+      free(completion);
     }
-    PyObject *tuple = PyTuple_New(2);
-    if (message_type == 0) {
-      PyTuple_SetItem(tuple, 0, PyUnicode_FromString(body));
-    } else {
-      PyTuple_SetItem(tuple, 0, PyBytes_FromString(body));
+    completion = next;
+  }
+  close(loop->wakeup_fds[0]);
+  close(loop->wakeup_fds[1]);
+  free(loop);
+}
+
+static void AsgiLoop_capsule_release(PyObject *capsule) {
+  AsgiLoop_release(PyCapsule_GetPointer(capsule, NULL));
+}
+
+// Creates a wakeup pipe and starts an event loop that drains it. The pipe is
+// non-blocking and it's not inherited by worker processes.
+static AsgiLoop *AsgiLoop_new(uint8_t uvloop) {
+  AsgiLoop *loop = calloc(1, sizeof(AsgiLoop));
+  if (!loop) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+  if (pipe(loop->wakeup_fds) < 0) {
+    PyErr_SetFromErrno(PyExc_OSError);
+    free(loop);
+    return NULL;
+  }
+  for (int i = 0; i < 2; i++) {
+    int flags = fcntl(loop->wakeup_fds[i], F_GETFL);
+    if (fcntl(loop->wakeup_fds[i], F_SETFL, flags | O_NONBLOCK) < 0 ||
+        fcntl(loop->wakeup_fds[i], F_SETFD, FD_CLOEXEC) < 0) {
+      PyErr_SetFromErrno(PyExc_OSError);
+      close(loop->wakeup_fds[0]);
+      close(loop->wakeup_fds[1]);
+      free(loop);
+      return NULL;
     }
-    PyTuple_SetItem(tuple, 1, PyLong_FromLong(message_type));
-    PyList_Append(self->request_body, tuple);
-    Py_DECREF(tuple); // WARNING: not sure if this should go here
   }
-  PyObject *set_fn = NULL;
-  if (is_send) {
-    set_fn = PyObject_GetAttrString((PyObject *)self->event_ts_send, "set");
-  } else {
-    set_fn = PyObject_GetAttrString((PyObject *)self->event_ts_receive, "set");
+  // The capsule owns the first reference
+  atomic_init(&loop->refs, 1);
+  atomic_init(&loop->lag, 0);
+  PyObject *capsule = PyCapsule_New(loop, NULL, AsgiLoop_capsule_release);
+  if (!capsule) {
+    close(loop->wakeup_fds[0]);
+    close(loop->wakeup_fds[1]);
+    free(loop);
+    return NULL;
   }
-  PyObject_CallNoArgs(set_fn);
-  Py_DECREF(set_fn);
-  PyGILState_Release(gstate);
+  PyObject *drain_completions =
+      PyCFunction_New(&asgi_drain_completions_def, capsule);
+  PyObject *record_lag = PyCFunction_New(&asgi_record_lag_def, capsule);
+  Py_DECREF(capsule);
+  if (!drain_completions || !record_lag) {
+    Py_XDECREF(drain_completions);
+    Py_XDECREF(record_lag);
+    return NULL;
+  }
+  // On failure the loop is freed along with the callbacks
+  PyObject *event_loop = PyObject_CallFunction(
+      start_loop, "iOOO", loop->wakeup_fds[0], drain_completions, record_lag,
+      uvloop ? Py_True : Py_False);
+  Py_DECREF(drain_completions);
+  Py_DECREF(record_lag);
+  if (!event_loop) {
+    return NULL;
+  }
+  loop->loop = event_loop;
+  loop->state = PyDict_New();
+  // Reference of the app
+  atomic_fetch_add(&loop->refs, 1);
+  return loop;
+}
+
+void AsgiEvent_cleanup(AsgiEvent *event) {
+  AsgiCompletion_push(event, NULL, 0, ASGI_COMPLETION_RELEASE, 0, 0);
+}
+
+// Returns the timings of a request, it must be called before the event is
+// released.
+RequestTimings AsgiEvent_timings(AsgiEvent *event) { return event->timings; }
+
+// Returns the lag of the slowest event loop of the app in nanoseconds.
+int64_t AsgiApp_loop_lag(AsgiApp *app) {
+  int64_t lag = 0;
+  for (size_t i = 0; i < app->loops_count; i++) {
+    int64_t loop_lag = atomic_load(&app->loops[i]->lag);
+    if (loop_lag > lag) {
+      lag = loop_lag;
+    }
+  }
+  return lag;
+}
+
+// The body is freed once the completion runs
+void AsgiEvent_set(AsgiEvent *self, char *body, size_t body_len,
+                   uint8_t more_body, uint8_t is_send) {
+  AsgiCompletion_push(self, body, body_len, ASGI_COMPLETION_SET, more_body,
+                      is_send);
+}
+
+void AsgiEvent_set_websocket(AsgiEvent *self, char *body, size_t body_len,
+                             uint8_t message_type, uint8_t is_send) {
+  AsgiCompletion_push(self, body, body_len, ASGI_COMPLETION_SET_WEBSOCKET,
+                      message_type, is_send);
 }
 
 void AsgiEvent_connect_websocket(AsgiEvent *self) {
@@ -642,8 +2498,8 @@ static PyObject *AsgiEvent_receive_start(AsgiEvent *self, PyObject *args) {
   PyObject *result = Py_False;
   if (asgi_receive_start(self->request_id, self) == 1) {
     // WARNING: should I incref here?
-    Py_INCREF(self->event_ts_receive);
-    result = self->event_ts_receive;
+    Py_INCREF(self->receive_waiter);
+    result = (PyObject *)self->receive_waiter;
   }
 #if PY_MINOR_VERSION < 12
   if (result == Py_False)
@@ -652,7 +2508,7 @@ static PyObject *AsgiEvent_receive_start(AsgiEvent *self, PyObject *args) {
   return result;
 }
 
-static PyObject *AsgiEvent_receive_end(AsgiEvent *self, PyObject *args) {
+static PyObject *AsgiEvent_receive_data(AsgiEvent *self) {
   PyObject *data = PyDict_New();
   switch (self->websockets_state) {
   case WS_NONE: {
@@ -676,19 +2532,9 @@ static PyObject *AsgiEvent_receive_end(AsgiEvent *self, PyObject *args) {
     } else {
       PyObject *data_type = PyUnicode_FromString("websocket.receive");
       PyDict_SetItemString(data, "type", data_type);
-      PyObject *pop_fn = PyObject_GetAttrString(self->request_body, "pop");
-      PyObject *ix = PyLong_FromLong(0);
-      PyObject *message = PyObject_CallOneArg(pop_fn, ix);
-      PyObject *message_data = PyTuple_GetItem(message, 0);
-      PyObject *message_type = PyTuple_GetItem(message, 1);
-      if (message_type == ix) {
-        PyDict_SetItemString(data, "text", message_data);
-      } else {
-        PyDict_SetItemString(data, "bytes", message_data);
-      }
-      Py_DECREF(message); // WARNING: not sure if this should be here
-      Py_DECREF(ix);      // WARNING: not sure if this should be here
-      Py_DECREF(pop_fn);
+      PyDict_SetItemString(data, self->more_body == 0 ? "text" : "bytes",
+                           self->request_body);
+      Py_CLEAR(self->request_body);
       Py_DECREF(data_type);
     }
     break;
@@ -700,25 +2546,17 @@ static PyObject *AsgiEvent_receive_end(AsgiEvent *self, PyObject *args) {
     Py_DECREF(data_type);
     PyObject *default_code = PyLong_FromLong(1005);
     PyObject *close_code = default_code;
-    if (self->request_body && PyList_Size(self->request_body) > 0) {
-      PyObject *pop_fn = PyObject_GetAttrString(self->request_body, "pop");
-      PyObject *ix = PyLong_FromLong(0);
-      PyObject *message = PyObject_CallOneArg(pop_fn, ix);
-      PyObject *message_data = PyTuple_GetItem(message, 0);
-      PyObject *message_type = PyTuple_GetItem(message, 1);
-      if (message_type == ix) {
-        close_code = PyLong_FromUnicodeObject(message_data, 10);
-        if (!close_code) {
-          if (PyErr_Occurred()) {
-            PyErr_Clear();
-          }
-          close_code = default_code;
+    // The close code is sent as a text message
+    if (self->request_body && PyUnicode_Check(self->request_body)) {
+      close_code = PyLong_FromUnicodeObject(self->request_body, 10);
+      if (!close_code) {
+        if (PyErr_Occurred()) {
+          PyErr_Clear();
         }
+        close_code = default_code;
       }
-      Py_DECREF(message); // WARNING: not sure if this should be here
-      Py_DECREF(ix);      // WARNING: not sure if this should be here
-      Py_DECREF(pop_fn);
     }
+    Py_CLEAR(self->request_body);
     PyDict_SetItemString(data, "code", close_code);
     if (close_code != default_code) {
       Py_DECREF(close_code); // WARNING: not sure if this should be here
@@ -730,6 +2568,14 @@ static PyObject *AsgiEvent_receive_end(AsgiEvent *self, PyObject *args) {
   return data;
 }
 
+static PyObject *AsgiEvent_receive_end(AsgiEvent *self, PyObject *args) {
+  PyObject *data;
+  Py_BEGIN_CRITICAL_SECTION(self);
+  data = AsgiEvent_receive_data(self);
+  Py_END_CRITICAL_SECTION();
+  return data;
+}
+
 uint8_t is_weboscket_closed(PyObject *exc) {
   if (PyErr_GivenExceptionMatches(exc, websocket_closed)) {
     return 1;
@@ -778,47 +2624,83 @@ static PyObject *AsgiEvent_result(AsgiEvent *self, PyObject *args) {
   Py_RETURN_NONE;
 }
 
-static PyObject *AsgiEvent_send(AsgiEvent *self, PyObject *args) {
+// Packs the headers of an ASGI response, headers can be missing. The selected
+// websocket subprotocol is sent as another header when it's not NULL or None.
+static MapKeyVal *asgi_headers(PyObject *headers, PyObject *subprotocol) {
+  uint8_t has_subprotocol = subprotocol && subprotocol != Py_None;
+  if ((!headers || headers == Py_None) && !has_subprotocol) {
+    return MapKeyVal_new(0, 0);
+  }
+  PyObject *pairs = headers && headers != Py_None ? PySequence_List(headers)
+                                                  : PyList_New(0);
+  if (pairs == NULL) {
+    return NULL;
+  }
+  if (has_subprotocol) {
+    PyObject *value = PyUnicode_Check(subprotocol)
+                          ? PyUnicode_AsUTF8String(subprotocol)
+                          : Py_NewRef(subprotocol);
+    PyObject *pair =
+        value ? Py_BuildValue("(yN)", "sec-websocket-protocol", value) : NULL;
+    if (pair == NULL || PyList_Append(pairs, pair) < 0) {
+      Py_XDECREF(pair);
+      Py_DECREF(pairs);
+      return NULL;
+    }
+    Py_DECREF(pair);
+  }
+  MapKeyVal *map = MapKeyVal_from_pairs(
+      pairs, 1, "expected response headers to be pairs of bytes");
+  Py_DECREF(pairs);
+  return map;
+}
+
+// Packs the links of an early hint as Link headers.
+static MapKeyVal *asgi_links(PyObject *links) {
+  if (links == NULL || links == Py_None) {
+    return MapKeyVal_new(0, 0);
+  }
+  PyObject *items = PySequence_Fast(links, "expected links to be a list");
+  if (items == NULL) {
+    return NULL;
+  }
+  Py_ssize_t count = PySequence_Fast_GET_SIZE(items);
+  PyObject *pairs = PyList_New(count);
+  for (Py_ssize_t i = 0; pairs && i < count; i++) {
+    PyObject *pair = Py_BuildValue("(yO)", "link",
+                                   PySequence_Fast_GET_ITEM(items, i));
+    if (pair == NULL) {
+      Py_CLEAR(pairs);
+      break;
+    }
+    PyList_SET_ITEM(pairs, i, pair);
+  }
+  Py_DECREF(items);
+  if (pairs == NULL) {
+    return NULL;
+  }
+  MapKeyVal *map =
+      MapKeyVal_from_pairs(pairs, 1, "expected links to be bytes");
+  Py_DECREF(pairs);
+  return map;
+}
+
+static PyObject *AsgiEvent_send_message(AsgiEvent *self, PyObject *args) {
   PyObject *data = PyTuple_GetItem(args, 0);
   PyObject *data_type = PyDict_GetItemString(data, "type");
   if (PyUnicode_CompareWithASCIIString(data_type, "http.response.start") == 0) {
     PyObject *status_code = PyDict_GetItemString(data, "status");
     PyObject *headers = PyDict_GetItemString(data, "headers");
 
-    PyObject *iterator = PyObject_GetIter(headers);
-    Py_ssize_t headers_count = 0;
-    if (PyTuple_Check(headers)) {
-      headers_count = PyTuple_Size(headers);
-    } else if (PyList_Check(headers)) {
-      headers_count = PyList_Size(headers);
-    }
-    MapKeyVal *http_headers = MapKeyVal_new(headers_count);
-
-    PyObject *key, *value, *item;
-    size_t pos = 0;
-    size_t len = 0;
-    while ((item = PyIter_Next(iterator))) {
-      // if (!PyTuple_Check(item) || PyTuple_Size(item) != 2) {
-      //   PyErr_SetString(PyExc_RuntimeError,
-      //                   "expected response headers to be tuples with 2
-      //                   items");
-      //   PyErr_Print();
-      //   Py_DECREF(item);
-      //   Py_DECREF(iterator);
-      //   MapKeyVal_free(http_headers, pos);
-      //   goto finalize_error;
-      // }
-      key = PyTuple_GetItem(item, 0);
-      value = PyTuple_GetItem(item, 1);
-      http_headers->keys[pos] = copy_pybytes(key, &len);
-      http_headers->values[pos] = copy_pybytes(value, &len);
-      Py_DECREF(item);
-      pos++;
+    PyObject *trailers = PyDict_GetItemString(data, "trailers");
+
+    MapKeyVal *http_headers = asgi_headers(headers, NULL);
+    if (http_headers == NULL) {
+      return NULL;
     }
-    Py_DECREF(iterator);
 
     asgi_set_headers(self->request_id, PyLong_AsLong(status_code), http_headers,
-                     self);
+                     trailers && PyObject_IsTrue(trailers) == 1, self);
   } else if (PyUnicode_CompareWithASCIIString(data_type,
                                               "http.response.body") == 0) {
     PyObject *more_body = PyDict_GetItemString(data, "more_body");
@@ -827,10 +2709,58 @@ static PyObject *AsgiEvent_send(AsgiEvent *self, PyObject *args) {
         PyObject_RichCompareBool(more_body, Py_False, Py_EQ) == 1) {
       send_more_body = 0;
     }
+    // The body is optional, the last message often goes without it
     PyObject *pybody = PyDict_GetItemString(data, "body");
     size_t body_len = 0;
-    char *body = copy_pybytes(pybody, &body_len);
+    char *body = pybody ? copy_pybytes(pybody, &body_len) : NULL;
     asgi_send_response(self->request_id, body, body_len, send_more_body, self);
+  } else if (PyUnicode_CompareWithASCIIString(data_type,
+                                              "http.response.trailers") == 0) {
+    PyObject *headers = PyDict_GetItemString(data, "headers");
+    PyObject *more_trailers = PyDict_GetItemString(data, "more_trailers");
+
+    MapKeyVal *http_trailers = asgi_headers(headers, NULL);
+    if (http_trailers == NULL) {
+      return NULL;
+    }
+
+    asgi_send_trailers(self->request_id, http_trailers,
+                       more_trailers && PyObject_IsTrue(more_trailers) == 1,
+                       self);
+  } else if (PyUnicode_CompareWithASCIIString(
+                 data_type, "http.response.early_hint") == 0) {
+    MapKeyVal *links = asgi_links(PyDict_GetItemString(data, "links"));
+    if (links == NULL) {
+      return NULL;
+    }
+
+    asgi_send_early_hint(self->request_id, links, self);
+  } else if (PyUnicode_CompareWithASCIIString(data_type,
+                                              "http.response.push") == 0) {
+    PyObject *path = PyDict_GetItemString(data, "path");
+    if (path == NULL || !PyUnicode_Check(path)) {
+      PyErr_SetString(PyExc_TypeError, "expected the push path to be a str");
+      return NULL;
+    }
+    PyObject *headers = PyDict_GetItemString(data, "headers");
+
+    MapKeyVal *push_headers = asgi_headers(headers, NULL);
+    if (push_headers == NULL) {
+      return NULL;
+    }
+
+    asgi_send_push(self->request_id, copy_pystring(path, NULL), push_headers,
+                   self);
+  } else if (PyUnicode_CompareWithASCIIString(data_type,
+                                              "http.response.pathsend") == 0) {
+    PyObject *path = PyDict_GetItemString(data, "path");
+    if (path == NULL || !PyUnicode_Check(path)) {
+      PyErr_SetString(PyExc_TypeError,
+                      "expected the pathsend path to be a str");
+      return NULL;
+    }
+
+    asgi_send_pathsend(self->request_id, copy_pystring(path, NULL), self);
   } else if (PyUnicode_CompareWithASCIIString(data_type, "websocket.accept") ==
              0) {
     if (self->websockets_state == WS_DISCONNECTED) {
@@ -840,55 +2770,12 @@ static PyObject *AsgiEvent_send(AsgiEvent *self, PyObject *args) {
     PyObject *headers = PyDict_GetItemString(data, "headers");
     PyObject *subprotocol = PyDict_GetItemString(data, "subprotocol");
 
-    Py_ssize_t headers_count = 0;
-    PyObject *iterator = NULL;
-    if (headers) {
-      iterator = PyObject_GetIter(headers);
-      if (PyTuple_Check(headers)) {
-        headers_count = PyTuple_Size(headers);
-      } else if (PyList_Check(headers)) {
-        headers_count = PyList_Size(headers);
-      }
-    }
-    if (subprotocol && subprotocol != Py_None) {
-      headers_count += 1;
-    }
-
-    MapKeyVal *http_headers = MapKeyVal_new(headers_count);
-    size_t pos = 0;
-    size_t len = 0;
-
-    if (iterator) {
-      PyObject *key, *value, *item;
-      while ((item = PyIter_Next(iterator))) {
-        // if (!PyTuple_Check(item) || PyTuple_Size(item) != 2) {
-        //   PyErr_SetString(PyExc_RuntimeError,
-        //                   "expected response headers to be tuples with 2
-        //                   items");
-        //   PyErr_Print();
-        //   Py_DECREF(item);
-        //   Py_DECREF(iterator);
-        //   MapKeyVal_free(http_headers, pos);
-        //   goto finalize_error;
-        // }
-        key = PyTuple_GetItem(item, 0);
-        value = PyTuple_GetItem(item, 1);
-        http_headers->keys[pos] = copy_pybytes(key, &len);
-        http_headers->values[pos] = copy_pybytes(value, &len);
-        Py_DECREF(item);
-        pos++;
-      }
-      Py_DECREF(iterator);
+    MapKeyVal *http_headers = asgi_headers(headers, subprotocol);
+    if (http_headers == NULL) {
+      return NULL;
     }
 
-    if (subprotocol && subprotocol != Py_None) {
-      http_headers->keys[pos] =
-          concatenate_strings("sec-websocket-protocol", "");
-      http_headers->values[pos] = copy_pybytes(subprotocol, &len);
-      pos++;
-    }
-
-    asgi_set_headers(self->request_id, 101, http_headers, self);
+    asgi_set_headers(self->request_id, 101, http_headers, 0, self);
 
     if (self->websockets_state == WS_DISCONNECTED) {
       goto websocket_error;
@@ -905,7 +2792,7 @@ static PyObject *AsgiEvent_send(AsgiEvent *self, PyObject *args) {
     size_t body_len = 0;
     uint8_t message_type = 0;
     if (data_text) {
-      body = copy_pystring(data_text);
+      body = copy_pystring(data_text, &body_len);
       message_type = 0;
     } else {
       body = copy_pybytes(PyDict_GetItemString(data, "bytes"), &body_len);
@@ -932,7 +2819,7 @@ static PyObject *AsgiEvent_send(AsgiEvent *self, PyObject *args) {
     }
     char *reason = NULL;
     if (close_reason) {
-      reason = copy_pystring(close_reason);
+      reason = copy_pystring(close_reason, NULL);
     }
 
     asgi_cancel_request_websocket(self->request_id, reason, code);
@@ -952,8 +2839,16 @@ websocket_error:
 
 finalize_send:
   // WARNING: should I incref here?
-  Py_INCREF(self->event_ts_send);
-  return self->event_ts_send;
+  Py_INCREF(self->send_waiter);
+  return (PyObject *)self->send_waiter;
+}
+
+// Sends a message of the app, the time that it takes is marshalling.
+static PyObject *AsgiEvent_send(AsgiEvent *self, PyObject *args) {
+  int64_t start = monotonic_ns();
+  PyObject *result = AsgiEvent_send_message(self, args);
+  self->timings.marshal += monotonic_ns() - start;
+  return result;
 }
 
 static PyMethodDef AsgiEvent_methods[] = {
@@ -979,56 +2874,91 @@ static PyTypeObject AsgiEventType = {
     .tp_methods = AsgiEvent_methods,
 };
 
-void AsgiApp_handle_request(AsgiApp *app, uint64_t request_id, MapKeyVal *scope,
-                            MapKeyVal *headers, const char *client_host,
-                            int client_port, const char *server_host,
-                            int server_port, const char *subprotocols) {
+// Advertises an extension in the scope, each one gets a dict for its
+// settings even if it has none.
+static void asgi_add_extension(PyObject *extensions, const char *name) {
+  PyObject *settings = PyDict_New();
+  PyDict_SetItemString(extensions, name, settings);
+  Py_DECREF(settings);
+}
+
+// Returns the event of the request, it must be released with AsgiEvent_cleanup
+AsgiEvent *AsgiApp_handle_request(AsgiApp *app, size_t loop_index,
+                                  uint64_t request_id, MapKeyVal *scope,
+                                  MapKeyVal *headers, const char *client_host,
+                                  int client_port, const char *server_host,
+                                  int server_port, const char *subprotocols,
+                                  uint8_t extensions) {
+  int64_t start = monotonic_ns();
   PyGILState_STATE gstate = PyGILState_Ensure();
+  int64_t acquired = monotonic_ns();
+  count_gil_acquisition();
+  AsgiLoop *loop = app->loops[loop_index];
 
   PyObject *scope_dict = PyDict_New();
-  PyDict_SetItemString(scope_dict, "asgi", asgi_version);
+  scope_set_item(scope_dict, "asgi", asgi_version);
 
   for (int i = 0; i < scope->count; i++) {
     const char *key = scope->keys[i];
+    PyObject *value;
     if (strcmp(key, "raw_path") == 0 || strcmp(key, "query_string") == 0) {
-      PyObject *value = PyBytes_FromString(scope->values[i]);
-      PyDict_SetItemString(scope_dict, key, value);
-
-      Py_DECREF(value);
+      value = PyBytes_FromStringAndSize(scope->values[i],
+                                        scope->value_sizes[i]);
     } else {
-      PyObject *value = PyUnicode_FromString(scope->values[i]);
-      PyDict_SetItemString(scope_dict, key, value);
-
-      Py_DECREF(value);
+      value = scope_value(scope->values[i], scope->value_sizes[i]);
     }
+    scope_set_item(scope_dict, key, value);
+    Py_DECREF(value);
   }
 
   PyObject *headers_tuple = PyTuple_New(headers->count);
   for (int i = 0; i < headers->count; i++) {
     PyObject *element = PyTuple_New(2);
-    PyTuple_SetItem(element, 0, PyBytes_FromString(headers->keys[i]));
-    PyTuple_SetItem(element, 1, PyBytes_FromString(headers->values[i]));
+    PyTuple_SetItem(element, 0,
+                    header_name(headers->keys[i], headers->key_sizes[i]));
+    PyTuple_SetItem(element, 1, PyBytes_FromStringAndSize(
+                                    headers->values[i],
+                                    headers->value_sizes[i]));
     PyTuple_SetItem(headers_tuple, i, element);
   }
-  PyDict_SetItemString(scope_dict, "headers", headers_tuple);
+  scope_set_item(scope_dict, "headers", headers_tuple);
   Py_DECREF(headers_tuple);
 
   PyObject *client_tuple = PyTuple_New(2);
   PyTuple_SetItem(client_tuple, 0, PyUnicode_FromString(client_host));
   PyTuple_SetItem(client_tuple, 1, PyLong_FromLong(client_port));
-  PyDict_SetItemString(scope_dict, "client", client_tuple);
+  scope_set_item(scope_dict, "client", client_tuple);
   Py_DECREF(client_tuple);
 
   PyObject *server_tuple = PyTuple_New(2);
   PyTuple_SetItem(server_tuple, 0, PyUnicode_FromString(server_host));
   PyTuple_SetItem(server_tuple, 1, PyLong_FromLong(server_port));
-  PyDict_SetItemString(scope_dict, "server", server_tuple);
+  scope_set_item(scope_dict, "server", server_tuple);
   Py_DECREF(server_tuple);
 
-  PyObject *state = PyDict_Copy(app->state);
-  PyDict_SetItemString(scope_dict, "state", state);
+  // Each request gets its own copy of the state of the lifespan
+  PyObject *state = PyDict_Copy(loop->state);
+  scope_set_item(scope_dict, "state", state);
   Py_DECREF(state);
 
+  if (extensions) {
+    PyObject *extensions_dict = PyDict_New();
+    if (extensions & ASGI_EXTENSION_TRAILERS) {
+      asgi_add_extension(extensions_dict, "http.response.trailers");
+    }
+    if (extensions & ASGI_EXTENSION_EARLY_HINT) {
+      asgi_add_extension(extensions_dict, "http.response.early_hint");
+    }
+    if (extensions & ASGI_EXTENSION_PUSH) {
+      asgi_add_extension(extensions_dict, "http.response.push");
+    }
+    if (extensions & ASGI_EXTENSION_PATHSEND) {
+      asgi_add_extension(extensions_dict, "http.response.pathsend");
+    }
+    scope_set_item(scope_dict, "extensions", extensions_dict);
+    Py_DECREF(extensions_dict);
+  }
+
   if (subprotocols) {
     PyObject *py_subprotocols = PyUnicode_FromString(subprotocols);
     PyObject *split_list =
@@ -1038,7 +2968,7 @@ void AsgiApp_handle_request(AsgiApp *app, uint64_t request_id, MapKeyVal *scope,
         PyErr_Clear();
       }
     } else {
-      PyDict_SetItemString(scope_dict, "subprotocols", split_list);
+      scope_set_item(scope_dict, "subprotocols", split_list);
       Py_DECREF(split_list);
     }
     Py_DECREF(py_subprotocols);
@@ -1046,21 +2976,13 @@ void AsgiApp_handle_request(AsgiApp *app, uint64_t request_id, MapKeyVal *scope,
 
   AsgiEvent *asgi_event =
       (AsgiEvent *)PyObject_CallObject((PyObject *)&AsgiEventType, NULL);
-  asgi_event->app = app;
+  atomic_fetch_add(&loop->refs, 1);
+  asgi_event->loop = loop;
   asgi_event->request_id = request_id;
-#if PY_MINOR_VERSION == 9
-  PyObject *noargs = PyTuple_New(0);
-  PyObject *kwargs = PyDict_New();
-  PyDict_SetItemString(kwargs, "loop", asyncio_Loop);
-  asgi_event->event_ts_send = PyObject_Call(asyncio_Event_ts, noargs, kwargs);
-  asgi_event->event_ts_receive =
-      PyObject_Call(asyncio_Event_ts, noargs, kwargs);
-  Py_DECREF(kwargs);
-  Py_DECREF(noargs);
-#else
-  asgi_event->event_ts_send = PyObject_CallNoArgs(asyncio_Event_ts);
-  asgi_event->event_ts_receive = PyObject_CallNoArgs(asyncio_Event_ts);
-#endif
+  asgi_event->send_waiter = AsgiWaiter_new(loop->loop);
+  asgi_event->receive_waiter = AsgiWaiter_new(loop->loop);
+  asgi_event->timings.gil_wait = acquired - start;
+  asgi_event->timings.setup = monotonic_ns() - acquired;
 
   PyObject *receive =
       PyObject_CallOneArg(build_receive, (PyObject *)asgi_event);
@@ -1072,11 +2994,23 @@ void AsgiApp_handle_request(AsgiApp *app, uint64_t request_id, MapKeyVal *scope,
   PyTuple_SetItem(args, 2, send);
   PyObject *coro = PyObject_Call(app->handler, args, NULL);
   Py_DECREF(args);
+  if (coro && atomic_load_explicit(&profiling, memory_order_relaxed)) {
+    // The wrapper tells the profiler which request the task is serving
+    PyObject *wrapped = PyObject_CallFunction(profiled, "KO",
+                                              (unsigned long long)request_id,
+                                              coro);
+    if (wrapped) {
+      Py_DECREF(coro);
+      coro = wrapped;
+    } else {
+      PyErr_Clear();
+    }
+  }
 
-  Py_INCREF(asyncio_Loop);
+  Py_INCREF(loop->loop);
   args = PyTuple_New(2);
   PyTuple_SetItem(args, 0, coro);
-  PyTuple_SetItem(args, 1, asyncio_Loop);
+  PyTuple_SetItem(args, 1, loop->loop);
   asgi_event->future =
       PyObject_Call(asyncio_run_coroutine_threadsafe, args, NULL);
   Py_DECREF(args);
@@ -1090,15 +3024,34 @@ void AsgiApp_handle_request(AsgiApp *app, uint64_t request_id, MapKeyVal *scope,
   Py_DECREF(asgi_event_result);
 
   PyGILState_Release(gstate);
+  return asgi_event;
 }
 
+// Stops the event loops of the app. Requests still in flight never finish.
 void AsgiApp_cleanup(AsgiApp *app) {
   PyGILState_STATE gstate = PyGILState_Ensure();
   Py_XDECREF(app->handler);
-  Py_XDECREF(app->state);
-  Py_XDECREF(app->lifespan_startup);
-  Py_XDECREF(app->lifespan_shutdown);
+  for (size_t i = 0; i < app->loops_count; i++) {
+    AsgiLoop *loop = app->loops[i];
+    PyObject *event_loop = loop->loop;
+    loop->loop = NULL;
+    Py_CLEAR(loop->state);
+    Py_CLEAR(loop->lifespan_startup);
+    Py_CLEAR(loop->lifespan_shutdown);
+    AsgiLoop_release(loop);
+
+    PyObject *stop = PyObject_GetAttrString(event_loop, "stop");
+    PyObject *result =
+        PyObject_CallMethod(event_loop, "call_soon_threadsafe", "O", stop);
+    if (!result) {
+      PyErr_Print();
+    }
+    Py_XDECREF(result);
+    Py_DECREF(stop);
+    Py_DECREF(event_loop);
+  }
   PyGILState_Release(gstate);
+  free(app->loops);
   free(app);
 }
 
@@ -1123,56 +3076,58 @@ void Py_init_and_release_gil(const char *setup_py) {
   PyObject *sysPath = PySys_GetObject("path");
   PyList_Insert(sysPath, 0, PyUnicode_FromString(""));
 
-  // Used for turning bytes-like object into a file-like object
-  PyObject *io_module = PyImport_ImportModule("io");
-  BytesIO = PyObject_GetAttrString(io_module, "BytesIO");
-
   // Used for events
   PyObject *asyncio = PyImport_ImportModule("asyncio");
-  PyObject *loop_name = PyUnicode_FromString("new_event_loop");
-  asyncio_Loop = PyObject_CallMethodNoArgs(asyncio, loop_name);
-  Py_DECREF(loop_name);
   asyncio_run_coroutine_threadsafe =
       PyObject_GetAttrString(asyncio, "run_coroutine_threadsafe");
 
-  PyObject *caddysnake_module = PyModule_Create(&CaddysnakeModule);
-  PyObject *response_callback_fn =
-      PyObject_GetAttrString(caddysnake_module, "response_callback");
-
   // Initialize types
-  PyType_Ready(&ResponseType);
+  PyType_Ready(&AsgiWaiterType);
   PyType_Ready(&AsgiEventType);
 
-  // Create setup functions, see file: caddysnake.py
-  PyRun_SimpleString(setup_py);
-  PyObject *main_module = PyImport_AddModule("__main__");
-
-  // WSGI: Setup task queue and consumer threads
-  PyObject *wsgi_setup_fn =
-      PyObject_GetAttrString(main_module, "caddysnake_setup_wsgi");
-  PyObject *task_queue =
-      PyObject_CallOneArg(wsgi_setup_fn, response_callback_fn);
-  task_queue_put = PyObject_GetAttrString(task_queue, "put");
-  PyRun_SimpleString("del caddysnake_setup_wsgi");
-  // Setup WSGI version
-  wsgi_version = PyTuple_New(2);
-  PyTuple_SetItem(wsgi_version, 0, PyLong_FromLong(1));
-  PyTuple_SetItem(wsgi_version, 1, PyLong_FromLong(0));
+  // ASGI: Names used in the scope of every request
+  if (NameCache_init(scope_key_names, ARRAY_SIZE(scope_key_names), scope_keys,
+                     PyUnicode_InternFromString) < 0 ||
+      NameCache_init(value_names, ARRAY_SIZE(value_names), scope_values,
+                     PyUnicode_FromString) < 0 ||
+      NameCache_init(header_names, ARRAY_SIZE(header_names),
+                     scope_header_names, PyBytes_FromString) < 0) {
+    PyErr_Print();
+  }
 
-  // Setup stderr for logging
-  sys_stderr = PySys_GetObject("stderr");
+  // WSGI: Setup the objects of the main interpreter, sub-interpreters use
+  // the same setup code later
+  caddysnake_setup_py = strdup(setup_py);
+  if (WsgiState_init(&main_wsgi_state) < 0) {
+    PyErr_Print();
+  }
+  PyObject *main_module = PyImport_AddModule("__main__");
 
-  // ASGI: Setup wrappers for asyncio events
+  // ASGI: Setup helpers that run apps in event loops
   PyObject *asgi_setup_fn =
       PyObject_GetAttrString(main_module, "caddysnake_setup_asgi");
-  PyObject *asgi_setup_result =
-      PyObject_CallOneArg(asgi_setup_fn, asyncio_Loop);
-  asyncio_Event_ts = PyTuple_GetItem(asgi_setup_result, 0);
-  build_receive = PyTuple_GetItem(asgi_setup_result, 1);
-  build_send = PyTuple_GetItem(asgi_setup_result, 2);
-  build_lifespan = PyTuple_GetItem(asgi_setup_result, 3);
-  websocket_closed = PyTuple_GetItem(asgi_setup_result, 4);
+  PyObject *asgi_setup_result = PyObject_CallNoArgs(asgi_setup_fn);
+  build_receive = PyTuple_GetItem(asgi_setup_result, 0);
+  build_send = PyTuple_GetItem(asgi_setup_result, 1);
+  build_lifespan = PyTuple_GetItem(asgi_setup_result, 2);
+  websocket_closed = PyTuple_GetItem(asgi_setup_result, 3);
+  start_loop = PyTuple_GetItem(asgi_setup_result, 4);
   PyRun_SimpleString("del caddysnake_setup_asgi");
+
+  // PROFILE: Setup the sampler of Python stacks
+  PyObject *profiler_setup_fn =
+      PyObject_GetAttrString(main_module, "caddysnake_setup_profiler");
+  PyObject *profiler_setup_result = PyObject_CallNoArgs(profiler_setup_fn);
+  profile_start = PyTuple_GetItem(profiler_setup_result, 0);
+  profiled = PyTuple_GetItem(profiler_setup_result, 1);
+  profile_threads = PyTuple_GetItem(profiler_setup_result, 2);
+  PyRun_SimpleString("del caddysnake_setup_profiler");
+
+  // RELOAD: Setup the helper that makes apps import again
+  PyObject *reload_setup_fn =
+      PyObject_GetAttrString(main_module, "caddysnake_setup_reload");
+  forget_modules = PyObject_CallNoArgs(reload_setup_fn);
+  PyRun_SimpleString("del caddysnake_setup_reload");
   // Setup ASGI version
   asgi_version = PyDict_New();
   PyDict_SetItemString(asgi_version, "version", PyUnicode_FromString("3.0"));
@@ -1182,11 +3137,7 @@ void Py_init_and_release_gil(const char *setup_py) {
   // This are global objects expected to exist during the entire program
   // lifetime. Refcounts can be safely decreased, but there's no need to do it
   // because we expect the objects to stick around forever.
-  // Py_DECREF(task_queue);
-  // Py_DECREF(wsgi_setup_fn);
-  // Py_DECREF(response_callback_fn);
-  // Py_DECREF(io_module);
-  // Py_DECREF(caddysnake_module);
+  // Py_DECREF(asyncio);
 
   PyEval_ReleaseThread(PyGILState_GetThisThreadState());
   return;
@@ -5,28 +5,33 @@ package caddysnake
 // #include "caddysnake.h"
 import "C"
 import (
+	"bytes"
 	_ "embed"
 	"errors"
 	"fmt"
 	"io"
+	"math"
 	"net"
 	"net/http"
-	"net/textproto"
 	"net/url"
 	"os"
 	"path/filepath"
 	"regexp"
 	"runtime"
+	"slices"
 	"strconv"
 	"strings"
 	"sync"
+	"sync/atomic"
 	"time"
 	"unsafe"
 
 	"github.com/caddyserver/caddy/v2"
 	"github.com/caddyserver/caddy/v2/caddyconfig/caddyfile"
 	"github.com/caddyserver/caddy/v2/caddyconfig/httpcaddyfile"
+	caddycmd "github.com/caddyserver/caddy/v2/cmd"
 	"github.com/caddyserver/caddy/v2/modules/caddyhttp"
+	"github.com/dustin/go-humanize"
 	"github.com/gorilla/websocket"
 	"go.uber.org/zap"
 )
@@ -46,8 +51,94 @@ type CaddySnake struct {
 	ModuleAsgi string `json:"module_asgi,omitempty"`
 	Lifespan   string `json:"lifespan,omitempty"`
 	VenvPath   string `json:"venv_path,omitempty"`
-	logger     *zap.Logger
-	app        AppServer
+	// Workers is the number of Python threads that serve a WSGI app.
+	// Defaults to 2 * NumCPU + 1. With sub-interpreters it's the number
+	// of threads of each interpreter.
+	Workers int `json:"workers,omitempty"`
+	// Interpreters runs the WSGI app in this many sub-interpreters, each
+	// one with its own GIL. Requires Python 3.12 or newer. Zero runs the
+	// app in the main interpreter.
+	Interpreters int `json:"interpreters,omitempty"`
+	// Dispatch is how WSGI requests reach the app: "queue" hands them to
+	// the pool of Python threads, "direct" calls the app from the thread
+	// that serves the HTTP request. Defaults to "queue".
+	Dispatch string `json:"dispatch,omitempty"`
+	// ProcessWorkers serves the WSGI app from this many worker processes,
+	// each one with the configured workers and interpreters. Zero serves
+	// the app from the Caddy process.
+	ProcessWorkers int `json:"process_workers,omitempty"`
+	// MaxRequests is the number of requests after which a worker process
+	// is replaced by a new one. Zero means never.
+	MaxRequests int `json:"max_requests,omitempty"`
+	// QueueLimit is the amount of WSGI requests that can wait for a free
+	// worker. Requests above the limit get a 503 response. Zero means unlimited.
+	QueueLimit int `json:"queue_limit,omitempty"`
+	// StreamRequestBody makes wsgi.input read the request body on demand
+	// instead of buffering it entirely before calling the app.
+	StreamRequestBody string `json:"stream_request_body,omitempty"`
+	// MaxRequestBody is the maximum size in bytes of a request body,
+	// bigger requests get a 413 response. Zero means unlimited.
+	MaxRequestBody int64 `json:"max_request_body,omitempty"`
+	// EventLoops is the number of event loops that run an ASGI app, each
+	// one in its own thread. Defaults to 1.
+	EventLoops int `json:"event_loops,omitempty"`
+	// Uvloop runs the event loops of an ASGI app with uvloop when it's
+	// installed.
+	Uvloop string `json:"uvloop,omitempty"`
+	// BodyChunkSize is the maximum size in bytes of the request body chunks
+	// that an ASGI app receives. Defaults to 64 KiB.
+	BodyChunkSize int `json:"body_chunk_size,omitempty"`
+	// BodyReadAhead is the number of request body chunks that are read
+	// before an ASGI app receives them. Zero disables read-ahead.
+	BodyReadAhead int `json:"body_read_ahead,omitempty"`
+	// FlushPolicy is when the response body of an ASGI app is flushed to
+	// the client: "always", "on_size", "on_interval" or "final_only".
+	// Defaults to "always". text/event-stream responses are always flushed.
+	FlushPolicy string `json:"flush_policy,omitempty"`
+	// FlushSize is the amount of bytes written since the last flush that
+	// triggers a flush with the "on_size" policy.
+	FlushSize int `json:"flush_size,omitempty"`
+	// FlushInterval is the maximum time that written data waits for a
+	// flush with the "on_interval" policy.
+	FlushInterval caddy.Duration `json:"flush_interval,omitempty"`
+	// WebsocketCompression negotiates permessage-deflate with the websocket
+	// clients of an ASGI app that support it.
+	WebsocketCompression string `json:"websocket_compression,omitempty"`
+	// ResponseCache is the maximum size in bytes of the in-memory cache of
+	// responses that set max-age or s-maxage. Zero disables the cache.
+	ResponseCache int64 `json:"response_cache,omitempty"`
+	// CacheVary are the request headers that are part of the cache key,
+	// responses that vary on other headers are not cached.
+	CacheVary []string `json:"cache_vary,omitempty"`
+	// MaxInFlight is the number of requests that the app runs at once, the
+	// rest wait for their turn. Zero disables admission control.
+	MaxInFlight int `json:"max_in_flight,omitempty"`
+	// MaxQueueWait is how long requests wait for their turn before they
+	// get a 503 response. Zero rejects them right away.
+	MaxQueueWait caddy.Duration `json:"max_queue_wait,omitempty"`
+	// AdaptiveLimit lowers the number of requests that run at once below
+	// MaxInFlight when the latency of the app goes up.
+	AdaptiveLimit string `json:"adaptive_limit,omitempty"`
+	// ReloadWatch are files and directories with the code of the app, it's
+	// reloaded when their Python files change. The venv is watched for
+	// packages that are installed or removed.
+	ReloadWatch []string `json:"reload_watch,omitempty"`
+	// Preload are Python modules imported before the app, in each
+	// interpreter and worker process that runs it.
+	Preload []string `json:"preload,omitempty"`
+	// BytecodeCache is a writable directory where Python keeps the bytecode
+	// of modules instead of __pycache__ next to them.
+	BytecodeCache string `json:"bytecode_cache,omitempty"`
+	// Warmup are paths of GET requests that are sent to the app before it
+	// serves traffic, the responses are discarded.
+	Warmup    []string `json:"warmup,omitempty"`
+	logger    *zap.Logger
+	app       AppServer
+	cache     *responseCache
+	admission *admissionController
+	// reload_paths are the paths that the handler watches to reload the
+	// app, ReloadWatch and the venv
+	reload_paths []string
 }
 
 // UnmarshalCaddyfile implements caddyfile.Unmarshaler.
@@ -75,6 +166,198 @@ func (f *CaddySnake) UnmarshalCaddyfile(d *caddyfile.Dispenser) error {
 					if !d.Args(&f.VenvPath) {
 						return d.Errf("expected exactly one argument for venv")
 					}
+				case "workers":
+					var workers string
+					if !d.Args(&workers) {
+						return d.Errf("expected exactly one argument for workers")
+					}
+					v, err := strconv.Atoi(workers)
+					if err != nil || v <= 0 {
+						return d.Errf("workers must be a positive integer: %s", workers)
+					}
+					f.Workers = v
+				case "interpreters":
+					var interpreters string
+					if !d.Args(&interpreters) {
+						return d.Errf("expected exactly one argument for interpreters")
+					}
+					v, err := strconv.Atoi(interpreters)
+					if err != nil || v <= 0 {
+						return d.Errf("interpreters must be a positive integer: %s", interpreters)
+					}
+					f.Interpreters = v
+				case "dispatch":
+					if !d.Args(&f.Dispatch) || (f.Dispatch != "queue" && f.Dispatch != "direct") {
+						return d.Errf("expected exactly one argument for dispatch: queue|direct")
+					}
+				case "process_workers":
+					var processWorkers string
+					if !d.Args(&processWorkers) {
+						return d.Errf("expected exactly one argument for process_workers")
+					}
+					v, err := strconv.Atoi(processWorkers)
+					if err != nil || v <= 0 {
+						return d.Errf("process_workers must be a positive integer: %s", processWorkers)
+					}
+					f.ProcessWorkers = v
+				case "max_requests":
+					var maxRequests string
+					if !d.Args(&maxRequests) {
+						return d.Errf("expected exactly one argument for max_requests")
+					}
+					v, err := strconv.Atoi(maxRequests)
+					if err != nil || v < 0 {
+						return d.Errf("max_requests must be a non-negative integer: %s", maxRequests)
+					}
+					f.MaxRequests = v
+				case "queue_limit":
+					var queueLimit string
+					if !d.Args(&queueLimit) {
+						return d.Errf("expected exactly one argument for queue_limit")
+					}
+					v, err := strconv.Atoi(queueLimit)
+					if err != nil || v < 0 {
+						return d.Errf("queue_limit must be a non-negative integer: %s", queueLimit)
+					}
+					f.QueueLimit = v
+				case "stream_request_body":
+					if !d.Args(&f.StreamRequestBody) || (f.StreamRequestBody != "on" && f.StreamRequestBody != "off") {
+						return d.Errf("expected exactly one argument for stream_request_body: on|off")
+					}
+				case "max_request_body":
+					var maxRequestBody string
+					if !d.Args(&maxRequestBody) {
+						return d.Errf("expected exactly one argument for max_request_body")
+					}
+					v, err := humanize.ParseBytes(maxRequestBody)
+					if err != nil {
+						return d.Errf("invalid max_request_body: %v", err)
+					}
+					f.MaxRequestBody = int64(v)
+				case "response_cache":
+					var responseCache string
+					if !d.Args(&responseCache) {
+						return d.Errf("expected exactly one argument for response_cache")
+					}
+					v, err := humanize.ParseBytes(responseCache)
+					if err != nil || v == 0 || v > math.MaxInt64 {
+						return d.Errf("invalid response_cache: %s", responseCache)
+					}
+					f.ResponseCache = int64(v)
+				case "cache_vary":
+					f.CacheVary = append(f.CacheVary, d.RemainingArgs()...)
+					if len(f.CacheVary) == 0 {
+						return d.Errf("expected at least one header for cache_vary")
+					}
+				case "max_in_flight":
+					var maxInFlight string
+					if !d.Args(&maxInFlight) {
+						return d.Errf("expected exactly one argument for max_in_flight")
+					}
+					v, err := strconv.Atoi(maxInFlight)
+					if err != nil || v <= 0 {
+						return d.Errf("max_in_flight must be a positive integer: %s", maxInFlight)
+					}
+					f.MaxInFlight = v
+				case "max_queue_wait":
+					var maxQueueWait string
+					if !d.Args(&maxQueueWait) {
+						return d.Errf("expected exactly one argument for max_queue_wait")
+					}
+					v, err := caddy.ParseDuration(maxQueueWait)
+					if err != nil || v < 0 {
+						return d.Errf("invalid max_queue_wait: %s", maxQueueWait)
+					}
+					f.MaxQueueWait = caddy.Duration(v)
+				case "adaptive_limit":
+					if !d.Args(&f.AdaptiveLimit) || (f.AdaptiveLimit != "on" && f.AdaptiveLimit != "off") {
+						return d.Errf("expected exactly one argument for adaptive_limit: on|off")
+					}
+				case "event_loops":
+					var eventLoops string
+					if !d.Args(&eventLoops) {
+						return d.Errf("expected exactly one argument for event_loops")
+					}
+					v, err := strconv.Atoi(eventLoops)
+					if err != nil || v <= 0 {
+						return d.Errf("event_loops must be a positive integer: %s", eventLoops)
+					}
+					f.EventLoops = v
+				case "body_chunk_size":
+					var bodyChunkSize string
+					if !d.Args(&bodyChunkSize) {
+						return d.Errf("expected exactly one argument for body_chunk_size")
+					}
+					v, err := humanize.ParseBytes(bodyChunkSize)
+					if err != nil || v == 0 || v > math.MaxInt32 {
+						return d.Errf("invalid body_chunk_size: %s", bodyChunkSize)
+					}
+					f.BodyChunkSize = int(v)
+				case "body_read_ahead":
+					var bodyReadAhead string
+					if !d.Args(&bodyReadAhead) {
+						return d.Errf("expected exactly one argument for body_read_ahead")
+					}
+					v, err := strconv.Atoi(bodyReadAhead)
+					if err != nil || v < 0 {
+						return d.Errf("body_read_ahead must be a non-negative integer: %s", bodyReadAhead)
+					}
+					f.BodyReadAhead = v
+				case "flush_policy":
+					args := d.RemainingArgs()
+					if len(args) == 0 {
+						return d.Errf("expected an argument for flush_policy: always|on_size <size>|on_interval <duration>|final_only")
+					}
+					f.FlushPolicy = args[0]
+					switch {
+					case len(args) == 1 && (args[0] == "always" || args[0] == "final_only"):
+					case len(args) == 2 && args[0] == "on_size":
+						v, err := humanize.ParseBytes(args[1])
+						if err != nil || v == 0 || v > math.MaxInt32 {
+							return d.Errf("invalid flush_policy size: %s", args[1])
+						}
+						f.FlushSize = int(v)
+					case len(args) == 2 && args[0] == "on_interval":
+						v, err := caddy.ParseDuration(args[1])
+						if err != nil || v <= 0 {
+							return d.Errf("invalid flush_policy interval: %s", args[1])
+						}
+						f.FlushInterval = caddy.Duration(v)
+					default:
+						return d.Errf("expected flush_policy always|on_size <size>|on_interval <duration>|final_only")
+					}
+				case "websocket_compression":
+					if !d.Args(&f.WebsocketCompression) || (f.WebsocketCompression != "on" && f.WebsocketCompression != "off") {
+						return d.Errf("expected exactly one argument for websocket_compression: on|off")
+					}
+				case "uvloop":
+					if !d.Args(&f.Uvloop) || (f.Uvloop != "on" && f.Uvloop != "off") {
+						return d.Errf("expected exactly one argument for uvloop: on|off")
+					}
+				case "preload":
+					f.Preload = append(f.Preload, d.RemainingArgs()...)
+					if len(f.Preload) == 0 {
+						return d.Errf("expected at least one module for preload")
+					}
+				case "bytecode_cache":
+					if !d.Args(&f.BytecodeCache) {
+						return d.Errf("expected exactly one argument for bytecode_cache")
+					}
+				case "warmup":
+					f.Warmup = append(f.Warmup, d.RemainingArgs()...)
+					if len(f.Warmup) == 0 {
+						return d.Errf("expected at least one path for warmup")
+					}
+					for _, path := range f.Warmup {
+						if !strings.HasPrefix(path, "/") {
+							return d.Errf("warmup paths must start with /: %s", path)
+						}
+					}
+				case "reload_watch":
+					f.ReloadWatch = append(f.ReloadWatch, d.RemainingArgs()...)
+					if len(f.ReloadWatch) == 0 {
+						f.ReloadWatch = []string{"."}
+					}
 				default:
 					return d.Errf("unknown subdirective: %s", d.Val())
 				}
@@ -97,28 +380,120 @@ func (CaddySnake) CaddyModule() caddy.ModuleInfo {
 // Provision sets up the module.
 func (f *CaddySnake) Provision(ctx caddy.Context) error {
 	f.logger = ctx.Logger(f)
+	if f.ResponseCache > 0 {
+		f.cache = newResponseCache(f.ResponseCache, f.CacheVary)
+	} else if len(f.CacheVary) > 0 {
+		f.logger.Warn("cache_vary is only used with response_cache")
+	}
+	if f.MaxInFlight > 0 {
+		f.admission = newAdmissionController(f.MaxInFlight, time.Duration(f.MaxQueueWait), f.AdaptiveLimit == "on")
+	} else if f.MaxQueueWait != 0 || f.AdaptiveLimit != "" {
+		f.logger.Warn("max_queue_wait and adaptive_limit are only used with max_in_flight")
+	}
+	imports := ImportOptions{Preload: f.Preload, BytecodeCache: f.BytecodeCache}
 	if f.ModuleWsgi != "" {
-		w, err := NewWsgi(f.ModuleWsgi, f.VenvPath)
-		if err != nil {
-			return err
+		options := WsgiOptions{
+			Workers:       f.Workers,
+			Interpreters:  f.Interpreters,
+			QueueLimit:    f.QueueLimit,
+			StreamBody:    f.StreamRequestBody == "on",
+			Direct:        f.Dispatch == "direct",
+			ImportOptions: imports,
 		}
 		if f.Lifespan != "" {
 			f.logger.Warn("lifespan is only used in ASGI mode", zap.String("lifespan", f.Lifespan))
 		}
-		f.logger.Info("imported wsgi app", zap.String("module_wsgi", f.ModuleWsgi), zap.String("venv_path", f.VenvPath))
+		if f.EventLoops != 0 || f.Uvloop != "" || f.BodyChunkSize != 0 || f.BodyReadAhead != 0 || f.FlushPolicy != "" || f.WebsocketCompression != "" {
+			f.logger.Warn("event_loops, uvloop, body_chunk_size, body_read_ahead, flush_policy and websocket_compression are only used in ASGI mode")
+		}
+		if f.ProcessWorkers > 0 {
+			p, err := NewProcessWsgi(f.ModuleWsgi, f.VenvPath, options, f.ProcessWorkers, f.MaxRequests, f.Warmup, f.logger)
+			if err != nil {
+				return err
+			}
+			f.logger.Info("started wsgi worker processes", zap.String("module_wsgi", f.ModuleWsgi), zap.String("venv_path", f.VenvPath), zap.Int("process_workers", f.ProcessWorkers), zap.Int("max_requests", f.MaxRequests))
+			f.app = p
+			f.provisionReload(f.ModuleWsgi, p)
+			return nil
+		}
+		if f.MaxRequests != 0 {
+			f.logger.Warn("max_requests is only used with process_workers")
+		}
+		w, err := NewWsgi(f.ModuleWsgi, f.VenvPath, options)
+		if err != nil {
+			return err
+		}
+		f.logger.Info("imported wsgi app", zap.String("module_wsgi", f.ModuleWsgi), zap.String("venv_path", f.VenvPath), zap.Int("workers", w.workers), zap.Int("interpreters", f.Interpreters), zap.Bool("direct", options.Direct))
 		f.app = w
+		f.provisionReload(f.ModuleWsgi, w)
+		f.warmUp(w, &w.startup)
 	} else if f.ModuleAsgi != "" {
-		var err error
-		f.app, err = NewAsgi(f.ModuleAsgi, f.VenvPath, f.Lifespan == "on")
+		if f.Workers != 0 || f.Interpreters != 0 || f.Dispatch != "" || f.ProcessWorkers != 0 || f.MaxRequests != 0 || f.QueueLimit != 0 || f.StreamRequestBody != "" {
+			f.logger.Warn("workers, interpreters, dispatch, process_workers, max_requests, queue_limit and stream_request_body are only used in WSGI mode")
+		}
+		flush, err := f.asgiFlushPolicy()
+		if err != nil {
+			return err
+		}
+		options := AsgiOptions{
+			Lifespan:      f.Lifespan == "on",
+			EventLoops:    f.EventLoops,
+			Uvloop:        f.Uvloop == "on",
+			BodyChunkSize: f.BodyChunkSize,
+			BodyReadAhead: f.BodyReadAhead,
+			Flush:         flush,
+
+			WebsocketCompression: f.WebsocketCompression == "on",
+			ImportOptions:        imports,
+		}
+		a, err := NewAsgi(f.ModuleAsgi, f.VenvPath, options)
 		if err != nil {
 			return err
 		}
+		f.logger.Info("imported asgi app", zap.String("module_asgi", f.ModuleAsgi), zap.String("venv_path", f.VenvPath), zap.Int("event_loops", a.options.EventLoops), zap.Bool("uvloop", options.Uvloop))
+		f.app = a
+		f.provisionReload(f.ModuleAsgi, a)
+		f.warmUp(a, &a.startup)
 	} else {
 		return errors.New("asgi or wsgi app needs to be specified")
 	}
 	return nil
 }
 
+// warmUp sends the warmup requests to an app that runs in this process,
+// failures are logged and the app still serves traffic.
+func (f *CaddySnake) warmUp(app AppServer, startup *appStartup) {
+	if len(f.Warmup) == 0 {
+		return
+	}
+	if err := warmUp(app, startup, f.Warmup); err != nil {
+		f.logger.Warn("python app warmup failed", zap.Error(err))
+		return
+	}
+	f.logger.Info("warmed up python app", zap.Duration("duration", time.Duration(startup.warmup_ns.Load())))
+}
+
+// asgiFlushPolicy converts the flush_policy settings of the module
+func (f *CaddySnake) asgiFlushPolicy() (FlushPolicy, error) {
+	switch f.FlushPolicy {
+	case "", "always":
+		return FlushPolicy{Mode: FLUSH_ALWAYS}, nil
+	case "final_only":
+		return FlushPolicy{Mode: FLUSH_FINAL_ONLY}, nil
+	case "on_size":
+		if f.FlushSize <= 0 {
+			return FlushPolicy{}, errors.New("flush_policy on_size needs a positive flush_size")
+		}
+		return FlushPolicy{Mode: FLUSH_ON_SIZE, Size: f.FlushSize}, nil
+	case "on_interval":
+		if f.FlushInterval <= 0 {
+			return FlushPolicy{}, errors.New("flush_policy on_interval needs a positive flush_interval")
+		}
+		return FlushPolicy{Mode: FLUSH_ON_INTERVAL, Interval: time.Duration(f.FlushInterval)}, nil
+	}
+	return FlushPolicy{}, fmt.Errorf("unknown flush_policy: %s", f.FlushPolicy)
+}
+
 // Validate implements caddy.Validator.
 func (m *CaddySnake) Validate() error {
 	return nil
@@ -128,6 +503,7 @@ func (m *CaddySnake) Validate() error {
 func (m *CaddySnake) Cleanup() error {
 	if m != nil && m.app != nil {
 		m.logger.Info("cleaning up module")
+		unregisterReloadable(m.app, m.reload_paths)
 		return m.app.Cleanup()
 	}
 	return nil
@@ -135,12 +511,44 @@ func (m *CaddySnake) Cleanup() error {
 
 // ServeHTTP implements caddyhttp.MiddlewareHandler.
 func (f CaddySnake) ServeHTTP(w http.ResponseWriter, r *http.Request, next caddyhttp.Handler) error {
-	if err := f.app.HandleRequest(w, r); err != nil {
+	if f.MaxRequestBody > 0 {
+		if r.ContentLength > f.MaxRequestBody {
+			return caddyhttp.Error(http.StatusRequestEntityTooLarge, errors.New("request body too large"))
+		}
+		r.Body = http.MaxBytesReader(w, r.Body, f.MaxRequestBody)
+	}
+	if f.cache != nil {
+		if err := f.cache.serve(w, r, f.handle); err != nil {
+			return err
+		}
+	} else if err := f.handle(w, r); err != nil {
 		return err
 	}
 	return next.ServeHTTP(w, r)
 }
 
+// handle passes a request to the app once admission control lets it in.
+// Websockets of ASGI apps are long-lived, so they don't take a slot.
+func (f *CaddySnake) handle(w http.ResponseWriter, r *http.Request) error {
+	if f.admission == nil {
+		return f.app.HandleRequest(w, r)
+	}
+	if _, ok := f.app.(*Asgi); ok && isWebsocketRequest(r) {
+		return f.app.HandleRequest(w, r)
+	}
+	priority := parsePriority(caddyhttp.GetVar(r.Context(), "python_priority"))
+	start, err := f.admission.admit(r.Context(), priority)
+	if err != nil {
+		if errors.Is(err, errAdmissionLimit) {
+			w.Header().Set("Retry-After", "1")
+			return caddyhttp.Error(http.StatusServiceUnavailable, err)
+		}
+		return err
+	}
+	defer f.admission.release(start)
+	return f.app.HandleRequest(w, r)
+}
+
 // Interface guards
 var (
 	_ caddy.Provisioner           = (*CaddySnake)(nil)
@@ -158,17 +566,21 @@ func parsePythonDirective(h httpcaddyfile.Helper) (caddyhttp.MiddlewareHandler,
 	return app, nil
 }
 
-// WsgiRequestHandler tracks the state of a HTTP request to a WSGI App
+// WsgiRequestHandler tracks the state of a HTTP request to a WSGI App.
+// The response is written from the Python worker thread through the
+// wsgi_write_chunk and wsgi_write_response callbacks.
 type WsgiRequestHandler struct {
-	status_code C.int
-	headers     *C.MapKeyVal
-	body        *C.char
-	body_size   C.size_t
+	w            http.ResponseWriter
+	body         io.Reader
+	headers_sent bool
+	done         chan struct{}
+	// timings are reported by Python with the end of the response, write
+	// is the time spent writing it to the client
+	timings C.RequestTimings
+	write   time.Duration
 }
 
-var wsgi_lock sync.RWMutex = sync.RWMutex{}
-var wsgi_request_counter int64 = 0
-var wsgi_handlers map[int64]chan WsgiRequestHandler = map[int64]chan WsgiRequestHandler{}
+var wsgi_requests requestRegistry[WsgiRequestHandler]
 
 func init() {
 	setup_py := C.CString(caddysnake_py)
@@ -176,6 +588,37 @@ func init() {
 	C.Py_init_and_release_gil(setup_py)
 	caddy.RegisterModule(CaddySnake{})
 	httpcaddyfile.RegisterHandlerDirective("python", parsePythonDirective)
+	caddycmd.RegisterCommand(caddycmd.Command{
+		Name:  processWorkerCommand,
+		Short: "Serves a WSGI app for the process_workers mode (internal)",
+		Long: `
+Started by the python handler when process_workers is set, it serves the
+WSGI app on a socket inherited from the parent Caddy process.
+`,
+		Func: cmdPythonWorker,
+	})
+}
+
+// gilAcquisitions is how many times requests took the GIL in the bridge so
+// far, the benchmarks report it per request.
+func gilAcquisitions() uint64 {
+	return uint64(C.Py_gil_acquisitions())
+}
+
+// startPythonSampler starts sampling the Python stacks of requests hz times a
+// second, see profile.go.
+func startPythonSampler(hz int) bool {
+	return C.Py_profile_start(C.int(hz)) != 0
+}
+
+// stopPythonSampler stops the sampler and returns its samples as JSON.
+func stopPythonSampler() ([]byte, error) {
+	samples := C.Py_profile_stop()
+	if samples == nil {
+		return nil, errors.New("failed to stop the python sampler")
+	}
+	defer C.free(unsafe.Pointer(samples))
+	return []byte(C.GoString(samples)), nil
 }
 
 // findSitePackagesInVenv searches for the site-packages directory in a given venv.
@@ -228,33 +671,166 @@ func findPythonDirectory(libPath string) (string, error) {
 
 // Wsgi stores a reference to a Python Wsgi application
 type Wsgi struct {
-	app          *C.WsgiApp
+	// apps has one instance of the app per interpreter, Reload swaps them
+	// for new ones
+	apps         atomic.Pointer[[]*wsgiInstance]
 	wsgi_pattern string
+	venv_path    string
+	cache_key    string
+	// handlers is the number of python handlers that serve the app, the
+	// last one to be cleaned up frees it
+	handlers     int
+	imports      ImportOptions
+	interpreters int
+	workers      int
+	queue_limit  int
+	stream_body  bool
+	// slots limits the requests that run at the same time with direct
+	// dispatch, it's nil when requests are queued to worker threads
+	slots     chan struct{}
+	in_flight atomic.Int64
+	next      atomic.Uint64
+	metrics   *appMetrics
+	// reload_lock is held while the app is imported again, drains waits
+	// for the instances that were replaced
+	reload_lock sync.Mutex
+	drains      sync.WaitGroup
+	startup     appStartup
+}
+
+// wsgiInstance is a WSGI app imported in one interpreter
+type wsgiInstance struct {
+	app       *C.WsgiApp
+	in_flight atomic.Int64
+	// retired is set when a reload replaces the instance, it only finishes
+	// the requests that it has
+	retired atomic.Bool
+}
+
+// WsgiOptions configures how requests are passed to a WSGI app
+type WsgiOptions struct {
+	// Workers is the size of the pool of Python threads that serve the app
+	// in each interpreter, zero uses a default based on the number of CPUs.
+	Workers int
+	// Interpreters is the number of sub-interpreters that run the app,
+	// zero runs it in the main interpreter.
+	Interpreters int
+	// QueueLimit is the amount of requests that can wait for a free worker,
+	// zero means unlimited.
+	QueueLimit int
+	// StreamBody reads the request body on demand from wsgi.input instead of
+	// buffering it before calling the app.
+	StreamBody bool
+	// Direct calls the app from the thread that handles the request instead
+	// of a Python worker thread, Workers limits the concurrent calls.
+	Direct bool
+	ImportOptions
+}
+
+// ImportOptions prepares the interpreters before an app is imported
+type ImportOptions struct {
+	// Preload are modules imported before the app in every interpreter
+	// that runs it, so apps that import them lazily don't do it while
+	// serving their first requests.
+	Preload []string
+	// BytecodeCache is the directory where Python reads and writes the
+	// bytecode of modules, empty keeps it in __pycache__ next to them.
+	BytecodeCache string
+}
+
+// cStrings returns the options as they are passed to C, free releases them.
+func (o ImportOptions) cStrings() (preload *C.char, pycache_prefix *C.char, free func()) {
+	if len(o.Preload) > 0 {
+		preload = C.CString(strings.Join(o.Preload, ","))
+	}
+	if o.BytecodeCache != "" {
+		pycache_prefix = C.CString(o.BytecodeCache)
+	}
+	return preload, pycache_prefix, func() {
+		C.free(unsafe.Pointer(preload))
+		C.free(unsafe.Pointer(pycache_prefix))
+	}
 }
 
+var wsgiapp_lock sync.Mutex = sync.Mutex{}
 var wsgiapp_cache map[string]*Wsgi = map[string]*Wsgi{}
 
-// NewWsgi imports a WSGI app
-func NewWsgi(wsgi_pattern string, venv_path string) (*Wsgi, error) {
-	wsgi_lock.Lock()
-	defer wsgi_lock.Unlock()
+// NewWsgi imports a WSGI app and starts a pool of worker threads to serve it.
+func NewWsgi(wsgi_pattern string, venv_path string, options WsgiOptions) (*Wsgi, error) {
+	wsgiapp_lock.Lock()
+	defer wsgiapp_lock.Unlock()
 
-	if app, ok := wsgiapp_cache[wsgi_pattern]; ok {
+	cache_key := appCacheKey(wsgi_pattern, venv_path, options)
+	if app, ok := wsgiapp_cache[cache_key]; ok {
+		app.handlers++
 		return app, nil
 	}
 
-	module_app := strings.Split(wsgi_pattern, ":")
-	if len(module_app) != 2 {
+	if len(strings.Split(wsgi_pattern, ":")) != 2 {
 		return nil, errors.New("expected pattern $(MODULE_NAME):$(VARIABLE_NAME)")
 	}
+
+	interpreters := options.Interpreters
+	if interpreters > 0 && C.Py_subinterpreters_supported() == 0 {
+		return nil, errors.New("interpreters requires Python 3.12 or newer")
+	}
+	if interpreters > 0 && options.Direct {
+		// Threads of the Go runtime can't run Python code in sub-interpreters
+		return nil, errors.New("direct dispatch can't be used with interpreters")
+	}
+
+	workers := options.Workers
+	if workers <= 0 {
+		// The default amount of threads is split between interpreters
+		workers = 2*runtime.NumCPU() + 1
+		if interpreters > 1 {
+			workers = (workers + interpreters - 1) / interpreters
+		}
+	}
+
+	result := &Wsgi{
+		wsgi_pattern: wsgi_pattern,
+		venv_path:    venv_path,
+		cache_key:    cache_key,
+		handlers:     1,
+		imports:      options.ImportOptions,
+		interpreters: interpreters,
+		workers:      workers,
+		queue_limit:  options.QueueLimit,
+		stream_body:  options.StreamBody,
+		metrics:      newAppMetrics(wsgi_pattern, !options.Direct),
+	}
+	if options.Direct {
+		result.slots = make(chan struct{}, workers)
+	}
+	apps, err := result.importApps()
+	if err != nil {
+		return nil, err
+	}
+	result.apps.Store(&apps)
+
+	wsgiapp_cache[cache_key] = result
+	return result, nil
+}
+
+// appCacheKey identifies an app in the cache of the process. Handlers share
+// an app when they serve the same pattern from the same venv with the same
+// options, a config reload that changes them imports a new one.
+func appCacheKey(pattern string, venv_path string, options any) string {
+	return fmt.Sprintf("%s\x00%s\x00%#v", pattern, venv_path, options)
+}
+
+// importApps imports the app in each interpreter.
+func (m *Wsgi) importApps() ([]*wsgiInstance, error) {
+	module_app := strings.Split(m.wsgi_pattern, ":")
 	module_name := C.CString(module_app[0])
 	defer C.free(unsafe.Pointer(module_name))
 	app_name := C.CString(module_app[1])
 	defer C.free(unsafe.Pointer(app_name))
 
 	var packages_path *C.char = nil
-	if venv_path != "" {
-		sitePackagesPath, err := findSitePackagesInVenv(venv_path)
+	if m.venv_path != "" {
+		sitePackagesPath, err := findSitePackagesInVenv(m.venv_path)
 		if err != nil {
 			return nil, err
 		}
@@ -262,32 +838,153 @@ func NewWsgi(wsgi_pattern string, venv_path string) (*Wsgi, error) {
 		defer C.free(unsafe.Pointer(packages_path))
 	}
 
-	runtime.LockOSThread()
-	defer runtime.UnlockOSThread()
-	app := C.WsgiApp_import(module_name, app_name, packages_path)
-	if app == nil {
+	preload, pycache_prefix, free := m.imports.cStrings()
+	defer free()
+
+	// Worker threads aren't started when the app is called directly
+	threads := m.workers
+	if m.slots != nil {
+		threads = 0
+	}
+
+	// Sub-interpreters have their own GIL, they import the app at the
+	// same time
+	start := time.Now()
+	subinterpreter := C.uint8_t(boolToInt(m.interpreters > 0))
+	apps := make([]*wsgiInstance, max(m.interpreters, 1))
+	var wg sync.WaitGroup
+	for i := range apps {
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			runtime.LockOSThread()
+			defer runtime.UnlockOSThread()
+			if app := C.WsgiApp_import(module_name, app_name, packages_path, preload, pycache_prefix, C.size_t(threads), subinterpreter); app != nil {
+				apps[i] = &wsgiInstance{app: app}
+			}
+		}(i)
+	}
+	wg.Wait()
+	if slices.Contains(apps, nil) {
+		runtime.LockOSThread()
+		defer runtime.UnlockOSThread()
+		for _, instance := range apps {
+			if instance != nil {
+				C.WsgiApp_cleanup(instance.app)
+			}
+		}
 		return nil, errors.New("failed to import module")
 	}
+	m.startup.imported(time.Since(start))
+	return apps, nil
+}
 
-	result := &Wsgi{app, wsgi_pattern}
-	wsgiapp_cache[wsgi_pattern] = result
-	return result, nil
+// Reload imports the app again and swaps it for the running one. Requests
+// in flight finish in the old instances, which are cleaned up once they are
+// done. They keep serving if the import fails.
+func (m *Wsgi) Reload() error {
+	m.reload_lock.Lock()
+	defer m.reload_lock.Unlock()
+	if m.interpreters == 0 {
+		// New sub-interpreters import everything, the main interpreter
+		// would find the app in sys.modules
+		module_name := C.CString(strings.Split(m.wsgi_pattern, ":")[0])
+		defer C.free(unsafe.Pointer(module_name))
+		C.Py_forget_modules(module_name)
+	}
+	apps, err := m.importApps()
+	if err != nil {
+		return err
+	}
+	old := *m.apps.Swap(&apps)
+	m.drains.Add(1)
+	go func() {
+		defer m.drains.Done()
+		for _, instance := range old {
+			instance.retired.Store(true)
+		}
+		runtime.LockOSThread()
+		defer runtime.UnlockOSThread()
+		for _, instance := range old {
+			for instance.in_flight.Load() > 0 {
+				time.Sleep(reloadDrainInterval)
+			}
+			C.WsgiApp_cleanup(instance.app)
+		}
+	}()
+	return nil
+}
+
+// instance picks the interpreter with the fewest requests in flight, ties
+// are broken in round robin order. The request is counted in flight of the
+// instance, which isn't one that a reload replaced.
+func (m *Wsgi) instance() *wsgiInstance {
+	for {
+		apps := *m.apps.Load()
+		best := apps[0]
+		if len(apps) > 1 {
+			start := int(m.next.Add(1) % uint64(len(apps)))
+			best = apps[start]
+			for i := 1; i < len(apps); i++ {
+				candidate := apps[(start+i)%len(apps)]
+				if candidate.in_flight.Load() < best.in_flight.Load() {
+					best = candidate
+				}
+			}
+		}
+		// A reload that swaps the instances after they were loaded waits
+		// for this request, or the request sees that it was retired
+		best.in_flight.Add(1)
+		if !best.retired.Load() {
+			return best
+		}
+		best.in_flight.Add(-1)
+	}
+}
+
+// InFlight returns the number of requests that were handed to the app
+// and haven't been responded yet.
+func (m *Wsgi) InFlight() int64 {
+	return m.in_flight.Load()
+}
+
+// QueueDepth returns the number of requests that are waiting for a free worker.
+func (m *Wsgi) QueueDepth() int64 {
+	if queued := m.in_flight.Load() - int64(m.workers*max(m.interpreters, 1)); queued > 0 {
+		return queued
+	}
+	return 0
+}
+
+func (m *Wsgi) gauges() appGauges {
+	return appGauges{in_flight: m.InFlight(), queue_depth: m.QueueDepth()}
 }
 
 // Cleanup deallocates CGO resources used by Wsgi app
 func (m *Wsgi) Cleanup() error {
-	if m.app != nil {
-		wsgi_lock.Lock()
-		if _, ok := wsgiapp_cache[m.wsgi_pattern]; !ok {
-			wsgi_lock.Unlock()
+	if m.apps.Load() != nil {
+		wsgiapp_lock.Lock()
+		if wsgiapp_cache[m.cache_key] != m {
+			wsgiapp_lock.Unlock()
+			return nil
+		}
+		m.handlers--
+		if m.handlers > 0 {
+			wsgiapp_lock.Unlock()
 			return nil
 		}
-		delete(wsgiapp_cache, m.wsgi_pattern)
-		wsgi_lock.Unlock()
+		delete(wsgiapp_cache, m.cache_key)
+		wsgiapp_lock.Unlock()
+		m.metrics.delete()
 
+		m.reload_lock.Lock()
+		defer m.reload_lock.Unlock()
+		m.drains.Wait()
 		runtime.LockOSThread()
 		defer runtime.UnlockOSThread()
-		C.WsgiApp_cleanup(m.app)
+		for _, instance := range *m.apps.Load() {
+			C.WsgiApp_cleanup(instance.app)
+		}
 	}
 	return nil
 }
@@ -307,6 +1004,14 @@ func upperCaseAndUnderscore(r rune) rune {
 
 // HandleRequest passes request down to Python Wsgi app and writes responses and headers.
 func (m *Wsgi) HandleRequest(w http.ResponseWriter, r *http.Request) error {
+	in_flight := m.in_flight.Add(1)
+	defer m.in_flight.Add(-1)
+	if m.queue_limit > 0 && in_flight > int64(m.workers*max(m.interpreters, 1)+m.queue_limit) {
+		w.Header().Set("Retry-After", "1")
+		return caddyhttp.Error(http.StatusServiceUnavailable, errors.New("wsgi queue limit reached"))
+	}
+
+	start := time.Now()
 	ctx := r.Context()
 	srvAddr := ctx.Value(http.LocalAddrContextKey).(net.Addr)
 	_, port, _ := net.SplitHostPort(srvAddr.String())
@@ -328,24 +1033,7 @@ func (m *Wsgi) HandleRequest(w http.ResponseWriter, r *http.Request) error {
 		"CONTENT_LENGTH":  r.Header.Get("Content-length"),
 		"wsgi.url_scheme": strings.ToLower(strings.Split(r.Proto, "/")[0]),
 	}
-	headers_length := len(r.Header)
-	if _, ok := r.Header[textproto.CanonicalMIMEHeaderKey("Proxy")]; ok {
-		headers_length -= 1
-	}
-	if _, ok := r.Header[textproto.CanonicalMIMEHeaderKey("Content-Type")]; ok {
-		headers_length -= 1
-	}
-	if _, ok := r.Header[textproto.CanonicalMIMEHeaderKey("Content-Length")]; ok {
-		headers_length -= 1
-	}
-	rh := C.MapKeyVal_new(C.size_t(headers_length + len(extra_headers)))
-	defer C.free(unsafe.Pointer(rh))
-	defer C.free(unsafe.Pointer(rh.keys))
-	defer C.free(unsafe.Pointer(rh.values))
-	i := 0
-	size_of_char_pointer := unsafe.Sizeof(rh.keys)
-	base_headers := uintptr(unsafe.Pointer(rh.keys))
-	base_values := uintptr(unsafe.Pointer(rh.values))
+	environ := newMapKeyVal(len(r.Header) + len(extra_headers))
 	for k, items := range r.Header {
 		key := strings.Map(upperCaseAndUnderscore, k)
 		if key == "PROXY" {
@@ -365,245 +1053,1069 @@ func (m *Wsgi) HandleRequest(w http.ResponseWriter, r *http.Request) error {
 			joinStr = "; "
 		}
 
-		key_str := C.CString("HTTP_" + key)
-		defer C.free(unsafe.Pointer(key_str))
-		value_str := C.CString(strings.Join(items, joinStr))
-		defer C.free(unsafe.Pointer(value_str))
-		*(**C.char)(unsafe.Pointer(base_headers + uintptr(i)*size_of_char_pointer)) = key_str
-		*(**C.char)(unsafe.Pointer(base_values + uintptr(i)*size_of_char_pointer)) = value_str
-		i++
+		environ.add("HTTP_"+key, strings.Join(items, joinStr))
 	}
 	for k, v := range extra_headers {
-		key_str := C.CString(k)
-		defer C.free(unsafe.Pointer(key_str))
-		value_str := C.CString(v)
-		defer C.free(unsafe.Pointer(value_str))
-		*(**C.char)(unsafe.Pointer(base_headers + uintptr(i)*size_of_char_pointer)) = key_str
-		*(**C.char)(unsafe.Pointer(base_values + uintptr(i)*size_of_char_pointer)) = value_str
-		i++
+		environ.add(k, v)
 	}
+	rh := environ.pack()
+	defer C.free(unsafe.Pointer(rh))
+	setup := time.Since(start)
 
-	body, err := io.ReadAll(r.Body)
-	if err != nil {
-		return err
+	var body []byte
+	if !m.stream_body {
+		var err error
+		body, err = readRequestBody(r)
+		if err != nil {
+			return requestBodyError(err)
+		}
+	}
+	// The body is copied into a Python bytes object, or the task queue of a
+	// sub-interpreter, before WsgiApp_handle_request returns, so it's safe to
+	// pass a pointer to Go memory.
+	var body_ptr *C.char
+	if len(body) > 0 {
+		body_ptr = (*C.char)(unsafe.Pointer(&body[0]))
 	}
-	body_str := C.CString(string(body))
-	defer C.free(unsafe.Pointer(body_str))
-
-	ch := make(chan WsgiRequestHandler)
-	wsgi_lock.Lock()
-	wsgi_request_counter++
-	request_id := wsgi_request_counter
-	wsgi_handlers[request_id] = ch
-	wsgi_lock.Unlock()
-
-	runtime.LockOSThread()
-	C.WsgiApp_handle_request(m.app, C.int64_t(request_id), rh, body_str)
-	runtime.UnlockOSThread()
 
-	h := <-ch
+	h := &WsgiRequestHandler{
+		w:    w,
+		done: make(chan struct{}, 1),
+	}
+	if m.stream_body {
+		h.body = r.Body
+	}
+	request_id := wsgi_requests.Register(h)
+	profileRequest("wsgi", request_id)
 
-	if h.headers != nil {
-		defer C.free(unsafe.Pointer(h.headers))
-		defer C.free(unsafe.Pointer(h.headers.keys))
-		defer C.free(unsafe.Pointer(h.headers.values))
+	instance := m.instance()
+	defer instance.in_flight.Add(-1)
 
-		for i := 0; i < int(h.headers.count); i++ {
-			header_name_ptr := unsafe.Pointer(uintptr(unsafe.Pointer(h.headers.keys)) + uintptr(i)*size_of_char_pointer)
-			header_value_ptr := unsafe.Pointer(uintptr(unsafe.Pointer(h.headers.values)) + uintptr(i)*size_of_char_pointer)
-			header_name := *(**C.char)(header_name_ptr)
-			defer C.free(unsafe.Pointer(header_name))
-			header_value := *(**C.char)(header_value_ptr)
-			defer C.free(unsafe.Pointer(header_value))
-			w.Header().Add(C.GoString(header_name), C.GoString(header_value))
+	if m.slots == nil {
+		runtime.LockOSThread()
+		C.WsgiApp_handle_request(
+			instance.app,
+			C.int64_t(request_id),
+			rh,
+			body_ptr,
+			C.size_t(len(body)),
+			C.uint8_t(boolToInt(m.stream_body)),
+			C.int64_t(r.ContentLength),
+		)
+		runtime.UnlockOSThread()
+		<-h.done
+	} else {
+		// Complete responses are returned by WsgiApp_call, streamed ones are
+		// sent with the callbacks before it returns. Requests wait for a
+		// slot before they take an OS thread, so a burst doesn't park a
+		// thread for each of them.
+		var response C.WsgiResponse
+		m.slots <- struct{}{}
+		runtime.LockOSThread()
+		returned := C.WsgiApp_call(
+			instance.app,
+			C.int64_t(request_id),
+			rh,
+			body_ptr,
+			C.size_t(len(body)),
+			C.uint8_t(boolToInt(m.stream_body)),
+			C.int64_t(r.ContentLength),
+			&response,
+		)
+		runtime.UnlockOSThread()
+		<-m.slots
+		h.timings = response.timings
+		if returned != 0 {
+			write_start := time.Now()
+			h.writeResponse(response.status, response.headers, response.body, response.body_len)
+			h.write += time.Since(write_start)
+			C.free(unsafe.Pointer(response.body))
 		}
 	}
 
-	w.WriteHeader(int(h.status_code))
-
-	if h.body != nil {
-		defer C.free(unsafe.Pointer(h.body))
-		body_bytes := C.GoBytes(unsafe.Pointer(h.body), C.int(h.body_size))
-		w.Write(body_bytes)
-	} else if h.status_code == 500 {
-		w.Write([]byte("Interal Server Error"))
-	}
+	wsgi_requests.Delete(request_id)
 
+	timings := cStageTimings(&h.timings)
+	timings.setup += setup
+	timings.write = h.write
+	m.metrics.observe(&timings)
 	return nil
 }
 
-//export wsgi_write_response
-func wsgi_write_response(request_id C.int64_t, status_code C.int, headers *C.MapKeyVal, body *C.char, body_size C.size_t) {
-	wsgi_lock.Lock()
-	defer wsgi_lock.Unlock()
-	ch := wsgi_handlers[int64(request_id)]
-	ch <- WsgiRequestHandler{
-		status_code: status_code,
-		body:        body,
-		body_size:   body_size,
-		headers:     headers,
+// cStageTimings converts the timings of a request reported by C.
+func cStageTimings(t *C.RequestTimings) stageTimings {
+	return stageTimings{
+		queue_wait: time.Duration(t.queue_wait),
+		gil_wait:   time.Duration(t.gil_wait),
+		setup:      time.Duration(t.setup),
+		app:        time.Duration(t.app),
+		marshal:    time.Duration(t.marshal),
 	}
-	delete(wsgi_handlers, int64(request_id))
 }
 
-// ASGI: Implementation
+// maxBodyPreallocation caps the buffer allocated upfront based on the Content-Length
+// header, bigger bodies grow the buffer as data arrives.
+const maxBodyPreallocation = 32 << 20
 
-// Asgi stores a reference to a Python Asgi application
-type Asgi struct {
-	app          *C.AsgiApp
-	asgi_pattern string
+// readRequestBody reads the entire request body. When the size is known
+// the body is read into a buffer of the exact size.
+func readRequestBody(r *http.Request) ([]byte, error) {
+	if r.ContentLength > 0 && r.ContentLength <= maxBodyPreallocation {
+		body := make([]byte, r.ContentLength)
+		if _, err := io.ReadFull(r.Body, body); err != nil {
+			return nil, err
+		}
+		return body, nil
+	}
+	return io.ReadAll(r.Body)
 }
 
-var asgiapp_cache map[string]*Asgi = map[string]*Asgi{}
-
-// NewAsgi imports a Python ASGI app
-func NewAsgi(asgi_pattern string, venv_path string, lifespan bool) (*Asgi, error) {
-	asgi_lock.Lock()
-	defer asgi_lock.Unlock()
-
-	if app, ok := asgiapp_cache[asgi_pattern]; ok {
-		return app, nil
+// requestBodyError turns errors caused by a request body over the
+// configured limit into a 413 response.
+func requestBodyError(err error) error {
+	var maxBytesError *http.MaxBytesError
+	if errors.As(err, &maxBytesError) {
+		return caddyhttp.Error(http.StatusRequestEntityTooLarge, err)
 	}
+	return err
+}
 
-	module_app := strings.Split(asgi_pattern, ":")
-	if len(module_app) != 2 {
-		return nil, errors.New("expected pattern $(MODULE_NAME):$(VARIABLE_NAME)")
+func boolToInt(b bool) int {
+	if b {
+		return 1
 	}
-	module_name := C.CString(module_app[0])
-	defer C.free(unsafe.Pointer(module_name))
-	app_name := C.CString(module_app[1])
-	defer C.free(unsafe.Pointer(app_name))
+	return 0
+}
 
-	var packages_path *C.char = nil
-	if venv_path != "" {
-		sitePackagesPath, err := findSitePackagesInVenv(venv_path)
+func wsgiRequestHandler(request_id C.int64_t) *WsgiRequestHandler {
+	return wsgi_requests.Lookup(uint64(request_id))
+}
+
+//export wsgi_read_body
+func wsgi_read_body(request_id C.int64_t, buffer *C.char, size C.size_t) C.int64_t {
+	h := wsgiRequestHandler(request_id)
+	if h == nil || h.body == nil {
+		// The response was already sent
+		return 0
+	}
+	buf := unsafe.Slice((*byte)(unsafe.Pointer(buffer)), int(size))
+	for {
+		n, err := h.body.Read(buf)
+		if n > 0 {
+			return C.int64_t(n)
+		}
+		if err == io.EOF {
+			return 0
+		}
 		if err != nil {
-			return nil, err
+			return -1
 		}
-		packages_path = C.CString(sitePackagesPath)
-		defer C.free(unsafe.Pointer(packages_path))
 	}
+}
 
-	runtime.LockOSThread()
-	defer runtime.UnlockOSThread()
-	app := C.AsgiApp_import(module_name, app_name, packages_path)
-	if app == nil {
-		return nil, errors.New("failed to import module")
+// mapKeyVal collects pairs of strings that are passed to C in a single
+// allocation.
+type mapKeyVal struct {
+	keys   []string
+	values []string
+	size   int
+}
+
+func newMapKeyVal(capacity int) *mapKeyVal {
+	return &mapKeyVal{
+		keys:   make([]string, 0, capacity),
+		values: make([]string, 0, capacity),
 	}
+}
 
-	var err error
+func (m *mapKeyVal) add(key, value string) {
+	m.keys = append(m.keys, key)
+	m.values = append(m.values, value)
+	m.size += len(key) + len(value)
+}
 
-	if lifespan {
-		status := C.AsgiApp_lifespan_startup(app)
-		if uint8(status) == 0 {
-			err = errors.New("startup failed")
-		}
+// pack copies the pairs into a C.MapKeyVal, it has to be released with C.free.
+func (m *mapKeyVal) pack() *C.MapKeyVal {
+	count := len(m.keys)
+	packed := C.MapKeyVal_new(C.size_t(count), C.size_t(m.size))
+	if packed == nil {
+		panic("caddysnake: out of memory")
+	}
+	keys := unsafe.Slice(packed.keys, count)
+	values := unsafe.Slice(packed.values, count)
+	key_sizes := unsafe.Slice(packed.key_sizes, count)
+	value_sizes := unsafe.Slice(packed.value_sizes, count)
+	data := unsafe.Slice((*byte)(unsafe.Pointer(packed.data)), m.size+2*count)
+	pos := 0
+	for i := 0; i < count; i++ {
+		keys[i] = (*C.char)(unsafe.Pointer(&data[pos]))
+		key_sizes[i] = C.size_t(len(m.keys[i]))
+		pos += copy(data[pos:], m.keys[i])
+		data[pos] = 0
+		pos++
+		values[i] = (*C.char)(unsafe.Pointer(&data[pos]))
+		value_sizes[i] = C.size_t(len(m.values[i]))
+		pos += copy(data[pos:], m.values[i])
+		data[pos] = 0
+		pos++
 	}
+	return packed
+}
 
-	result := &Asgi{app, asgi_pattern}
-	asgiapp_cache[asgi_pattern] = result
-	return result, err
+// forEachMapKeyVal calls fn with every pair of a map packed in C.
+func forEachMapKeyVal(m *C.MapKeyVal, fn func(key, value string)) {
+	if m == nil {
+		return
+	}
+	count := int(m.count)
+	keys := unsafe.Slice(m.keys, count)
+	values := unsafe.Slice(m.values, count)
+	key_sizes := unsafe.Slice(m.key_sizes, count)
+	value_sizes := unsafe.Slice(m.value_sizes, count)
+	for i := 0; i < count; i++ {
+		fn(C.GoStringN(keys[i], C.int(key_sizes[i])), C.GoStringN(values[i], C.int(value_sizes[i])))
+	}
 }
 
-// Cleanup deallocates CGO resources used by Asgi app
-func (m *Asgi) Cleanup() (err error) {
-	if m != nil && m.app != nil {
-		asgi_lock.Lock()
-		if _, ok := asgiapp_cache[m.asgi_pattern]; !ok {
-			asgi_lock.Unlock()
-			return
-		}
-		delete(asgiapp_cache, m.asgi_pattern)
-		asgi_lock.Unlock()
+// writeHeaders copies the headers built by Python into the response and
+// frees them.
+func (h *WsgiRequestHandler) writeHeaders(status_code C.int, headers *C.MapKeyVal) {
+	response_headers := h.w.Header()
+	forEachMapKeyVal(headers, response_headers.Add)
+	C.free(unsafe.Pointer(headers))
 
-		runtime.LockOSThread()
-		defer runtime.UnlockOSThread()
+	h.w.WriteHeader(int(status_code))
+	h.headers_sent = true
+}
 
-		status := C.AsgiApp_lifespan_shutdown(m.app)
-		if uint8(status) == 0 {
-			err = errors.New("shutdown failure")
-		}
+// writeBody writes a chunk of the response. Body is owned by Python and is
+// only valid during the callback.
+func (h *WsgiRequestHandler) writeBody(body *C.char, body_size C.size_t) {
+	if body != nil && body_size > 0 {
+		h.w.Write(unsafe.Slice((*byte)(unsafe.Pointer(body)), int(body_size)))
+	}
+}
 
-		C.AsgiApp_cleanup(m.app)
+//export wsgi_write_chunk
+func wsgi_write_chunk(request_id C.int64_t, status_code C.int, headers *C.MapKeyVal, body *C.char, body_size C.size_t) {
+	h := wsgiRequestHandler(request_id)
+	start := time.Now()
+	if headers != nil {
+		h.writeHeaders(status_code, headers)
 	}
-	return
+	h.writeBody(body, body_size)
+	if f, ok := h.w.(http.Flusher); ok {
+		f.Flush()
+	}
+	h.write += time.Since(start)
 }
 
-type WebsocketState uint8
+//export wsgi_write_file
+func wsgi_write_file(request_id C.int64_t, status_code C.int, headers *C.MapKeyVal, fd C.int, timings *C.RequestTimings) {
+	h := wsgiRequestHandler(request_id)
+	h.timings = *timings
+	start := time.Now()
+	f := os.NewFile(uintptr(fd), "wsgi.file_wrapper")
+	defer f.Close()
+	h.writeHeaders(status_code, headers)
+	// Copying from an *os.File lets the ResponseWriter use sendfile(2)
+	if size, err := strconv.ParseInt(h.w.Header().Get("Content-Length"), 10, 64); err == nil {
+		io.CopyN(h.w, f, size)
+	} else {
+		io.Copy(h.w, f)
+	}
+	h.write += time.Since(start)
+	h.done <- struct{}{}
+}
 
-const (
+// writeResponse writes the last part of the response, the headers are only
+// nil when the app failed.
+func (h *WsgiRequestHandler) writeResponse(status_code C.int, headers *C.MapKeyVal, body *C.char, body_size C.size_t) {
+	if headers != nil {
+		h.writeHeaders(status_code, headers)
+		h.writeBody(body, body_size)
+	} else if !h.headers_sent {
+		h.w.WriteHeader(int(status_code))
+		if status_code == 500 {
+			h.w.Write([]byte("Internal Server Error"))
+		}
+	} else {
+		h.writeBody(body, body_size)
+	}
+}
+
+//export wsgi_write_response
+func wsgi_write_response(request_id C.int64_t, status_code C.int, headers *C.MapKeyVal, body *C.char, body_size C.size_t, timings *C.RequestTimings) {
+	h := wsgiRequestHandler(request_id)
+	if timings != nil {
+		h.timings = *timings
+	}
+	start := time.Now()
+	h.writeResponse(status_code, headers, body, body_size)
+	h.write += time.Since(start)
+	h.done <- struct{}{}
+}
+
+// ASGI: Implementation
+
+// Asgi stores a reference to a Python Asgi application
+type Asgi struct {
+	// app is the imported app, Reload swaps it for a new one
+	app          atomic.Pointer[asgiInstance]
+	asgi_pattern string
+	venv_path    string
+	options      AsgiOptions
+	cache_key    string
+	// handlers is the number of python handlers that serve the app, the
+	// last one to be cleaned up frees it
+	handlers   int
+	chunk_size int
+	read_ahead int
+	flush      FlushPolicy
+	upgrader   *websocket.Upgrader
+	next       atomic.Uint64
+	websockets atomic.Int64
+	metrics    *appMetrics
+	// reload_lock is held while the app is imported again, drains waits
+	// for the instances that were replaced
+	reload_lock sync.Mutex
+	drains      sync.WaitGroup
+	startup     appStartup
+}
+
+// asgiInstance is an ASGI app imported with its event loops
+type asgiInstance struct {
+	app *C.AsgiApp
+	// loops counts the requests in flight of each event loop of the app
+	loops []atomic.Int64
+	// retired is set when a reload replaces the instance, it only finishes
+	// the requests that it has
+	retired atomic.Bool
+}
+
+// AsgiOptions configures how an ASGI app is run
+type AsgiOptions struct {
+	// Lifespan runs the startup and shutdown events of the app, once in
+	// every event loop.
+	Lifespan bool
+	// EventLoops is the number of event loops that run requests, each one
+	// in its own thread. Zero means one.
+	EventLoops int
+	// Uvloop creates the event loops with uvloop when it's installed.
+	Uvloop bool
+	// BodyChunkSize is the maximum size of the request body chunks passed
+	// to receive, zero uses 64 KiB.
+	BodyChunkSize int
+	// BodyReadAhead is the number of body chunks that are read in the
+	// background before the app receives them, zero disables read-ahead.
+	BodyReadAhead int
+	// Flush is when the response body is flushed to the client.
+	Flush FlushPolicy
+	// WebsocketCompression negotiates permessage-deflate with websocket
+	// clients.
+	WebsocketCompression bool
+	ImportOptions
+}
+
+// FlushMode is when the response of an ASGI request is flushed
+type FlushMode uint8
+
+const (
+	FLUSH_ALWAYS FlushMode = iota
+	FLUSH_ON_SIZE
+	FLUSH_ON_INTERVAL
+	FLUSH_FINAL_ONLY
+)
+
+// FlushPolicy decides when the response body chunks of an ASGI app are
+// flushed. Chunks that aren't flushed stay in the buffer of the response
+// writer, they go out with the next flush or when the buffer fills up.
+// The last chunk of a response is always flushed.
+type FlushPolicy struct {
+	Mode FlushMode
+	// Size is the amount of bytes written since the last flush that
+	// triggers a flush with FLUSH_ON_SIZE.
+	Size int
+	// Interval is the maximum time that written data waits for a flush
+	// with FLUSH_ON_INTERVAL.
+	Interval time.Duration
+}
+
+var asgiapp_lock sync.Mutex = sync.Mutex{}
+var asgiapp_cache map[string]*Asgi = map[string]*Asgi{}
+
+// NewAsgi imports a Python ASGI app
+func NewAsgi(asgi_pattern string, venv_path string, options AsgiOptions) (*Asgi, error) {
+	asgiapp_lock.Lock()
+	defer asgiapp_lock.Unlock()
+
+	if options.EventLoops <= 0 {
+		options.EventLoops = 1
+	}
+	cache_key := appCacheKey(asgi_pattern, venv_path, options)
+	if app, ok := asgiapp_cache[cache_key]; ok {
+		app.handlers++
+		return app, nil
+	}
+
+	if len(strings.Split(asgi_pattern, ":")) != 2 {
+		return nil, errors.New("expected pattern $(MODULE_NAME):$(VARIABLE_NAME)")
+	}
+
+	chunk_size := options.BodyChunkSize
+	if chunk_size <= 0 {
+		chunk_size = 1 << 16
+	}
+
+	ws_upgrader := &upgrader
+	if options.WebsocketCompression {
+		ws_upgrader = &compressing_upgrader
+	}
+
+	result := &Asgi{
+		asgi_pattern: asgi_pattern,
+		venv_path:    venv_path,
+		options:      options,
+		cache_key:    cache_key,
+		handlers:     1,
+		chunk_size:   chunk_size,
+		read_ahead:   options.BodyReadAhead,
+		flush:        options.Flush,
+		upgrader:     ws_upgrader,
+		metrics:      newAppMetrics(asgi_pattern, false),
+	}
+	app, err := result.importApp()
+	if app == nil {
+		return nil, err
+	}
+	result.app.Store(app)
+	asgiapp_cache[cache_key] = result
+	return result, err
+}
+
+// importApp imports the app and starts its event loops. The app is returned
+// with an error when the startup of the lifespan fails.
+func (m *Asgi) importApp() (*asgiInstance, error) {
+	module_app := strings.Split(m.asgi_pattern, ":")
+	module_name := C.CString(module_app[0])
+	defer C.free(unsafe.Pointer(module_name))
+	app_name := C.CString(module_app[1])
+	defer C.free(unsafe.Pointer(app_name))
+
+	var packages_path *C.char = nil
+	if m.venv_path != "" {
+		sitePackagesPath, err := findSitePackagesInVenv(m.venv_path)
+		if err != nil {
+			return nil, err
+		}
+		packages_path = C.CString(sitePackagesPath)
+		defer C.free(unsafe.Pointer(packages_path))
+	}
+
+	preload, pycache_prefix, free := m.options.ImportOptions.cStrings()
+	defer free()
+
+	uvloop := C.uint8_t(0)
+	if m.options.Uvloop {
+		uvloop = C.uint8_t(1)
+	}
+
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
+	start := time.Now()
+	app := C.AsgiApp_import(module_name, app_name, packages_path, preload, pycache_prefix, C.size_t(m.options.EventLoops), uvloop)
+	if app == nil {
+		return nil, errors.New("failed to import module")
+	}
+
+	var err error
+
+	if m.options.Lifespan {
+		status := C.AsgiApp_lifespan_startup(app)
+		if uint8(status) == 0 {
+			err = errors.New("startup failed")
+		}
+	}
+	m.startup.imported(time.Since(start))
+	return &asgiInstance{app: app, loops: make([]atomic.Int64, m.options.EventLoops)}, err
+}
+
+// cleanup runs the shutdown of the lifespan and stops the event loops, the
+// OS thread must be locked.
+func (a *asgiInstance) cleanup() (err error) {
+	status := C.AsgiApp_lifespan_shutdown(a.app)
+	if uint8(status) == 0 {
+		err = errors.New("shutdown failure")
+	}
+
+	C.AsgiApp_cleanup(a.app)
+	return
+}
+
+// inFlight returns the number of requests that the event loops run.
+func (a *asgiInstance) inFlight() (in_flight int64) {
+	for i := range a.loops {
+		in_flight += a.loops[i].Load()
+	}
+	return
+}
+
+// Reload imports the app again and swaps it for the running one. Requests
+// and websockets in flight finish in the old app, which is shut down once
+// they are done. It keeps serving if the import or the startup fails.
+func (m *Asgi) Reload() error {
+	m.reload_lock.Lock()
+	defer m.reload_lock.Unlock()
+	module_name := C.CString(strings.Split(m.asgi_pattern, ":")[0])
+	defer C.free(unsafe.Pointer(module_name))
+	C.Py_forget_modules(module_name)
+	app, err := m.importApp()
+	if err != nil {
+		if app != nil {
+			runtime.LockOSThread()
+			app.cleanup()
+			runtime.UnlockOSThread()
+		}
+		return err
+	}
+	old := m.app.Swap(app)
+	old.retired.Store(true)
+	m.drains.Add(1)
+	go func() {
+		defer m.drains.Done()
+		for old.inFlight() > 0 {
+			time.Sleep(reloadDrainInterval)
+		}
+		runtime.LockOSThread()
+		defer runtime.UnlockOSThread()
+		// The app prints why its shutdown failed, it's gone either way
+		old.cleanup()
+	}()
+	return nil
+}
+
+// Cleanup deallocates CGO resources used by Asgi app
+func (m *Asgi) Cleanup() (err error) {
+	if m != nil && m.app.Load() != nil {
+		asgiapp_lock.Lock()
+		if asgiapp_cache[m.cache_key] != m {
+			asgiapp_lock.Unlock()
+			return
+		}
+		m.handlers--
+		if m.handlers > 0 {
+			asgiapp_lock.Unlock()
+			return
+		}
+		delete(asgiapp_cache, m.cache_key)
+		asgiapp_lock.Unlock()
+		m.metrics.delete()
+
+		m.reload_lock.Lock()
+		defer m.reload_lock.Unlock()
+		m.drains.Wait()
+		runtime.LockOSThread()
+		defer runtime.UnlockOSThread()
+		err = m.app.Load().cleanup()
+	}
+	return
+}
+
+func (m *Asgi) gauges() appGauges {
+	app := m.app.Load()
+	return appGauges{
+		loop_lag:   time.Duration(C.AsgiApp_loop_lag(app.app)),
+		websockets: m.websockets.Load(),
+		in_flight:  app.inFlight(),
+	}
+}
+
+// loop picks the app and its event loop with the fewest requests in flight,
+// ties are broken in round robin order. The request is counted in flight of
+// the loop of an app that a reload didn't replace.
+func (m *Asgi) loop() (*asgiInstance, int) {
+	for {
+		app := m.app.Load()
+		best := 0
+		if len(app.loops) > 1 {
+			start := int(m.next.Add(1) % uint64(len(app.loops)))
+			best = start
+			for i := 1; i < len(app.loops); i++ {
+				candidate := (start + i) % len(app.loops)
+				if app.loops[candidate].Load() < app.loops[best].Load() {
+					best = candidate
+				}
+			}
+		}
+		// A reload that swaps the app after it was loaded waits for this
+		// request, or the request sees that it was retired
+		app.loops[best].Add(1)
+		if !app.retired.Load() {
+			return app, best
+		}
+		app.loops[best].Add(-1)
+	}
+}
+
+type WebsocketState uint8
+
+const (
 	WS_STARTING WebsocketState = iota + 2
 	WS_CONNECTED
 	WS_DISCONNECTED
 )
 
+// websocketQueueSize is the number of messages of a websocket connection
+// that are read before the app receives them
+const websocketQueueSize = 16
+
+// WsMessage is a message read from a websocket connection, its data is in C
+// memory. The last message of a connection has closed set and the close
+// code of the connection.
 type WsMessage struct {
-	mt      int
-	message []byte
+	data         *C.char
+	size         int
+	message_type C.uint8_t
+	closed       bool
+	close_code   int
 }
 
-// AsgiRequestHandler stores pointers to the request and the response writer
-type AsgiRequestHandler struct {
-	event                     *C.AsgiEvent
-	w                         http.ResponseWriter
-	r                         *http.Request
-	completed_body            bool
-	completed_response        bool
-	accumulated_response_size int
-	done                      chan error
+// websocketQueue is a ring of the messages that are waiting for the app,
+// receiver is set when the app waits for a message and the queue is empty.
+// space is signaled when a message is taken out of a full queue.
+type websocketQueue struct {
+	messages [websocketQueueSize]WsMessage
+	head     int
+	size     int
+	receiver *C.AsgiEvent
+	space    sync.Cond
+}
 
-	operations chan AsgiOperations
+// AsgiRequestHandler stores pointers to the request and the response writer.
+// Handlers are reused between requests, see NewAsgiRequestHandler.
+type AsgiRequestHandler struct {
+	// mu serializes the callbacks of the request
+	mu             sync.Mutex
+	id             uint64
+	event          *C.AsgiEvent
+	w              http.ResponseWriter
+	r              *http.Request
+	completed_body bool
+	body           bodyReader
+	// read_ahead reads the body ahead of receive, it's nil when the body
+	// is only read when the app asks for it
+	read_ahead         *readAhead
+	completed_response bool
+	// started is set once the app sent the start of the response, status
+	// is written with the body because a pathsend can turn it into a
+	// partial response. trailers is set when the app sends trailers after
+	// the body.
+	started  bool
+	status   int
+	trailers bool
+
+	// pending has the operations queued by the callbacks of the app, wake
+	// tells the goroutine that serves the request to run them. running is
+	// the batch that it's running. Both slices keep their capacity when
+	// the handler is reused.
+	pending []asgiOp
+	running []asgiOp
+	wake    chan struct{}
+
+	// flush is the flush policy of the response, unflushed counts the
+	// bytes written since the last flush. flush_timer is set while a
+	// flush is pending with FLUSH_ON_INTERVAL.
+	flush        FlushPolicy
+	event_stream bool
+	unflushed    int
+	last_flush   time.Time
+	flush_timer  *time.Timer
 
 	is_websocket    bool
 	websocket_state WebsocketState
 	websocket_conn  *websocket.Conn
+	websocket_queue *websocketQueue
+	upgrader        *websocket.Upgrader
+
+	// timings are taken from the event when the request finishes, write
+	// is the time spent writing the response to the client
+	timings C.RequestTimings
+	write   time.Duration
+}
+
+type asgiOpKind uint8
+
+const (
+	ASGI_OP_RECEIVE asgiOpKind = iota
+	ASGI_OP_HEADERS
+	ASGI_OP_BODY
+	ASGI_OP_TRAILERS
+	ASGI_OP_EARLY_HINT
+	ASGI_OP_PUSH
+	ASGI_OP_PATHSEND
+	ASGI_OP_WEBSOCKET_SEND
+	ASGI_OP_FLUSH
+	ASGI_OP_DONE
+)
+
+// asgiOp is an operation that a callback of the app queues for the goroutine
+// that serves the request, only the fields used by its kind are set.
+type asgiOp struct {
+	kind    asgiOpKind
+	event   *C.AsgiEvent
+	status  C.int
+	headers *C.MapKeyVal
+	body    *C.char
+	length  C.size_t
+	// flag is trailers for ASGI_OP_HEADERS, more_body for ASGI_OP_BODY,
+	// more_trailers for ASGI_OP_TRAILERS and the message type for
+	// ASGI_OP_WEBSOCKET_SEND. body is the path for ASGI_OP_PUSH and
+	// ASGI_OP_PATHSEND.
+	flag C.uint8_t
+	err  error
+}
+
+var asgi_handlers = sync.Pool{New: func() any {
+	return &AsgiRequestHandler{wake: make(chan struct{}, 1)}
+}}
+
+// NewAsgiRequestHandler takes a handler from the pool and prepares it to
+// serve a request.
+func NewAsgiRequestHandler(w http.ResponseWriter, r *http.Request, chunk_size int, flush FlushPolicy) *AsgiRequestHandler {
+	h := asgi_handlers.Get().(*AsgiRequestHandler)
+	h.w = w
+	h.r = r
+	h.body = bodyReader{body: r.Body, length: r.ContentLength, chunk_size: chunk_size}
+	h.flush = flush
+	return h
 }
 
-// AsgiOperations stores operations that should be executed in the background
-type AsgiOperations struct {
-	stop bool
-	op   func()
+// release puts the handler back in the pool. Websocket handlers are left to
+// the garbage collector, their goroutines can outlive the request.
+func (h *AsgiRequestHandler) release() {
+	if h.is_websocket {
+		return
+	}
+	// Callbacks that looked the request up before it finished see that
+	// the id changed
+	h.mu.Lock()
+	h.id = 0
+	h.completed_response = false
+	h.started = false
+	h.status = 0
+	h.trailers = false
+	h.pending = h.pending[:0]
+	h.mu.Unlock()
+	h.event = nil
+	h.w = nil
+	h.r = nil
+	h.completed_body = false
+	h.body = bodyReader{}
+	h.read_ahead = nil
+	h.event_stream = false
+	h.unflushed = 0
+	h.last_flush = time.Time{}
+	h.timings = C.RequestTimings{}
+	h.write = 0
+	select {
+	case <-h.wake:
+	default:
+	}
+	asgi_handlers.Put(h)
+}
+
+// queue adds an operation for the goroutine that serves the request, the
+// lock of the handler must be held.
+func (h *AsgiRequestHandler) queue(op asgiOp) {
+	h.pending = append(h.pending, op)
+	select {
+	case h.wake <- struct{}{}:
+	default:
+	}
 }
 
-func (h *AsgiRequestHandler) consume() {
+// serve runs the operations of the request in the order they were queued,
+// until one of them finishes it.
+func (h *AsgiRequestHandler) serve() error {
 	for {
-		o := <-h.operations
-		if o.op != nil {
-			o.op()
-		}
-		if o.stop {
-			if h.event != nil {
-				runtime.LockOSThread()
-				C.AsgiEvent_cleanup(h.event)
-				runtime.UnlockOSThread()
+		<-h.wake
+		h.mu.Lock()
+		ops := h.pending
+		h.pending = h.running[:0]
+		h.running = ops
+		h.mu.Unlock()
+		for i := range ops {
+			done, err := h.run(&ops[i])
+			ops[i] = asgiOp{}
+			if done {
+				h.finish(ops[i+1:])
+				return err
 			}
-			close(h.operations)
-			break
 		}
 	}
 }
 
-// NewAsgiRequestHandler initializes handler and starts queue that consumes operations
-// in the background.
-func NewAsgiRequestHandler(w http.ResponseWriter, r *http.Request) *AsgiRequestHandler {
-	h := &AsgiRequestHandler{
-		w:    w,
-		r:    r,
-		done: make(chan error, 2),
+// run executes an operation, it returns true when the request is done.
+func (h *AsgiRequestHandler) run(op *asgiOp) (bool, error) {
+	switch op.kind {
+	case ASGI_OP_RECEIVE:
+		var body *C.char
+		var body_len int
+		if !h.completed_body {
+			chunk, ok := h.nextBodyChunk()
+			if ok && chunk.err != nil {
+				C.AsgiEvent_set(op.event, nil, 0, C.uint8_t(0), C.uint8_t(0))
+				return true, requestBodyError(chunk.err)
+			}
+			h.completed_body = !ok || chunk.last
+			body, body_len = chunk.data, chunk.size
+		}
 
-		operations: make(chan AsgiOperations, 16),
+		more_body := C.uint8_t(0)
+		if !h.completed_body {
+			more_body = C.uint8_t(1)
+		}
+
+		C.AsgiEvent_set(op.event, body, C.size_t(body_len), more_body, C.uint8_t(0))
+	case ASGI_OP_HEADERS:
+		start := time.Now()
+		response_headers := h.w.Header()
+		forEachMapKeyVal(op.headers, response_headers.Add)
+		C.free(unsafe.Pointer(op.headers))
+
+		h.started = true
+		h.status = int(op.status)
+		h.trailers = op.flag != 0
+		// Server-sent events are delivered as soon as the app sends them
+		h.event_stream = strings.HasPrefix(response_headers.Get("content-type"), "text/event-stream")
+		h.write += time.Since(start)
+
+		C.AsgiEvent_set(op.event, nil, 0, C.uint8_t(0), C.uint8_t(1))
+	case ASGI_OP_BODY:
+		// Write doesn't keep the slice, so the body is written straight
+		// from C memory
+		start := time.Now()
+		h.writeStatus()
+		_, err := h.w.Write(unsafe.Slice((*byte)(unsafe.Pointer(op.body)), int(op.length)))
+		C.free(unsafe.Pointer(op.body))
+		h.unflushed += int(op.length)
+		if op.flag == 0 || h.shouldFlush() {
+			h.flushResponse()
+		}
+		h.write += time.Since(start)
+
+		C.AsgiEvent_set(op.event, nil, 0, C.uint8_t(0), C.uint8_t(1))
+		// The response finishes with the trailers when the app sends them
+		if err != nil || (op.flag == 0 && !h.trailers) {
+			return true, err
+		}
+	case ASGI_OP_TRAILERS:
+		start := time.Now()
+		h.writeStatus()
+		// Trailers that weren't announced in the headers are sent with
+		// the prefix, like any trailer of a chunked or HTTP/2 response
+		response_headers := h.w.Header()
+		forEachMapKeyVal(op.headers, func(key string, value string) {
+			response_headers.Add(http.TrailerPrefix+key, value)
+		})
+		C.free(unsafe.Pointer(op.headers))
+		h.write += time.Since(start)
+
+		C.AsgiEvent_set(op.event, nil, 0, C.uint8_t(0), C.uint8_t(1))
+		if op.flag == 0 {
+			return true, nil
+		}
+	case ASGI_OP_EARLY_HINT:
+		// Hints are only useful before the response starts
+		if !h.started {
+			start := time.Now()
+			response_headers := h.w.Header()
+			links := response_headers["Link"]
+			forEachMapKeyVal(op.headers, response_headers.Add)
+			h.w.WriteHeader(http.StatusEarlyHints)
+			// The links of the hint aren't repeated in the response
+			if links == nil {
+				delete(response_headers, "Link")
+			} else {
+				response_headers["Link"] = links
+			}
+			h.write += time.Since(start)
+		}
+		C.free(unsafe.Pointer(op.headers))
+
+		C.AsgiEvent_set(op.event, nil, 0, C.uint8_t(0), C.uint8_t(1))
+	case ASGI_OP_PUSH:
+		// Pushes are hints too, clients can refuse them
+		if pusher, ok := h.w.(http.Pusher); ok && !h.started {
+			push_headers := http.Header{}
+			forEachMapKeyVal(op.headers, push_headers.Add)
+			pusher.Push(C.GoString(op.body), &http.PushOptions{Header: push_headers})
+		}
+		C.free(unsafe.Pointer(op.body))
+		C.free(unsafe.Pointer(op.headers))
+
+		C.AsgiEvent_set(op.event, nil, 0, C.uint8_t(0), C.uint8_t(1))
+	case ASGI_OP_PATHSEND:
+		start := time.Now()
+		err := h.sendFile(C.GoString(op.body))
+		C.free(unsafe.Pointer(op.body))
+		h.write += time.Since(start)
+
+		C.AsgiEvent_set(op.event, nil, 0, C.uint8_t(0), C.uint8_t(1))
+		if err != nil || !h.trailers {
+			return true, err
+		}
+	case ASGI_OP_WEBSOCKET_SEND:
+		ws_message_type := websocket.TextMessage
+		if op.flag != C.uint8_t(0) {
+			ws_message_type = websocket.BinaryMessage
+		}
+		// WriteMessage doesn't keep the slice either
+		err := h.websocket_conn.WriteMessage(ws_message_type, unsafe.Slice((*byte)(unsafe.Pointer(op.body)), int(op.length)))
+		C.free(unsafe.Pointer(op.body))
+		if err != nil {
+			h.mu.Lock()
+			h.websocket_state = WS_DISCONNECTED
+			h.mu.Unlock()
+			h.websocket_conn.Close()
+			C.AsgiEvent_disconnect_websocket(op.event)
+		}
+
+		C.AsgiEvent_set(op.event, nil, 0, C.uint8_t(0), C.uint8_t(1))
+	case ASGI_OP_FLUSH:
+		if h.unflushed > 0 {
+			start := time.Now()
+			h.flushResponse()
+			h.write += time.Since(start)
+		}
+	case ASGI_OP_DONE:
+		return true, op.err
+	}
+	return false, nil
+}
+
+// writeStatus writes the status that the app started the response with,
+// once.
+func (h *AsgiRequestHandler) writeStatus() {
+	if h.status != 0 {
+		// The body is dropped if the app doesn't read the rest of it, see
+		// readAhead.stop
+		if h.read_ahead != nil && h.r.ProtoMajor == 1 && h.read_ahead.pending() {
+			h.w.Header().Set("Connection", "close")
+		}
+		h.w.WriteHeader(h.status)
+		h.status = 0
 	}
-	go h.consume()
-	return h
 }
 
-var asgi_lock sync.RWMutex = sync.RWMutex{}
-var asgi_request_counter uint64 = 0
-var asgi_handlers map[uint64]*AsgiRequestHandler = map[uint64]*AsgiRequestHandler{}
+// sendFile writes the file of a pathsend as the body of the response. The
+// file is copied by the ResponseWriter with sendfile(2) when it can, and 200
+// responses get range and conditional requests handled like static files.
+func (h *AsgiRequestHandler) sendFile(path string) error {
+	if !filepath.IsAbs(path) {
+		return fmt.Errorf("pathsend needs an absolute path: %s", path)
+	}
+	f, err := os.Open(path)
+	if err != nil {
+		return err
+	}
+	defer f.Close()
+	info, err := f.Stat()
+	if err != nil {
+		return err
+	}
+	if info.IsDir() {
+		return fmt.Errorf("pathsend of a directory: %s", path)
+	}
+	if h.status == http.StatusOK {
+		h.status = 0
+		// ServeContent sets the length of the part that it sends
+		h.w.Header().Del("Content-Length")
+		http.ServeContent(h.w, h.r, "", info.ModTime(), f)
+	} else {
+		h.writeStatus()
+		if _, err := io.Copy(h.w, f); err != nil {
+			return err
+		}
+	}
+	h.flushResponse()
+	return nil
+}
+
+// finish stops taking operations once the request is done. The ones that
+// were left complete their events without doing anything, so the app doesn't
+// keep waiting for them.
+func (h *AsgiRequestHandler) finish(rest []asgiOp) {
+	h.mu.Lock()
+	h.completed_response = true
+	pending := h.pending
+	if q := h.websocket_queue; q != nil {
+		h.closeWebsocketQueue(q)
+	}
+	h.mu.Unlock()
+	for _, ops := range [][]asgiOp{rest, pending} {
+		for i := range ops {
+			op := &ops[i]
+			switch op.kind {
+			case ASGI_OP_RECEIVE:
+				C.AsgiEvent_set(op.event, nil, 0, C.uint8_t(0), C.uint8_t(0))
+			case ASGI_OP_HEADERS, ASGI_OP_TRAILERS, ASGI_OP_EARLY_HINT, ASGI_OP_PUSH, ASGI_OP_PATHSEND:
+				C.free(unsafe.Pointer(op.body))
+				C.free(unsafe.Pointer(op.headers))
+				C.AsgiEvent_set(op.event, nil, 0, C.uint8_t(0), C.uint8_t(1))
+			case ASGI_OP_BODY, ASGI_OP_WEBSOCKET_SEND:
+				C.free(unsafe.Pointer(op.body))
+				C.AsgiEvent_set(op.event, nil, 0, C.uint8_t(0), C.uint8_t(1))
+			}
+			*op = asgiOp{}
+		}
+	}
+
+	if h.flush_timer != nil {
+		h.flush_timer.Stop()
+		h.flush_timer = nil
+	}
+	if h.read_ahead != nil {
+		h.read_ahead.stop(h.w, h.r)
+	}
+	if h.event != nil {
+		if !h.is_websocket {
+			h.timings = C.AsgiEvent_timings(h.event)
+		}
+		C.AsgiEvent_cleanup(h.event)
+	}
+}
+
+// isWebsocketRequest tells if a request is a websocket handshake, which ASGI
+// apps get as a websocket scope.
+func isWebsocketRequest(r *http.Request) bool {
+	if r.Method != http.MethodGet {
+		return false
+	}
+	contains_connection_upgrade := false
+	for _, v := range r.Header.Values("connection") {
+		if strings.Contains(strings.ToLower(v), "upgrade") {
+			contains_connection_upgrade = true
+			break
+		}
+	}
+	contains_upgrade_websockets := false
+	for _, v := range r.Header.Values("upgrade") {
+		if strings.Contains(strings.ToLower(v), "websocket") {
+			contains_upgrade_websockets = true
+			break
+		}
+	}
+	return contains_connection_upgrade && contains_upgrade_websockets
+}
+
+var asgi_requests requestRegistry[AsgiRequestHandler]
 var upgrader = websocket.Upgrader{} // use default options
+var compressing_upgrader = websocket.Upgrader{EnableCompression: true}
 
 // HandleRequest passes request down to Python ASGI app and writes responses and headers.
 func (m *Asgi) HandleRequest(w http.ResponseWriter, r *http.Request) error {
+	start := time.Now()
 	ctx := r.Context()
 	srvAddr := ctx.Value(http.LocalAddrContextKey).(net.Addr)
 	_, server_port_string, _ := net.SplitHostPort(srvAddr.String())
@@ -620,21 +2132,7 @@ func (m *Asgi) HandleRequest(w http.ResponseWriter, r *http.Request) error {
 	client_host_str := C.CString(client_host)
 	defer C.free(unsafe.Pointer(client_host_str))
 
-	contains_connection_upgrade := false
-	for _, v := range r.Header.Values("connection") {
-		if strings.Contains(strings.ToLower(v), "upgrade") {
-			contains_connection_upgrade = true
-			break
-		}
-	}
-	contains_upgrade_websockets := false
-	for _, v := range r.Header.Values("upgrade") {
-		if strings.Contains(strings.ToLower(v), "websocket") {
-			contains_upgrade_websockets = true
-			break
-		}
-	}
-	is_websocket := contains_connection_upgrade && contains_upgrade_websockets && r.Method == "GET"
+	is_websocket := isWebsocketRequest(r)
 
 	decodedPath, err := url.PathUnescape(r.URL.Path)
 	if err != nil {
@@ -664,31 +2162,14 @@ func (m *Asgi) HandleRequest(w http.ResponseWriter, r *http.Request) error {
 		"query_string": r.URL.RawQuery,
 		"root_path":    "",
 	}
-	scope := C.MapKeyVal_new(C.size_t(len(scope_map)))
-	defer C.free(unsafe.Pointer(scope))
-	defer C.free(unsafe.Pointer(scope.keys))
-	defer C.free(unsafe.Pointer(scope.values))
-	scope_count := 0
-	base_of_keys := uintptr(unsafe.Pointer(scope.keys))
-	base_of_values := uintptr(unsafe.Pointer(scope.values))
-	size_of_pointer := unsafe.Sizeof(scope.keys)
+	scope_pairs := newMapKeyVal(len(scope_map))
 	for k, v := range scope_map {
-		key_str := C.CString(k)
-		defer C.free(unsafe.Pointer(key_str))
-		value_str := C.CString(v)
-		defer C.free(unsafe.Pointer(value_str))
-		*(**C.char)(unsafe.Pointer(base_of_keys + uintptr(scope_count)*size_of_pointer)) = key_str
-		*(**C.char)(unsafe.Pointer(base_of_values + uintptr(scope_count)*size_of_pointer)) = value_str
-		scope_count++
+		scope_pairs.add(k, v)
 	}
+	scope := scope_pairs.pack()
+	defer C.free(unsafe.Pointer(scope))
 
-	request_headers := C.MapKeyVal_new(C.size_t(len(r.Header)))
-	defer C.free(unsafe.Pointer(request_headers))
-	defer C.free(unsafe.Pointer(request_headers.keys))
-	defer C.free(unsafe.Pointer(request_headers.values))
-	header_count := 0
-	base_of_keys = uintptr(unsafe.Pointer(request_headers.keys))
-	base_of_values = uintptr(unsafe.Pointer(request_headers.values))
+	header_pairs := newMapKeyVal(len(r.Header))
 	for k, items := range r.Header {
 		if k == "Proxy" {
 			// golang cgi issue 16405
@@ -700,29 +2181,30 @@ func (m *Asgi) HandleRequest(w http.ResponseWriter, r *http.Request) error {
 			joinStr = "; "
 		}
 
-		key_str := C.CString(strings.ToLower(k))
-		defer C.free(unsafe.Pointer(key_str))
-		value_str := C.CString(strings.Join(items, joinStr))
-		defer C.free(unsafe.Pointer(value_str))
-		*(**C.char)(unsafe.Pointer(base_of_keys + uintptr(header_count)*size_of_pointer)) = key_str
-		*(**C.char)(unsafe.Pointer(base_of_values + uintptr(header_count)*size_of_pointer)) = value_str
-		header_count++
+		header_pairs.add(strings.ToLower(k), strings.Join(items, joinStr))
 	}
+	request_headers := header_pairs.pack()
+	defer C.free(unsafe.Pointer(request_headers))
+	setup := time.Since(start)
 
-	arh := NewAsgiRequestHandler(w, r)
+	arh := NewAsgiRequestHandler(w, r, m.chunk_size, m.flush)
 	arh.is_websocket = is_websocket
+	arh.upgrader = m.upgrader
+	if m.read_ahead > 0 && !is_websocket && r.ContentLength != 0 {
+		// HTTP/1 responses discard the unread body when they start, the
+		// body is read ahead while the app responds
+		http.NewResponseController(w).EnableFullDuplex()
+		arh.startReadAhead(m.read_ahead)
+	}
 
-	asgi_lock.Lock()
-	asgi_request_counter++
-	request_id := asgi_request_counter
-	asgi_handlers[request_id] = arh
-	asgi_lock.Unlock()
+	request_id := asgi_requests.Register(arh)
+	profileRequest("asgi", request_id)
+	arh.mu.Lock()
+	arh.id = request_id
+	arh.mu.Unlock()
 	defer func() {
-		arh.completed_response = true
-		arh.operations <- AsgiOperations{stop: true}
-		asgi_lock.Lock()
-		delete(asgi_handlers, request_id)
-		asgi_lock.Unlock()
+		asgi_requests.Delete(request_id)
+		arh.release()
 	}()
 
 	var subprotocols *C.char = nil
@@ -731,9 +2213,19 @@ func (m *Asgi) HandleRequest(w http.ResponseWriter, r *http.Request) error {
 		defer C.free(unsafe.Pointer(subprotocols))
 	}
 
+	app, loop := m.loop()
+	defer app.loops[loop].Add(-1)
+	if is_websocket {
+		m.websockets.Add(1)
+		defer m.websockets.Add(-1)
+	}
+
 	runtime.LockOSThread()
-	C.AsgiApp_handle_request(
-		m.app,
+	// The event is released when the request finishes, even if the app
+	// never called receive or send
+	arh.event = C.AsgiApp_handle_request(
+		app.app,
+		C.size_t(loop),
 		C.uint64_t(request_id),
 		scope,
 		request_headers,
@@ -742,26 +2234,201 @@ func (m *Asgi) HandleRequest(w http.ResponseWriter, r *http.Request) error {
 		server_host_str,
 		C.int(server_port),
 		subprotocols,
+		asgiExtensions(w, r, is_websocket),
 	)
 	runtime.UnlockOSThread()
+	called := time.Now()
+
+	err = arh.serve()
+	// Websockets would only measure how long connections are open
+	if !is_websocket {
+		timings := cStageTimings(&arh.timings)
+		timings.setup += setup
+		timings.write = arh.write
+		// The app waits for its messages to be sent and written
+		timings.app = max(time.Since(called)-timings.write-timings.marshal, 0)
+		m.metrics.observe(&timings)
+	}
+	return err
+}
 
-	if err := <-arh.done; err != nil {
-		return err
+// bodyChunk is a chunk of the request body in C memory, the event loop frees
+// it after the chunk is delivered.
+type bodyChunk struct {
+	data *C.char
+	size int
+	// last is set on the final chunk of the body
+	last bool
+	err  error
+}
+
+// bodyReader reads the request body in chunks.
+type bodyReader struct {
+	body       io.Reader
+	length     int64
+	read       int64
+	chunk_size int
+}
+
+// next reads the next chunk of the request body straight into C memory.
+// Chunks are at most chunk_size bytes and never go past the Content-Length
+// of the request.
+func (b *bodyReader) next() bodyChunk {
+	size := int64(b.chunk_size)
+	if b.length >= 0 && b.length-b.read < size {
+		size = b.length - b.read
+	}
+	// The chunk is never NULL, even when it's empty
+	data := (*C.char)(C.malloc(C.size_t(size + 1)))
+	n := 0
+	var err error
+	if size > 0 {
+		n, err = b.body.Read(unsafe.Slice((*byte)(unsafe.Pointer(data)), size))
 	}
+	if err != nil && err != io.EOF {
+		C.free(unsafe.Pointer(data))
+		return bodyChunk{err: err}
+	}
+	b.read += int64(n)
+	return bodyChunk{data: data, size: n, last: err == io.EOF || b.read == b.length}
+}
 
-	return nil
+// readAhead reads chunks of the request body in a goroutine while the app
+// runs. The body can't be read once the request finishes, so stop joins the
+// goroutine before the handler returns.
+type readAhead struct {
+	chunks chan bodyChunk
+	// mu guards the state of the goroutine, reading is set while it waits
+	// for the body and done once it read the whole body or failed
+	mu      sync.Mutex
+	stopped bool
+	reading bool
+	done    bool
+}
+
+// startReadAhead reads chunks of the request body in the background, up to
+// n of them are buffered while the app processes the previous ones.
+func (h *AsgiRequestHandler) startReadAhead(n int) {
+	a := &readAhead{chunks: make(chan bodyChunk, n)}
+	h.read_ahead = a
+	body := h.body
+	go func() {
+		defer close(a.chunks)
+		defer func() {
+			a.mu.Lock()
+			a.done = true
+			a.mu.Unlock()
+		}()
+		for {
+			a.mu.Lock()
+			if a.stopped {
+				a.mu.Unlock()
+				return
+			}
+			a.reading = true
+			a.mu.Unlock()
+			chunk := body.next()
+			a.mu.Lock()
+			a.reading = false
+			stopped := a.stopped
+			a.mu.Unlock()
+			if stopped {
+				C.free(unsafe.Pointer(chunk.data))
+				return
+			}
+			if chunk.last || chunk.err != nil {
+				a.mu.Lock()
+				a.done = true
+				a.mu.Unlock()
+			}
+			// stop drains the chunks, so this doesn't block it
+			a.chunks <- chunk
+			if chunk.last || chunk.err != nil {
+				return
+			}
+		}
+	}()
+}
+
+// pending tells if the body wasn't read until its end yet.
+func (a *readAhead) pending() bool {
+	a.mu.Lock()
+	defer a.mu.Unlock()
+	return !a.done
+}
+
+// stop ends the read-ahead and waits for it, a read that waits for the
+// client is interrupted with a read deadline, or by closing the body when
+// the connection doesn't support deadlines. The chunks that the app didn't
+// receive are freed.
+func (a *readAhead) stop(w http.ResponseWriter, r *http.Request) {
+	a.mu.Lock()
+	a.stopped = true
+	reading := a.reading
+	a.mu.Unlock()
+	if reading {
+		// The rest of the body is dropped, an HTTP/1 connection can't
+		// take another request
+		if r.ProtoMajor == 1 {
+			w.Header().Set("Connection", "close")
+		}
+		if err := http.NewResponseController(w).SetReadDeadline(time.Now()); err != nil {
+			r.Body.Close()
+		}
+	}
+	for chunk := range a.chunks {
+		C.free(unsafe.Pointer(chunk.data))
+	}
+}
+
+// nextBodyChunk returns the next chunk of the request body, ok is false when
+// the body was read until its end or an error.
+func (h *AsgiRequestHandler) nextBodyChunk() (chunk bodyChunk, ok bool) {
+	if h.read_ahead == nil {
+		return h.body.next(), true
+	}
+	chunk, ok = <-h.read_ahead.chunks
+	return
+}
+
+// cBytes copies b to C memory that is never NULL, even when b is empty
+func cBytes(b []byte) *C.char {
+	p := C.malloc(C.size_t(len(b) + 1))
+	copy(unsafe.Slice((*byte)(p), len(b)), b)
+	return (*C.char)(p)
+}
+
+// asgiRequestHandler returns the handler of a request with its lock held, or
+// nil if the request already finished.
+func asgiRequestHandler(request_id C.uint64_t) *AsgiRequestHandler {
+	arh := asgi_requests.Lookup(uint64(request_id))
+	if arh == nil {
+		return nil
+	}
+	arh.mu.Lock()
+	if arh.completed_response || arh.id != uint64(request_id) {
+		arh.mu.Unlock()
+		return nil
+	}
+	return arh
+}
+
+// finishAsgiRequest ends a request from a goroutine that doesn't hold the
+// lock of its handler.
+func finishAsgiRequest(request_id C.uint64_t, err error) {
+	if arh := asgiRequestHandler(request_id); arh != nil {
+		arh.queue(asgiOp{kind: ASGI_OP_DONE, err: err})
+		arh.mu.Unlock()
+	}
 }
 
 //export asgi_receive_start
 func asgi_receive_start(request_id C.uint64_t, event *C.AsgiEvent) C.uint8_t {
-	asgi_lock.Lock()
-	defer asgi_lock.Unlock()
-	arh := asgi_handlers[uint64(request_id)]
-	if arh == nil || arh.completed_response {
+	arh := asgiRequestHandler(request_id)
+	if arh == nil {
 		return C.uint8_t(0)
 	}
-
-	arh.event = event
+	defer arh.mu.Unlock()
 
 	if arh.is_websocket {
 		switch arh.websocket_state {
@@ -769,243 +2436,331 @@ func asgi_receive_start(request_id C.uint64_t, event *C.AsgiEvent) C.uint8_t {
 			// TODO: this shouldn't happen, what do I do here?
 			fmt.Println("SHOULD NOT SEE THIS - PLEASE REPORT")
 		case WS_CONNECTED:
-			go func() {
-				mt, message, err := arh.websocket_conn.ReadMessage()
-				if err != nil {
-					closeError, isClose := err.(*websocket.CloseError)
-					closeCode := 1005
-					if isClose {
-						closeCode = closeError.Code
-					}
-					body_str := C.CString(fmt.Sprintf("%d", closeCode))
-					defer C.free(unsafe.Pointer(body_str))
-					arh.websocket_state = WS_DISCONNECTED
-					arh.websocket_conn.Close()
-					runtime.LockOSThread()
-					C.AsgiEvent_disconnect_websocket(event)
-					C.AsgiEvent_set_websocket(event, body_str, C.uint8_t(0), C.uint8_t(0))
-					runtime.UnlockOSThread()
-					arh.done <- fmt.Errorf("websocket closed: %d", closeCode)
-					return
-				}
-				body_str := C.CString(string(message))
-				defer C.free(unsafe.Pointer(body_str))
-
-				message_type := C.uint8_t(0)
-				if mt == websocket.BinaryMessage {
-					message_type = C.uint8_t(1)
-				}
-
-				runtime.LockOSThread()
-				C.AsgiEvent_set_websocket(event, body_str, message_type, C.uint8_t(0))
-				runtime.UnlockOSThread()
-			}()
+			arh.receiveWebsocket(event)
 		case WS_DISCONNECTED:
-			go func() {
-				runtime.LockOSThread()
-				C.AsgiEvent_disconnect_websocket(event)
-				C.AsgiEvent_set(event, nil, C.uint8_t(0), C.uint8_t(0))
-				runtime.UnlockOSThread()
-				arh.done <- errors.New("websocket closed - receive start")
-			}()
+			C.AsgiEvent_disconnect_websocket(event)
+			C.AsgiEvent_set(event, nil, 0, C.uint8_t(0), C.uint8_t(0))
+			arh.queue(asgiOp{kind: ASGI_OP_DONE, err: errors.New("websocket closed - receive start")})
 		default:
 			arh.websocket_state = WS_STARTING
-			runtime.LockOSThread()
 			C.AsgiEvent_connect_websocket(event)
-			C.AsgiEvent_set(event, nil, C.uint8_t(0), C.uint8_t(0))
-			runtime.UnlockOSThread()
+			C.AsgiEvent_set(event, nil, 0, C.uint8_t(0), C.uint8_t(0))
 		}
 		return C.uint8_t(1)
 	}
 
-	arh.operations <- AsgiOperations{op: func() {
-		var body_str *C.char
-		var more_body C.uint8_t
-		if !arh.completed_body {
-			buffer := make([]byte, 1<<16)
-			_, err := arh.r.Body.Read(buffer)
-			if err != nil && err != io.EOF {
-				arh.done <- err
-				return
-			}
-			arh.completed_body = (err == io.EOF)
-			body_str = C.CString(string(buffer))
-			defer C.free(unsafe.Pointer(body_str))
-		}
-
-		if arh.completed_body {
-			more_body = C.uint8_t(0)
-		} else {
-			more_body = C.uint8_t(1)
-		}
-
-		runtime.LockOSThread()
-		C.AsgiEvent_set(event, body_str, more_body, C.uint8_t(0))
-		runtime.UnlockOSThread()
-	}}
+	arh.queue(asgiOp{kind: ASGI_OP_RECEIVE, event: event})
 
 	return C.uint8_t(1)
 }
 
 //export asgi_set_headers
-func asgi_set_headers(request_id C.uint64_t, status_code C.int, headers *C.MapKeyVal, event *C.AsgiEvent) {
-	asgi_lock.Lock()
-	defer asgi_lock.Unlock()
-	arh := asgi_handlers[uint64(request_id)]
-
-	arh.event = event
+func asgi_set_headers(request_id C.uint64_t, status_code C.int, headers *C.MapKeyVal, trailers C.uint8_t, event *C.AsgiEvent) {
+	arh := asgiRequestHandler(request_id)
+	if arh == nil {
+		C.free(unsafe.Pointer(headers))
+		return
+	}
+	defer arh.mu.Unlock()
 
 	if arh.is_websocket {
 		ws_headers := arh.w.Header().Clone()
-		if headers != nil {
-			size_of_pointer := unsafe.Sizeof(headers.keys)
-			defer C.free(unsafe.Pointer(headers))
-			defer C.free(unsafe.Pointer(headers.keys))
-			defer C.free(unsafe.Pointer(headers.values))
-
-			for i := 0; i < int(headers.count); i++ {
-				header_name_ptr := unsafe.Pointer(uintptr(unsafe.Pointer(headers.keys)) + uintptr(i)*size_of_pointer)
-				header_value_ptr := unsafe.Pointer(uintptr(unsafe.Pointer(headers.values)) + uintptr(i)*size_of_pointer)
-				header_name := *(**C.char)(header_name_ptr)
-				defer C.free(unsafe.Pointer(header_name))
-				header_value := *(**C.char)(header_value_ptr)
-				defer C.free(unsafe.Pointer(header_value))
-				ws_headers.Add(C.GoString(header_name), C.GoString(header_value))
-			}
-		}
+		forEachMapKeyVal(headers, ws_headers.Add)
+		C.free(unsafe.Pointer(headers))
 		switch arh.websocket_state {
 		case WS_STARTING:
-			ws_conn, err := upgrader.Upgrade(arh.w, arh.r, ws_headers)
+			ws_conn, err := arh.upgrader.Upgrade(arh.w, arh.r, ws_headers)
 			if err != nil {
 				arh.websocket_state = WS_DISCONNECTED
-				arh.websocket_conn.Close()
-				runtime.LockOSThread()
 				C.AsgiEvent_disconnect_websocket(event)
-				C.AsgiEvent_set(event, nil, C.uint8_t(0), C.uint8_t(1))
-				runtime.UnlockOSThread()
+				C.AsgiEvent_set(event, nil, 0, C.uint8_t(0), C.uint8_t(1))
 				return
 			}
 			arh.websocket_state = WS_CONNECTED
 			arh.websocket_conn = ws_conn
+			arh.websocket_queue = &websocketQueue{}
+			arh.websocket_queue.space.L = &arh.mu
+			go arh.readWebsocket()
 
-			runtime.LockOSThread()
-			C.AsgiEvent_set(event, nil, C.uint8_t(0), C.uint8_t(1))
-			runtime.UnlockOSThread()
+			C.AsgiEvent_set(event, nil, 0, C.uint8_t(0), C.uint8_t(1))
 		case WS_DISCONNECTED:
-			runtime.LockOSThread()
 			C.AsgiEvent_disconnect_websocket(event)
-			C.AsgiEvent_set(event, nil, C.uint8_t(0), C.uint8_t(1))
-			runtime.UnlockOSThread()
+			C.AsgiEvent_set(event, nil, 0, C.uint8_t(0), C.uint8_t(1))
 		}
 		return
 	}
 
-	arh.operations <- AsgiOperations{op: func() {
-		if headers != nil {
-			size_of_pointer := unsafe.Sizeof(headers.keys)
-			defer C.free(unsafe.Pointer(headers))
-			defer C.free(unsafe.Pointer(headers.keys))
-			defer C.free(unsafe.Pointer(headers.values))
-
-			for i := 0; i < int(headers.count); i++ {
-				header_name_ptr := unsafe.Pointer(uintptr(unsafe.Pointer(headers.keys)) + uintptr(i)*size_of_pointer)
-				header_value_ptr := unsafe.Pointer(uintptr(unsafe.Pointer(headers.values)) + uintptr(i)*size_of_pointer)
-				header_name := *(**C.char)(header_name_ptr)
-				defer C.free(unsafe.Pointer(header_name))
-				header_value := *(**C.char)(header_value_ptr)
-				defer C.free(unsafe.Pointer(header_value))
-				arh.w.Header().Add(C.GoString(header_name), C.GoString(header_value))
-			}
-		}
-
-		arh.w.WriteHeader(int(status_code))
-
-		runtime.LockOSThread()
-		C.AsgiEvent_set(event, nil, C.uint8_t(0), C.uint8_t(1))
-		runtime.UnlockOSThread()
-	}}
+	arh.queue(asgiOp{kind: ASGI_OP_HEADERS, event: event, status: status_code, headers: headers, flag: trailers})
 }
 
 //export asgi_send_response
 func asgi_send_response(request_id C.uint64_t, body *C.char, body_len C.size_t, more_body C.uint8_t, event *C.AsgiEvent) {
-	asgi_lock.Lock()
-	defer asgi_lock.Unlock()
-	arh := asgi_handlers[uint64(request_id)]
+	arh := asgiRequestHandler(request_id)
+	if arh == nil {
+		C.free(unsafe.Pointer(body))
+		return
+	}
+	defer arh.mu.Unlock()
 
-	arh.event = event
+	arh.queue(asgiOp{kind: ASGI_OP_BODY, event: event, body: body, length: body_len, flag: more_body})
+}
 
-	arh.operations <- AsgiOperations{op: func() {
-		defer C.free(unsafe.Pointer(body))
-		body_bytes := C.GoBytes(unsafe.Pointer(body), C.int(body_len))
-		arh.accumulated_response_size += len(body_bytes)
-		_, err := arh.w.Write(body_bytes)
-		if f, ok := arh.w.(http.Flusher); ok {
-			f.Flush()
+//export asgi_send_trailers
+func asgi_send_trailers(request_id C.uint64_t, trailers *C.MapKeyVal, more_trailers C.uint8_t, event *C.AsgiEvent) {
+	arh := asgiRequestHandler(request_id)
+	if arh == nil {
+		C.free(unsafe.Pointer(trailers))
+		return
+	}
+	defer arh.mu.Unlock()
+
+	arh.queue(asgiOp{kind: ASGI_OP_TRAILERS, event: event, headers: trailers, flag: more_trailers})
+}
+
+//export asgi_send_early_hint
+func asgi_send_early_hint(request_id C.uint64_t, links *C.MapKeyVal, event *C.AsgiEvent) {
+	arh := asgiRequestHandler(request_id)
+	if arh == nil {
+		C.free(unsafe.Pointer(links))
+		return
+	}
+	defer arh.mu.Unlock()
+
+	arh.queue(asgiOp{kind: ASGI_OP_EARLY_HINT, event: event, headers: links})
+}
+
+//export asgi_send_push
+func asgi_send_push(request_id C.uint64_t, path *C.char, headers *C.MapKeyVal, event *C.AsgiEvent) {
+	arh := asgiRequestHandler(request_id)
+	if arh == nil {
+		C.free(unsafe.Pointer(path))
+		C.free(unsafe.Pointer(headers))
+		return
+	}
+	defer arh.mu.Unlock()
+
+	arh.queue(asgiOp{kind: ASGI_OP_PUSH, event: event, body: path, headers: headers})
+}
+
+//export asgi_send_pathsend
+func asgi_send_pathsend(request_id C.uint64_t, path *C.char, event *C.AsgiEvent) {
+	arh := asgiRequestHandler(request_id)
+	if arh == nil {
+		C.free(unsafe.Pointer(path))
+		return
+	}
+	defer arh.mu.Unlock()
+
+	arh.queue(asgiOp{kind: ASGI_OP_PATHSEND, event: event, body: path})
+}
+
+// asgiExtensions are the extensions of the ASGI spec that the connection of
+// a request supports. HTTP/1.0 has no trailers or informational responses,
+// and only HTTP/2 can push.
+func asgiExtensions(w http.ResponseWriter, r *http.Request, is_websocket bool) C.uint8_t {
+	if is_websocket {
+		return 0
+	}
+	extensions := C.uint8_t(C.ASGI_EXTENSION_PATHSEND)
+	if !r.ProtoAtLeast(1, 1) {
+		return extensions
+	}
+	extensions |= C.ASGI_EXTENSION_TRAILERS | C.ASGI_EXTENSION_EARLY_HINT
+	if _, ok := w.(http.Pusher); ok && r.ProtoMajor == 2 {
+		extensions |= C.ASGI_EXTENSION_PUSH
+	}
+	return extensions
+}
+
+// shouldFlush tells if the response has to be flushed after writing a body
+// chunk that isn't the last one. With FLUSH_ON_INTERVAL it schedules a flush
+// for the data that is left in the buffer.
+func (h *AsgiRequestHandler) shouldFlush() bool {
+	if h.event_stream {
+		return true
+	}
+	switch h.flush.Mode {
+	case FLUSH_ON_SIZE:
+		return h.unflushed >= h.flush.Size
+	case FLUSH_ON_INTERVAL:
+		wait := h.flush.Interval - time.Since(h.last_flush)
+		if wait <= 0 {
+			return true
 		}
-		if err != nil {
-			arh.done <- err
-		} else if int(more_body) == 0 {
-			arh.done <- nil
+		if h.flush_timer == nil {
+			id := C.uint64_t(h.id)
+			h.flush_timer = time.AfterFunc(wait, func() { queueFlush(id) })
 		}
+		return false
+	case FLUSH_FINAL_ONLY:
+		return false
+	}
+	return true
+}
 
-		runtime.LockOSThread()
-		C.AsgiEvent_set(event, nil, C.uint8_t(0), C.uint8_t(1))
-		runtime.UnlockOSThread()
-	}}
+// queueFlush flushes the data left in the buffer from the goroutine that
+// serves the request, unless it already finished.
+func queueFlush(request_id C.uint64_t) {
+	if arh := asgiRequestHandler(request_id); arh != nil {
+		arh.queue(asgiOp{kind: ASGI_OP_FLUSH})
+		arh.mu.Unlock()
+	}
 }
 
-//export asgi_send_response_websocket
-func asgi_send_response_websocket(request_id C.uint64_t, body *C.char, body_len C.size_t, message_type C.uint8_t, event *C.AsgiEvent) {
-	asgi_lock.Lock()
-	defer asgi_lock.Unlock()
-	arh := asgi_handlers[uint64(request_id)]
-
-	arh.event = event
-
-	arh.operations <- AsgiOperations{op: func() {
-		defer C.free(unsafe.Pointer(body))
-		var body_bytes []byte
-		var ws_message_type int
-		if message_type == C.uint8_t(0) {
-			ws_message_type = websocket.TextMessage
-			body_bytes = []byte(C.GoString(body))
-		} else {
-			ws_message_type = websocket.BinaryMessage
-			body_bytes = C.GoBytes(unsafe.Pointer(body), C.int(body_len))
+func (h *AsgiRequestHandler) flushResponse() {
+	if f, ok := h.w.(http.Flusher); ok {
+		f.Flush()
+	}
+	h.unflushed = 0
+	h.last_flush = time.Now()
+	if h.flush_timer != nil {
+		h.flush_timer.Stop()
+		h.flush_timer = nil
+	}
+}
+
+// readWebsocket reads the messages of a websocket connection until it's
+// closed or the request finishes. The reader waits while the queue is full,
+// so a slow app makes the client slow down.
+func (h *AsgiRequestHandler) readWebsocket() {
+	q := h.websocket_queue
+	var buffer bytes.Buffer
+	for {
+		h.mu.Lock()
+		for q.size == len(q.messages) && !h.completed_response {
+			q.space.Wait()
+		}
+		finished := h.completed_response
+		h.mu.Unlock()
+		if finished {
+			return
+		}
+
+		var message WsMessage
+		mt, reader, err := h.websocket_conn.NextReader()
+		if err == nil {
+			buffer.Reset()
+			_, err = buffer.ReadFrom(reader)
 		}
-		err := arh.websocket_conn.WriteMessage(ws_message_type, body_bytes)
 		if err != nil {
-			arh.websocket_state = WS_DISCONNECTED
-			arh.websocket_conn.Close()
-			runtime.LockOSThread()
-			C.AsgiEvent_disconnect_websocket(event)
-			C.AsgiEvent_set(event, nil, C.uint8_t(0), C.uint8_t(1))
-			runtime.UnlockOSThread()
+			message.closed = true
+			message.close_code = 1005
+			if closeError, isClose := err.(*websocket.CloseError); isClose {
+				message.close_code = closeError.Code
+			}
+		} else {
+			message.data = cBytes(buffer.Bytes())
+			message.size = buffer.Len()
+			if mt == websocket.BinaryMessage {
+				message.message_type = C.uint8_t(1)
+			}
+			// Don't keep the memory of a big message for the whole
+			// connection
+			if buffer.Cap() > 1<<16 {
+				buffer = bytes.Buffer{}
+			}
+		}
+
+		h.mu.Lock()
+		if h.completed_response {
+			h.mu.Unlock()
+			C.free(unsafe.Pointer(message.data))
 			return
 		}
+		if q.receiver != nil {
+			event := q.receiver
+			q.receiver = nil
+			h.deliverWebsocket(event, message)
+		} else {
+			q.messages[(q.head+q.size)%len(q.messages)] = message
+			q.size++
+		}
+		h.mu.Unlock()
+		if message.closed {
+			return
+		}
+	}
+}
 
-		runtime.LockOSThread()
-		C.AsgiEvent_set(event, nil, C.uint8_t(0), C.uint8_t(1))
-		runtime.UnlockOSThread()
-	}}
+// receiveWebsocket completes a receive of the app with the next message of
+// the queue, or makes it wait for the reader. The lock of the handler must
+// be held.
+func (h *AsgiRequestHandler) receiveWebsocket(event *C.AsgiEvent) {
+	q := h.websocket_queue
+	if q.size == 0 {
+		q.receiver = event
+		return
+	}
+	message := q.messages[q.head]
+	q.messages[q.head] = WsMessage{}
+	q.head = (q.head + 1) % len(q.messages)
+	if q.size == len(q.messages) {
+		q.space.Signal()
+	}
+	q.size--
+	h.deliverWebsocket(event, message)
+}
+
+// deliverWebsocket passes a message to a receive of the app, the close of the
+// connection finishes the request. The lock of the handler must be held.
+func (h *AsgiRequestHandler) deliverWebsocket(event *C.AsgiEvent, message WsMessage) {
+	if message.closed {
+		close_code := []byte(strconv.Itoa(message.close_code))
+		h.websocket_state = WS_DISCONNECTED
+		h.websocket_conn.Close()
+		C.AsgiEvent_disconnect_websocket(event)
+		C.AsgiEvent_set_websocket(event, cBytes(close_code), C.size_t(len(close_code)), C.uint8_t(0), C.uint8_t(0))
+		h.queue(asgiOp{kind: ASGI_OP_DONE, err: fmt.Errorf("websocket closed: %d", message.close_code)})
+		return
+	}
+	C.AsgiEvent_set_websocket(event, message.data, C.size_t(message.size), message.message_type, C.uint8_t(0))
+}
+
+// closeWebsocketQueue frees the messages that the app didn't receive when
+// the request finishes, a receive that is waiting gets a disconnect. The
+// lock of the handler must be held.
+func (h *AsgiRequestHandler) closeWebsocketQueue(q *websocketQueue) {
+	for ; q.size > 0; q.size-- {
+		C.free(unsafe.Pointer(q.messages[q.head].data))
+		q.messages[q.head] = WsMessage{}
+		q.head = (q.head + 1) % len(q.messages)
+	}
+	if q.receiver != nil {
+		C.AsgiEvent_disconnect_websocket(q.receiver)
+		C.AsgiEvent_set(q.receiver, nil, 0, C.uint8_t(0), C.uint8_t(0))
+		q.receiver = nil
+	}
+	q.space.Broadcast()
+	// Stops the reader if it's waiting for a message
+	h.websocket_conn.Close()
+}
+
+//export asgi_send_response_websocket
+func asgi_send_response_websocket(request_id C.uint64_t, body *C.char, body_len C.size_t, message_type C.uint8_t, event *C.AsgiEvent) {
+	arh := asgiRequestHandler(request_id)
+	if arh == nil {
+		C.free(unsafe.Pointer(body))
+		return
+	}
+	defer arh.mu.Unlock()
+
+	arh.queue(asgiOp{kind: ASGI_OP_WEBSOCKET_SEND, event: event, body: body, length: body_len, flag: message_type})
 }
 
 //export asgi_cancel_request
 func asgi_cancel_request(request_id C.uint64_t) {
-	asgi_lock.Lock()
-	defer asgi_lock.Unlock()
-	arh, ok := asgi_handlers[uint64(request_id)]
-	if ok {
-		arh.done <- errors.New("request cancelled")
+	arh := asgiRequestHandler(request_id)
+	if arh != nil {
+		defer arh.mu.Unlock()
+		arh.queue(asgiOp{kind: ASGI_OP_DONE, err: errors.New("request cancelled")})
 	}
 }
 
 //export asgi_cancel_request_websocket
 func asgi_cancel_request_websocket(request_id C.uint64_t, reason *C.char, code C.int) {
-	asgi_lock.Lock()
-	defer asgi_lock.Unlock()
-	arh, ok := asgi_handlers[uint64(request_id)]
-	if ok {
+	arh := asgiRequestHandler(request_id)
+	if arh != nil {
+		defer arh.mu.Unlock()
 		var reasonText string
 		if reason != nil {
 			defer C.free(unsafe.Pointer(reason))
@@ -1014,7 +2769,7 @@ func asgi_cancel_request_websocket(request_id C.uint64_t, reason *C.char, code C
 		closeCode := int(code)
 		if arh.websocket_state == WS_STARTING {
 			arh.w.WriteHeader(403)
-			arh.done <- fmt.Errorf("websocket closed: %d '%s'", closeCode, reasonText)
+			arh.queue(asgiOp{kind: ASGI_OP_DONE, err: fmt.Errorf("websocket closed: %d '%s'", closeCode, reasonText)})
 		} else if arh.websocket_state == WS_CONNECTED {
 			arh.websocket_state = WS_DISCONNECTED
 			closeMessage := websocket.FormatCloseMessage(closeCode, reasonText)
@@ -1022,7 +2777,7 @@ func asgi_cancel_request_websocket(request_id C.uint64_t, reason *C.char, code C
 				if arh.websocket_conn != nil {
 					arh.websocket_conn.WriteControl(websocket.CloseMessage, closeMessage, time.Now().Add(5*time.Second))
 					arh.websocket_conn.Close()
-					arh.done <- fmt.Errorf("websocket closed: %d '%s'", closeCode, reasonText)
+					finishAsgiRequest(request_id, fmt.Errorf("websocket closed: %d '%s'", closeCode, reasonText))
 				}
 			}()
 		}
@@ -6,43 +6,100 @@
 #include <stdlib.h>
 
 void Py_init_and_release_gil(const char *);
+uint8_t Py_subinterpreters_supported(void);
+uint64_t Py_gil_acquisitions(void);
+uint8_t Py_profile_start(int);
+char *Py_profile_stop(void);
+void Py_forget_modules(const char *);
 
+// MapKeyVal is a list of key-value pairs packed in a single allocation that
+// is released with free. Strings are NUL terminated and also have explicit
+// sizes, so values that contain NUL bytes are kept whole.
 typedef struct {
   size_t count;
   char **keys;
   char **values;
+  size_t *key_sizes;
+  size_t *value_sizes;
+  // Where the next string is copied, after the arrays
+  char *data;
 } MapKeyVal;
-MapKeyVal *MapKeyVal_new(size_t);
+MapKeyVal *MapKeyVal_new(size_t, size_t);
+void MapKeyVal_set(MapKeyVal *, size_t, const char *, size_t, const char *,
+                   size_t);
+
+// RequestTimings are the nanoseconds that a request spent in each stage of
+// the bridge to Python, they are reported to Go with the end of the request.
+typedef struct {
+  // Waiting in the task queue for a worker thread, WSGI only
+  int64_t queue_wait;
+  // Waiting for the GIL in the thread that handles the request
+  int64_t gil_wait;
+  // Building the environ or the scope
+  int64_t setup;
+  // Running the app, for WSGI it includes iterating the response body
+  int64_t app;
+  // Converting the response from Python objects
+  int64_t marshal;
+} RequestTimings;
 
 // WSGI Protocol
 typedef struct WsgiApp WsgiApp;
-WsgiApp *WsgiApp_import(const char *, const char *, const char *);
-void WsgiApp_handle_request(WsgiApp *, int64_t, MapKeyVal *, const char *);
+WsgiApp *WsgiApp_import(const char *, const char *, const char *,
+                        const char *, const char *, size_t, uint8_t);
+void WsgiApp_handle_request(WsgiApp *, int64_t, MapKeyVal *, const char *,
+                            size_t, uint8_t, int64_t);
+typedef struct {
+  int status;
+  MapKeyVal *headers;
+  char *body;
+  size_t body_len;
+  RequestTimings timings;
+} WsgiResponse;
+uint8_t WsgiApp_call(WsgiApp *, int64_t, MapKeyVal *, const char *, size_t,
+                     uint8_t, int64_t, WsgiResponse *);
 void WsgiApp_cleanup(WsgiApp *);
 
-extern void wsgi_write_response(int64_t, int, MapKeyVal *, char *, size_t);
+extern void wsgi_write_response(int64_t, int, MapKeyVal *, char *, size_t,
+                                RequestTimings *);
+extern void wsgi_write_chunk(int64_t, int, MapKeyVal *, char *, size_t);
+extern void wsgi_write_file(int64_t, int, MapKeyVal *, int, RequestTimings *);
+extern int64_t wsgi_read_body(int64_t, char *, size_t);
 
 // ASGI 3.0 protocol
 
 typedef struct AsgiApp AsgiApp;
 typedef struct AsgiEvent AsgiEvent;
-AsgiApp *AsgiApp_import(const char *, const char *, const char *);
+AsgiApp *AsgiApp_import(const char *, const char *, const char *,
+                        const char *, const char *, size_t, uint8_t);
 uint8_t AsgiApp_lifespan_startup(AsgiApp *);
 uint8_t AsgiApp_lifespan_shutdown(AsgiApp *);
-void AsgiApp_handle_request(AsgiApp *, uint64_t, MapKeyVal *, MapKeyVal *,
-                            const char *, int, const char *, int, const char *);
-void AsgiEvent_set(AsgiEvent *, const char *, uint8_t, uint8_t);
-void AsgiEvent_set_websocket(AsgiEvent *, const char *, uint8_t, uint8_t);
+// Extensions of the ASGI spec that a request supports
+#define ASGI_EXTENSION_TRAILERS 1
+#define ASGI_EXTENSION_EARLY_HINT 2
+#define ASGI_EXTENSION_PUSH 4
+#define ASGI_EXTENSION_PATHSEND 8
+AsgiEvent *AsgiApp_handle_request(AsgiApp *, size_t, uint64_t, MapKeyVal *,
+                                  MapKeyVal *, const char *, int, const char *,
+                                  int, const char *, uint8_t);
+void AsgiEvent_set(AsgiEvent *, char *, size_t, uint8_t, uint8_t);
+void AsgiEvent_set_websocket(AsgiEvent *, char *, size_t, uint8_t, uint8_t);
 void AsgiEvent_connect_websocket(AsgiEvent *);
 void AsgiEvent_disconnect_websocket(AsgiEvent *);
 void AsgiEvent_cleanup(AsgiEvent *);
+RequestTimings AsgiEvent_timings(AsgiEvent *);
+int64_t AsgiApp_loop_lag(AsgiApp *);
 void AsgiApp_cleanup(AsgiApp *);
 
 extern uint8_t asgi_receive_start(uint64_t, AsgiEvent *);
 extern void asgi_send_response(uint64_t, char *, size_t, uint8_t, AsgiEvent *);
 extern void asgi_send_response_websocket(uint64_t, char *, size_t, uint8_t,
                                          AsgiEvent *);
-extern void asgi_set_headers(uint64_t, int, MapKeyVal *, AsgiEvent *);
+extern void asgi_set_headers(uint64_t, int, MapKeyVal *, uint8_t, AsgiEvent *);
+extern void asgi_send_trailers(uint64_t, MapKeyVal *, uint8_t, AsgiEvent *);
+extern void asgi_send_early_hint(uint64_t, MapKeyVal *, AsgiEvent *);
+extern void asgi_send_push(uint64_t, char *, MapKeyVal *, AsgiEvent *);
+extern void asgi_send_pathsend(uint64_t, char *, AsgiEvent *);
 extern void asgi_cancel_request(uint64_t);
 extern void asgi_cancel_request_websocket(uint64_t, char *, int);
 
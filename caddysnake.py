@@ -1,41 +1,74 @@
-def caddysnake_setup_wsgi(callback):
+def caddysnake_setup_wsgi(callback, workers, get_task=None):
     from queue import SimpleQueue
     from threading import Thread
 
-    task_queue = SimpleQueue()
-
-    def process_request_response(task):
-        try:
-            task.call_wsgi()
-            callback(task, None)
-        except Exception as e:
-            callback(task, e)
+    # Sub-interpreters are given a function that waits for requests in C
+    task_queue = None
+    if get_task is None:
+        task_queue = SimpleQueue()
+        get_task = task_queue.get
 
     def worker():
         while True:
-            task = task_queue.get()
-            Thread(target=process_request_response, args=(task,)).start()
+            task = get_task()
+            if task is None:
+                # Sent on cleanup, stop this worker
+                break
+            try:
+                task.call_wsgi()
+                callback(task, None)
+            except Exception as e:
+                callback(task, e)
 
-    Thread(target=worker).start()
+    threads = [Thread(target=worker) for _ in range(workers)]
+    for t in threads:
+        t.start()
 
-    return task_queue
+    return task_queue, threads
 
 
-def caddysnake_setup_asgi(loop):
+def caddysnake_setup_asgi():
     import asyncio
+    import sys
     from threading import Thread
 
-    # See: https://stackoverflow.com/questions/33000200/asyncio-wait-for-event-from-other-thread
-    class Event_ts(asyncio.Event):
-        def set(self):
-            loop.call_soon_threadsafe(super().set)
+    def start_loop(wakeup_fd, drain_completions, record_lag, use_uvloop):
+        loop = None
+        if use_uvloop:
+            try:
+                import uvloop
+
+                loop = uvloop.new_event_loop()
+            except ImportError:
+                print("uvloop is not installed, using asyncio", file=sys.stderr)
+        if loop is None:
+            loop = asyncio.new_event_loop()
+
+        # Waiters of requests are completed by drain_completions in the loop
+        loop.add_reader(wakeup_fd, drain_completions)
+
+        # The lag of the loop is how late a callback runs, it's sampled
+        # twice a second
+        def probe(expected):
+            now = loop.time()
+            record_lag(max(now - expected, 0.0))
+            loop.call_at(now + 0.5, probe, now + 0.5)
+
+        loop.call_soon(probe, loop.time())
+
+        def run():
+            loop.run_forever()
+            loop.remove_reader(wakeup_fd)
+            loop.close()
+
+        Thread(target=run).start()
+        return loop
 
     def build_receive(asgi_event):
         async def receive():
-            ev = asgi_event.receive_start()
-            if ev:
-                await ev.wait()
-                ev.clear()
+            waiter = asgi_event.receive_start()
+            if waiter:
+                await waiter
                 result = asgi_event.receive_end()
                 return result
             else:
@@ -45,15 +78,11 @@ def caddysnake_setup_asgi(loop):
 
     def build_send(asgi_event):
         async def send(data):
-            ev = asgi_event.send(data)
-            await ev.wait()
-            ev.clear()
+            await asgi_event.send(data)
 
         return send
 
-    def build_lifespan(app, state):
-        import sys
-        import warnings
+    def build_lifespan(app, state, loop):
 
         scope = {
             "type": "lifespan",
@@ -113,15 +142,137 @@ def caddysnake_setup_asgi(loop):
 
         return lifespan_startup, lifespan_shutdown
 
-    Thread(target=loop.run_forever).start()
-
     class WebsocketClosed(IOError):
         pass
 
     return (
-        Event_ts,
         build_receive,
         build_send,
         build_lifespan,
         WebsocketClosed,
+        start_loop,
     )
+
+
+def caddysnake_setup_profiler():
+    import json
+    import sys
+    import threading
+    import time
+
+    # Threads that are serving a WSGI request, the bridge registers them
+    # while a profile runs
+    request_threads = {}
+    # Frames of the ASGI requests that are running
+    request_frames = {}
+    bridge_file = sys._getframe().f_code.co_filename
+
+    async def profiled(request_id, coro):
+        frame = sys._getframe()
+        request_frames[frame] = request_id
+        try:
+            return await coro
+        finally:
+            del request_frames[frame]
+
+    def request_stack(thread, frame):
+        # Returns the request that a thread is serving and the frames of the
+        # app, from the innermost one
+        kind, request_id = "wsgi", request_threads.get(thread)
+        stack = []
+        while frame is not None:
+            if frame in request_frames:
+                kind, request_id = "asgi", request_frames[frame]
+                break
+            code = frame.f_code
+            if code.co_filename == bridge_file and code.co_name == "worker":
+                break
+            name = getattr(code, "co_qualname", code.co_name)
+            stack.append((name, code.co_filename, frame.f_lineno or 0))
+            frame = frame.f_back
+        return kind, request_id, tuple(stack)
+
+    def start(hz):
+        samples = {}
+        stopped = threading.Event()
+        request_threads.clear()
+
+        def sample():
+            interval = 1 / hz
+            deadline = time.monotonic()
+            while True:
+                deadline += interval
+                if stopped.wait(max(deadline - time.monotonic(), 0)):
+                    return
+                for thread, frame in sys._current_frames().items():
+                    kind, request_id, stack = request_stack(thread, frame)
+                    if request_id is None:
+                        continue
+                    key = (kind, request_id, stack)
+                    samples[key] = samples.get(key, 0) + 1
+
+        sampler = threading.Thread(target=sample, daemon=True)
+        sampler.start()
+
+        def stop():
+            stopped.set()
+            sampler.join()
+            request_threads.clear()
+            return json.dumps(
+                [
+                    {
+                        "kind": kind,
+                        "request": request_id,
+                        "count": count,
+                        "stack": [
+                            {"name": name, "file": file, "line": line}
+                            for name, file, line in stack
+                        ],
+                    }
+                    for (kind, request_id, stack), count in samples.items()
+                ]
+            )
+
+        return stop
+
+    return start, profiled, request_threads
+
+
+def caddysnake_setup_reload():
+    import importlib
+    import os
+    import sys
+
+    installed_dirs = {"site-packages", "dist-packages"}
+
+    def forget_modules(module_name):
+        # Removes the app and the modules next to it from sys.modules, so
+        # importing the app again runs the code that is on disk. Installed
+        # packages stay, they are usually the slow ones to import.
+        module = sys.modules.get(module_name.partition(".")[0])
+        path = getattr(module, "__file__", None)
+        if path is None:
+            return
+        root = os.path.dirname(os.path.abspath(path))
+        if hasattr(module, "__path__"):
+            # The code of a package is in the directory that contains it
+            root = os.path.dirname(root)
+        root = os.path.join(root, "")
+        prefixes = tuple(
+            os.path.join(os.path.abspath(prefix), "")
+            for prefix in {sys.prefix, sys.base_prefix, sys.exec_prefix}
+        )
+        for name, module in list(sys.modules.items()):
+            path = getattr(module, "__file__", None)
+            if path is None:
+                continue
+            path = os.path.abspath(path)
+            if (
+                path.startswith(root)
+                and not path.startswith(prefixes)
+                and installed_dirs.isdisjoint(path.split(os.sep))
+            ):
+                del sys.modules[name]
+        importlib.invalidate_caches()
+
+    return forget_modules
@@ -1,10 +1,17 @@
 package caddysnake
 
 import (
+	"bufio"
+	"io"
+	"net"
+	"net/http"
+	"net/http/httptest"
 	"os"
 	"path/filepath"
 	"strings"
+	"sync/atomic"
 	"testing"
+	"time"
 )
 
 func TestFindSitePackagesInVenv(t *testing.T) {
@@ -73,3 +80,202 @@ func TestFindSitePackagesInVenv_NoSitePackages(t *testing.T) {
 		t.Errorf("expected error %q, got %q", expectedError, err.Error())
 	}
 }
+
+// testVenv creates a venv with a module. Python is initialized when the
+// package loads, so the venv only has to hold the module of the apps.
+func testVenv(t *testing.T, module string, source string) string {
+	venv := t.TempDir()
+	site_packages := filepath.Join(venv, "lib", "python3.11", "site-packages")
+	if err := os.MkdirAll(site_packages, 0755); err != nil {
+		t.Fatal(err)
+	}
+	if err := os.WriteFile(filepath.Join(site_packages, module+".py"), []byte(source), 0644); err != nil {
+		t.Fatal(err)
+	}
+	return venv
+}
+
+func TestAppCacheOptions(t *testing.T) {
+	venv := testVenv(t, "cacheoptions", `
+def wsgi(environ, start_response):
+    start_response("200 OK", [])
+    return [b""]
+
+async def asgi(scope, receive, send):
+    pass
+`)
+
+	first, err := NewWsgi("cacheoptions:wsgi", venv, WsgiOptions{Workers: 2})
+	if err != nil {
+		t.Fatal(err)
+	}
+	shared, err := NewWsgi("cacheoptions:wsgi", venv, WsgiOptions{Workers: 2})
+	if err != nil {
+		t.Fatal(err)
+	}
+	if shared != first {
+		t.Error("expected handlers with the same options to share the app")
+	}
+	// A config reload provisions the new handler before the old one is
+	// cleaned up
+	reloaded, err := NewWsgi("cacheoptions:wsgi", venv, WsgiOptions{Workers: 3})
+	if err != nil {
+		t.Fatal(err)
+	}
+	if reloaded == first {
+		t.Fatal("expected a new app when the options differ")
+	}
+	if reloaded.workers != 3 || first.workers != 2 {
+		t.Errorf("expected 3 and 2 workers, got %d and %d", reloaded.workers, first.workers)
+	}
+	first.Cleanup()
+	if wsgiapp_cache[first.cache_key] != first {
+		t.Error("expected the app to be kept until its last handler is cleaned up")
+	}
+	shared.Cleanup()
+	if _, ok := wsgiapp_cache[first.cache_key]; ok {
+		t.Error("expected the app to be freed")
+	}
+	if wsgiapp_cache[reloaded.cache_key] != reloaded {
+		t.Error("expected the new app to be kept")
+	}
+	reloaded.Cleanup()
+
+	a1, err := NewAsgi("cacheoptions:asgi", venv, AsgiOptions{})
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer a1.Cleanup()
+	a2, err := NewAsgi("cacheoptions:asgi", venv, AsgiOptions{EventLoops: 1})
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer a2.Cleanup()
+	if a2 != a1 {
+		t.Error("expected the default event loops to match one event loop")
+	}
+	a3, err := NewAsgi("cacheoptions:asgi", venv, AsgiOptions{EventLoops: 2})
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer a3.Cleanup()
+	if a3 == a1 || a3.options.EventLoops != 2 {
+		t.Error("expected a new app with two event loops")
+	}
+}
+
+// trackedBody counts the reads of a request body, reads is written without
+// a lock so the race detector sees reads that race with the end of the
+// request.
+type trackedBody struct {
+	io.ReadCloser
+	reads    int
+	in_read  atomic.Int32
+	returned atomic.Bool
+	late     atomic.Int32
+}
+
+func (b *trackedBody) Read(p []byte) (int, error) {
+	b.reads++
+	if b.returned.Load() {
+		b.late.Add(1)
+	}
+	b.in_read.Add(1)
+	defer b.in_read.Add(-1)
+	return b.ReadCloser.Read(p)
+}
+
+func TestAsgiReadAheadStops(t *testing.T) {
+	venv := testVenv(t, "readaheadstops", `
+async def app(scope, receive, send):
+    await receive()
+    await send({"type": "http.response.start", "status": 401, "headers": []})
+    await send({"type": "http.response.body", "body": b"denied"})
+`)
+	app, err := NewAsgi("readaheadstops:app", venv, AsgiOptions{BodyChunkSize: 1000, BodyReadAhead: 4})
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer app.Cleanup()
+
+	bodies := make(chan *trackedBody, 1)
+	srv := httptest.NewServer(http.HandlerFunc(func(w http.ResponseWriter, r *http.Request) {
+		body := &trackedBody{ReadCloser: r.Body}
+		r.Body = body
+		if err := app.HandleRequest(w, r); err != nil {
+			t.Errorf("unexpected error: %v", err)
+		}
+		if n := body.in_read.Load(); n != 0 {
+			t.Errorf("expected no read in progress, got %d after %d reads", n, body.reads)
+		}
+		body.returned.Store(true)
+		bodies <- body
+	}))
+	defer srv.Close()
+
+	// The client sends part of a large body and stalls
+	pr, pw := io.Pipe()
+	req, _ := http.NewRequest("POST", srv.URL, pr)
+	req.ContentLength = 1 << 20
+	go pw.Write(make([]byte, 1000))
+	resp, err := http.DefaultClient.Do(req)
+	if err != nil {
+		t.Fatal(err)
+	}
+	io.ReadAll(resp.Body)
+	resp.Body.Close()
+	if resp.StatusCode != http.StatusUnauthorized || !resp.Close {
+		t.Errorf("expected status 401 and the connection to be closed, got %d and %v", resp.StatusCode, resp.Close)
+	}
+	body := <-bodies
+
+	// More of the body arrives after the request finished
+	go pw.Write(make([]byte, 4000))
+	time.Sleep(100 * time.Millisecond)
+	pw.Close()
+	if n := body.late.Load(); n != 0 {
+		t.Errorf("expected no reads after the request finished, got %d", n)
+	}
+}
+
+func TestWsgiStreamBodyAllocation(t *testing.T) {
+	venv := testVenv(t, "streamallocation", `
+def app(environ, start_response):
+    try:
+        environ["wsgi.input"].read()
+        result = b"read"
+    except MemoryError:
+        result = b"MemoryError"
+    except Exception:
+        result = b"error"
+    start_response("200 OK", [])
+    return [result]
+`)
+	app, err := NewWsgi("streamallocation:app", venv, WsgiOptions{StreamBody: true})
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer app.Cleanup()
+	srv := httptest.NewServer(http.HandlerFunc(func(w http.ResponseWriter, r *http.Request) {
+		app.HandleRequest(w, r)
+	}))
+	defer srv.Close()
+
+	// The client announces a terabyte and sends a few bytes, the body isn't
+	// allocated upfront
+	conn, err := net.Dial("tcp", srv.Listener.Addr().String())
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer conn.Close()
+	io.WriteString(conn, "POST / HTTP/1.1\r\nHost: test\r\nContent-Length: 1099511627776\r\n\r\nsome bytes")
+	conn.(*net.TCPConn).CloseWrite()
+	resp, err := http.ReadResponse(bufio.NewReader(conn), nil)
+	if err != nil {
+		t.Fatal(err)
+	}
+	body, _ := io.ReadAll(resp.Body)
+	if string(body) != "error" {
+		t.Errorf("expected the truncated body to fail the read, got %q", body)
+	}
+}
@@ -0,0 +1,221 @@
+package caddysnake
+
+import (
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/prometheus/client_golang/prometheus"
+)
+
+// Metrics of the bridge between Caddy and Python. They are registered in the
+// default Prometheus registry, the one that Caddy's metrics handler and
+// admin endpoint expose. Every metric is labelled with the pattern of the
+// app, like "main:app".
+
+// stageBuckets go from 10µs to about 2.6s, the stages of a request take a few
+// microseconds when things are fine.
+var stageBuckets = prometheus.ExponentialBuckets(0.00001, 4, 10)
+
+func newStageHistogram(name string, help string) *prometheus.HistogramVec {
+	return prometheus.NewHistogramVec(prometheus.HistogramOpts{
+		Namespace: "caddy",
+		Subsystem: "python",
+		Name:      name,
+		Help:      help,
+		Buckets:   stageBuckets,
+	}, []string{"app"})
+}
+
+var (
+	queueWaitSeconds = newStageHistogram("queue_wait_seconds", "Time that WSGI requests waited for a worker thread.")
+	gilWaitSeconds   = newStageHistogram("gil_wait_seconds", "Time that requests waited for the GIL before they were passed to Python.")
+	setupSeconds     = newStageHistogram("setup_seconds", "Time spent building the WSGI environ or the ASGI scope.")
+	appSeconds       = newStageHistogram("app_seconds", "Time spent running the app.")
+	marshalSeconds   = newStageHistogram("marshal_seconds", "Time spent converting responses from Python objects.")
+	writeSeconds     = newStageHistogram("write_seconds", "Time spent writing responses to the client from the callbacks of Python.")
+
+	inFlightDesc = prometheus.NewDesc("caddy_python_requests_in_flight", "Requests that are being served by the app.", []string{"app"}, nil)
+	queueDesc    = prometheus.NewDesc("caddy_python_task_queue_depth", "WSGI requests that are waiting for a worker thread.", []string{"app"}, nil)
+	lagDesc      = prometheus.NewDesc("caddy_python_event_loop_lag_seconds", "How late the slowest event loop of an ASGI app runs callbacks.", []string{"app"}, nil)
+	socketsDesc  = prometheus.NewDesc("caddy_python_websockets_open", "Websocket connections of an ASGI app that are open.", []string{"app"}, nil)
+	startupDesc  = prometheus.NewDesc("caddy_python_startup_seconds", "Time that the last start or reload of the app took, by stage.", []string{"app", "stage"}, nil)
+)
+
+func init() {
+	prometheus.MustRegister(
+		queueWaitSeconds,
+		gilWaitSeconds,
+		setupSeconds,
+		appSeconds,
+		marshalSeconds,
+		writeSeconds,
+		appCollector{},
+	)
+}
+
+// stageTimings is the time that a request spent in each stage of the bridge,
+// stages that don't apply are zero.
+type stageTimings struct {
+	queue_wait time.Duration
+	gil_wait   time.Duration
+	setup      time.Duration
+	app        time.Duration
+	marshal    time.Duration
+	write      time.Duration
+}
+
+// appMetrics has the histograms of one app, with its label already set so
+// observing doesn't have to look the series up.
+type appMetrics struct {
+	pattern    string
+	queue_wait prometheus.Observer
+	gil_wait   prometheus.Observer
+	setup      prometheus.Observer
+	app        prometheus.Observer
+	marshal    prometheus.Observer
+	write      prometheus.Observer
+}
+
+// app_metrics_count is the number of apps that observe the series of a
+// pattern, a config reload can import an app while the old one still runs.
+var app_metrics_lock sync.Mutex
+var app_metrics_count = map[string]int{}
+
+// newAppMetrics creates the series of an app, queue_wait is only reported
+// when requests wait in a task queue.
+func newAppMetrics(pattern string, queued bool) *appMetrics {
+	app_metrics_lock.Lock()
+	app_metrics_count[pattern]++
+	app_metrics_lock.Unlock()
+	m := &appMetrics{
+		pattern:  pattern,
+		gil_wait: gilWaitSeconds.WithLabelValues(pattern),
+		setup:    setupSeconds.WithLabelValues(pattern),
+		app:      appSeconds.WithLabelValues(pattern),
+		marshal:  marshalSeconds.WithLabelValues(pattern),
+		write:    writeSeconds.WithLabelValues(pattern),
+	}
+	if queued {
+		m.queue_wait = queueWaitSeconds.WithLabelValues(pattern)
+	}
+	return m
+}
+
+func (m *appMetrics) observe(t *stageTimings) {
+	if m.queue_wait != nil {
+		m.queue_wait.Observe(t.queue_wait.Seconds())
+	}
+	m.gil_wait.Observe(t.gil_wait.Seconds())
+	m.setup.Observe(t.setup.Seconds())
+	m.app.Observe(t.app.Seconds())
+	m.marshal.Observe(t.marshal.Seconds())
+	m.write.Observe(t.write.Seconds())
+}
+
+// delete removes the series of the app once the last app of its pattern is
+// cleaned up.
+func (m *appMetrics) delete() {
+	app_metrics_lock.Lock()
+	defer app_metrics_lock.Unlock()
+	app_metrics_count[m.pattern]--
+	if app_metrics_count[m.pattern] > 0 {
+		return
+	}
+	delete(app_metrics_count, m.pattern)
+	for _, histogram := range []*prometheus.HistogramVec{queueWaitSeconds, gilWaitSeconds, setupSeconds, appSeconds, marshalSeconds, writeSeconds} {
+		histogram.DeleteLabelValues(m.pattern)
+	}
+}
+
+// appGauges are the current values of the gauges of an app.
+type appGauges struct {
+	in_flight   int64
+	queue_depth int64
+	loop_lag    time.Duration
+	websockets  int64
+}
+
+func (g appGauges) add(o appGauges) appGauges {
+	return appGauges{
+		in_flight:   g.in_flight + o.in_flight,
+		queue_depth: g.queue_depth + o.queue_depth,
+		loop_lag:    max(g.loop_lag, o.loop_lag),
+		websockets:  g.websockets + o.websockets,
+	}
+}
+
+// appStartup is how long the stages of the last start of an app took. The
+// import stage includes the preload modules and the lifespan startup of
+// ASGI apps, worker processes report the slowest one.
+type appStartup struct {
+	import_ns atomic.Int64
+	warmup_ns atomic.Int64
+}
+
+func (s *appStartup) imported(d time.Duration) { s.import_ns.Store(int64(d)) }
+func (s *appStartup) warmedUp(d time.Duration) { s.warmup_ns.Store(int64(d)) }
+
+// startupApp is an app that reports its startup.
+type startupApp interface {
+	startupTimes() *appStartup
+}
+
+func (m *Wsgi) startupTimes() *appStartup        { return &m.startup }
+func (m *Asgi) startupTimes() *appStartup        { return &m.startup }
+func (p *ProcessWsgi) startupTimes() *appStartup { return &p.startup }
+
+// appCollector reports the gauges of the apps that are imported when the
+// metrics are scraped.
+type appCollector struct{}
+
+func (appCollector) Describe(ch chan<- *prometheus.Desc) {
+	ch <- inFlightDesc
+	ch <- queueDesc
+	ch <- lagDesc
+	ch <- socketsDesc
+	ch <- startupDesc
+}
+
+func (appCollector) Collect(ch chan<- prometheus.Metric) {
+	// Apps of the same pattern with different options are reported
+	// together, their gauges are summed and the largest lag is kept
+	wsgi_gauges := map[string]appGauges{}
+	wsgiapp_lock.Lock()
+	for _, app := range wsgiapp_cache {
+		wsgi_gauges[app.wsgi_pattern] = wsgi_gauges[app.wsgi_pattern].add(app.gauges())
+	}
+	wsgiapp_lock.Unlock()
+	for pattern, gauges := range wsgi_gauges {
+		ch <- prometheus.MustNewConstMetric(inFlightDesc, prometheus.GaugeValue, float64(gauges.in_flight), pattern)
+		ch <- prometheus.MustNewConstMetric(queueDesc, prometheus.GaugeValue, float64(gauges.queue_depth), pattern)
+	}
+
+	// Apps are cleaned up after they are removed from the cache, so the
+	// ones found here can be read
+	asgi_gauges := map[string]appGauges{}
+	asgiapp_lock.Lock()
+	for _, app := range asgiapp_cache {
+		asgi_gauges[app.asgi_pattern] = asgi_gauges[app.asgi_pattern].add(app.gauges())
+	}
+	asgiapp_lock.Unlock()
+	for pattern, gauges := range asgi_gauges {
+		ch <- prometheus.MustNewConstMetric(inFlightDesc, prometheus.GaugeValue, float64(gauges.in_flight), pattern)
+		ch <- prometheus.MustNewConstMetric(lagDesc, prometheus.GaugeValue, gauges.loop_lag.Seconds(), pattern)
+		ch <- prometheus.MustNewConstMetric(socketsDesc, prometheus.GaugeValue, float64(gauges.websockets), pattern)
+	}
+
+	// Worker processes aren't cached, the startup of the apps of handlers
+	// is reported. Handlers can start their own pools of the same app.
+	reported := map[string]bool{}
+	reloadable_lock.Lock()
+	for app, entry := range reloadable_apps {
+		if app, ok := app.(startupApp); ok && !reported[entry.pattern] {
+			reported[entry.pattern] = true
+			startup := app.startupTimes()
+			ch <- prometheus.MustNewConstMetric(startupDesc, prometheus.GaugeValue, time.Duration(startup.import_ns.Load()).Seconds(), entry.pattern, "import")
+			ch <- prometheus.MustNewConstMetric(startupDesc, prometheus.GaugeValue, time.Duration(startup.warmup_ns.Load()).Seconds(), entry.pattern, "warmup")
+		}
+	}
+	reloadable_lock.Unlock()
+}
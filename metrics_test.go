@@ -0,0 +1,85 @@
+package caddysnake
+
+import (
+	"strings"
+	"testing"
+	"time"
+
+	"github.com/prometheus/client_golang/prometheus/testutil"
+)
+
+func TestAppMetrics(t *testing.T) {
+	queue_series := testutil.CollectAndCount(queueWaitSeconds)
+	app_series := testutil.CollectAndCount(appSeconds)
+
+	queued := newAppMetrics("metrics_test:queued", true)
+	direct := newAppMetrics("metrics_test:direct", false)
+	timings := stageTimings{
+		queue_wait: time.Millisecond,
+		gil_wait:   time.Microsecond,
+		setup:      20 * time.Microsecond,
+		app:        5 * time.Millisecond,
+		marshal:    50 * time.Microsecond,
+		write:      100 * time.Microsecond,
+	}
+	queued.observe(&timings)
+	direct.observe(&timings)
+	// The queue wait of apps that don't queue requests isn't reported
+	if got := testutil.CollectAndCount(queueWaitSeconds); got != queue_series+1 {
+		t.Errorf("expected one more queue wait series, got %d", got-queue_series)
+	}
+	if got := testutil.CollectAndCount(appSeconds); got != app_series+2 {
+		t.Errorf("expected two more app series, got %d", got-app_series)
+	}
+
+	queued.delete()
+	direct.delete()
+	if got := testutil.CollectAndCount(appSeconds); got != app_series {
+		t.Errorf("expected the series to be deleted, got %d left", got-app_series)
+	}
+}
+
+func TestAppCollector(t *testing.T) {
+	app := &Wsgi{
+		wsgi_pattern: "metrics_test:app",
+		workers:      2,
+	}
+	app.in_flight.Store(5)
+	app.startup.imported(1500 * time.Millisecond)
+	app.startup.warmedUp(250 * time.Millisecond)
+	registerReloadable(app.wsgi_pattern, app, nil, nil)
+	defer unregisterReloadable(app, nil)
+
+	wsgiapp_lock.Lock()
+	wsgi_apps := wsgiapp_cache
+	wsgiapp_cache = map[string]*Wsgi{app.wsgi_pattern: app}
+	wsgiapp_lock.Unlock()
+	asgiapp_lock.Lock()
+	asgi_apps := asgiapp_cache
+	asgiapp_cache = map[string]*Asgi{}
+	asgiapp_lock.Unlock()
+	defer func() {
+		wsgiapp_lock.Lock()
+		wsgiapp_cache = wsgi_apps
+		wsgiapp_lock.Unlock()
+		asgiapp_lock.Lock()
+		asgiapp_cache = asgi_apps
+		asgiapp_lock.Unlock()
+	}()
+
+	expected := `
+		# HELP caddy_python_requests_in_flight Requests that are being served by the app.
+		# TYPE caddy_python_requests_in_flight gauge
+		caddy_python_requests_in_flight{app="metrics_test:app"} 5
+		# HELP caddy_python_startup_seconds Time that the last start or reload of the app took, by stage.
+		# TYPE caddy_python_startup_seconds gauge
+		caddy_python_startup_seconds{app="metrics_test:app",stage="import"} 1.5
+		caddy_python_startup_seconds{app="metrics_test:app",stage="warmup"} 0.25
+		# HELP caddy_python_task_queue_depth WSGI requests that are waiting for a worker thread.
+		# TYPE caddy_python_task_queue_depth gauge
+		caddy_python_task_queue_depth{app="metrics_test:app"} 3
+	`
+	if err := testutil.CollectAndCompare(appCollector{}, strings.NewReader(expected)); err != nil {
+		t.Error(err)
+	}
+}
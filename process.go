@@ -0,0 +1,552 @@
+package caddysnake
+
+import (
+	"context"
+	"encoding/json"
+	"errors"
+	"fmt"
+	"io"
+	"net"
+	"net/http"
+	"net/http/httputil"
+	"os"
+	"path/filepath"
+	"slices"
+	"sync"
+	"syscall"
+	"time"
+
+	"github.com/caddyserver/caddy/v2"
+	caddycmd "github.com/caddyserver/caddy/v2/cmd"
+	"github.com/caddyserver/caddy/v2/modules/caddyhttp"
+	"go.uber.org/zap"
+)
+
+// Worker processes run the python-worker command of the Caddy executable,
+// the app to serve is passed as JSON in the processWorkerEnv variable.
+const (
+	processWorkerCommand = "python-worker"
+	processWorkerEnv     = "CADDYSNAKE_PROCESS_WORKER"
+)
+
+// Headers used to pass along the parts of a request that the HTTP hop to a
+// worker process loses.
+const (
+	processLocalAddrHeader = "Caddysnake-Local-Addr"
+	processProtoHeader     = "Caddysnake-Proto"
+)
+
+// processShutdownTimeout is how long a worker process waits for in flight
+// requests when it stops. Workers still running after that are killed.
+const processShutdownTimeout = 10 * time.Second
+
+// Workers that crash are restarted after a delay that doubles while they
+// keep crashing right after starting.
+const (
+	processRestartDelay    = 100 * time.Millisecond
+	processMaxRestartDelay = 5 * time.Second
+)
+
+// File descriptors passed to worker processes after stdin, stdout and stderr.
+const (
+	processListenerFd = 3
+	processControlFd  = 4
+	processReadyFd    = 5
+)
+
+type processWorkerConfig struct {
+	Module      string      `json:"module"`
+	VenvPath    string      `json:"venv_path"`
+	Options     WsgiOptions `json:"options"`
+	MaxRequests int         `json:"max_requests"`
+	Warmup      []string    `json:"warmup"`
+}
+
+// ProcessWsgi serves a WSGI app from a pool of worker processes. Workers are
+// new instances of the Caddy executable that import the app and accept
+// HTTP connections from one shared Unix socket, so the kernel spreads
+// requests between them and each one runs Python with its own GIL.
+type ProcessWsgi struct {
+	executable string
+	config     string
+	socket_dir string
+	listener   *net.UnixListener
+	listen_fd  uintptr
+	proxy      *httputil.ReverseProxy
+	logger     *zap.Logger
+
+	mu      sync.Mutex
+	workers []*processWorker
+	// reload_lock is held while Reload replaces the workers
+	reload_lock sync.Mutex
+	startup     appStartup
+	// closed is closed by Cleanup to stop the supervisors
+	closed chan struct{}
+	wg     sync.WaitGroup
+}
+
+type processWorker struct {
+	process *os.Process
+	// state is set when the process exits, before exited is closed
+	state *os.ProcessState
+	// control is closed to ask the worker to stop
+	control *os.File
+	exited  chan struct{}
+	started time.Time
+	// startup are the times that the worker reported when it was ready
+	startup processWorkerStartup
+}
+
+// processWorkerStartup is written to the ready pipe by a worker, it reports
+// how long it took to import the app and to warm it up.
+type processWorkerStartup struct {
+	Import time.Duration
+	Warmup time.Duration
+}
+
+// NewProcessWsgi starts process_workers processes that serve a WSGI app. Each
+// process is recycled after serving max_requests requests, zero means never.
+// Workers send the warmup requests to the app before they accept connections.
+func NewProcessWsgi(wsgi_pattern string, venv_path string, options WsgiOptions, process_workers int, max_requests int, warmup []string, logger *zap.Logger) (*ProcessWsgi, error) {
+	executable, err := os.Executable()
+	if err != nil {
+		return nil, err
+	}
+	config, err := json.Marshal(processWorkerConfig{
+		Module:      wsgi_pattern,
+		VenvPath:    venv_path,
+		Options:     options,
+		MaxRequests: max_requests,
+		Warmup:      warmup,
+	})
+	if err != nil {
+		return nil, err
+	}
+
+	socket_dir, err := os.MkdirTemp("", "caddysnake")
+	if err != nil {
+		return nil, err
+	}
+	socket_path := filepath.Join(socket_dir, "wsgi.sock")
+	listener, err := net.ListenUnix("unix", &net.UnixAddr{Name: socket_path, Net: "unix"})
+	if err != nil {
+		os.RemoveAll(socket_dir)
+		return nil, err
+	}
+	// The socket is passed as is to the workers. listener.File() and
+	// os/exec would put it in blocking mode, then the accept of a worker
+	// can't be interrupted when it stops.
+	raw_conn, err := listener.SyscallConn()
+	if err != nil {
+		listener.Close()
+		os.RemoveAll(socket_dir)
+		return nil, err
+	}
+	var listen_fd uintptr
+	raw_conn.Control(func(fd uintptr) {
+		listen_fd = fd
+	})
+
+	p := &ProcessWsgi{
+		executable: executable,
+		config:     string(config),
+		socket_dir: socket_dir,
+		listener:   listener,
+		listen_fd:  listen_fd,
+		logger:     logger,
+		closed:     make(chan struct{}),
+	}
+	p.proxy = &httputil.ReverseProxy{
+		Rewrite: p.rewrite,
+		Transport: &http.Transport{
+			DialContext: func(ctx context.Context, _, _ string) (net.Conn, error) {
+				var dialer net.Dialer
+				return dialer.DialContext(ctx, "unix", socket_path)
+			},
+			// A new connection per request lets any idle worker accept it
+			DisableKeepAlives:  true,
+			DisableCompression: true,
+		},
+		FlushInterval: -1,
+		ErrorHandler: func(w http.ResponseWriter, r *http.Request, err error) {
+			p.logger.Error("python worker process failed", zap.Error(err))
+			w.WriteHeader(http.StatusBadGateway)
+		},
+	}
+
+	// Workers start at the same time, each one imports the app with its own
+	// interpreter
+	p.workers = make([]*processWorker, process_workers)
+	errs := make([]error, process_workers)
+	var wg sync.WaitGroup
+	for i := range p.workers {
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			p.workers[i], errs[i] = p.startWorker()
+		}(i)
+	}
+	wg.Wait()
+	if err := errors.Join(errs...); err != nil {
+		p.workers = slices.DeleteFunc(p.workers, func(worker *processWorker) bool { return worker == nil })
+		p.Cleanup()
+		return nil, err
+	}
+	p.recordStartup(p.workers)
+	for i := range p.workers {
+		p.wg.Add(1)
+		go p.supervise(i)
+	}
+	return p, nil
+}
+
+// rewrite points a request to the worker processes and keeps the headers
+// that the app would see in process.
+func (p *ProcessWsgi) rewrite(pr *httputil.ProxyRequest) {
+	pr.Out.URL.Scheme = "http"
+	pr.Out.URL.Host = "caddysnake"
+	for _, header := range []string{"Forwarded", "X-Forwarded-For", "X-Forwarded-Host", "X-Forwarded-Proto"} {
+		if values, ok := pr.In.Header[header]; ok {
+			pr.Out.Header[header] = values
+		}
+	}
+	if addr, ok := pr.In.Context().Value(http.LocalAddrContextKey).(net.Addr); ok {
+		pr.Out.Header.Set(processLocalAddrHeader, addr.String())
+	}
+	pr.Out.Header.Set(processProtoHeader, pr.In.Proto)
+}
+
+func (p *ProcessWsgi) startWorker() (*processWorker, error) {
+	control_read, control_write, err := os.Pipe()
+	if err != nil {
+		return nil, err
+	}
+	ready_read, ready_write, err := os.Pipe()
+	if err != nil {
+		control_read.Close()
+		control_write.Close()
+		return nil, err
+	}
+	defer ready_read.Close()
+	dev_null, err := os.Open(os.DevNull)
+	if err != nil {
+		control_read.Close()
+		control_write.Close()
+		ready_write.Close()
+		return nil, err
+	}
+	defer dev_null.Close()
+
+	pid, err := syscall.ForkExec(p.executable, []string{p.executable, processWorkerCommand}, &syscall.ProcAttr{
+		Env:   append(os.Environ(), processWorkerEnv+"="+p.config),
+		Files: []uintptr{dev_null.Fd(), os.Stdout.Fd(), os.Stderr.Fd(), p.listen_fd, control_read.Fd(), ready_write.Fd()},
+	})
+	control_read.Close()
+	ready_write.Close()
+	if err != nil {
+		control_write.Close()
+		return nil, err
+	}
+	process, err := os.FindProcess(pid)
+	if err != nil {
+		control_write.Close()
+		return nil, err
+	}
+
+	worker := &processWorker{
+		process: process,
+		control: control_write,
+		exited:  make(chan struct{}),
+		started: time.Now(),
+	}
+	go func() {
+		worker.state, _ = process.Wait()
+		close(worker.exited)
+	}()
+
+	// The worker writes its startup times once it's ready, or exits
+	if err := json.NewDecoder(ready_read).Decode(&worker.startup); err != nil {
+		control_write.Close()
+		<-worker.exited
+		return nil, errors.New("python worker process failed to start")
+	}
+	return worker, nil
+}
+
+// recordStartup reports the startup of the slowest of workers.
+func (p *ProcessWsgi) recordStartup(workers []*processWorker) {
+	var slowest processWorkerStartup
+	for _, worker := range workers {
+		slowest.Import = max(slowest.Import, worker.startup.Import)
+		slowest.Warmup = max(slowest.Warmup, worker.startup.Warmup)
+	}
+	p.startup.imported(slowest.Import)
+	p.startup.warmedUp(slowest.Warmup)
+}
+
+func (w *processWorker) stop() {
+	w.control.Close()
+	select {
+	case <-w.exited:
+	case <-time.After(processShutdownTimeout + time.Second):
+		w.process.Kill()
+		<-w.exited
+	}
+}
+
+// supervise replaces the worker in a slot when it exits, either because it
+// was recycled or because it crashed.
+func (p *ProcessWsgi) supervise(slot int) {
+	defer p.wg.Done()
+	p.mu.Lock()
+	worker := p.workers[slot]
+	p.mu.Unlock()
+	delay := processRestartDelay
+	for {
+		select {
+		case <-worker.exited:
+		case <-p.closed:
+			return
+		}
+		p.mu.Lock()
+		current := p.workers[slot]
+		p.mu.Unlock()
+		if current != worker {
+			// Reload started a new worker before it stopped this one
+			worker = current
+			continue
+		}
+
+		pid := worker.process.Pid
+		backoff := false
+		if worker.state != nil && worker.state.Success() {
+			p.logger.Info("recycling python worker process", zap.Int("pid", pid))
+		} else {
+			p.logger.Warn("python worker process exited", zap.Int("pid", pid), zap.Stringer("state", worker.state))
+			// Back off when workers crash right after starting
+			backoff = time.Since(worker.started) < 5*time.Second
+		}
+		if !backoff {
+			delay = processRestartDelay
+		}
+
+		var replacement *processWorker
+		for replacement == nil {
+			if backoff {
+				select {
+				case <-time.After(delay):
+				case <-p.closed:
+					return
+				}
+				delay = min(2*delay, processMaxRestartDelay)
+			}
+			var err error
+			if replacement, err = p.startWorker(); err != nil {
+				p.logger.Error("failed to restart python worker process", zap.Error(err))
+				backoff = true
+			}
+		}
+
+		p.mu.Lock()
+		select {
+		case <-p.closed:
+			p.mu.Unlock()
+			replacement.stop()
+			return
+		default:
+		}
+		if current := p.workers[slot]; current != worker {
+			// Reload filled the slot while the replacement started
+			p.mu.Unlock()
+			replacement.stop()
+			worker = current
+			continue
+		}
+		p.workers[slot] = replacement
+		p.mu.Unlock()
+		worker = replacement
+	}
+}
+
+// Reload replaces the worker processes one at a time. Each new process
+// imports the app before the old one stops accepting connections and
+// finishes its requests, so the pool keeps serving. Workers that failed to
+// start leave the rest of the old ones running.
+func (p *ProcessWsgi) Reload() error {
+	p.reload_lock.Lock()
+	defer p.reload_lock.Unlock()
+	replacements := make([]*processWorker, 0, len(p.workers))
+	for slot := range p.workers {
+		replacement, err := p.startWorker()
+		if err != nil {
+			return err
+		}
+		replacements = append(replacements, replacement)
+		p.mu.Lock()
+		select {
+		case <-p.closed:
+			p.mu.Unlock()
+			replacement.stop()
+			return nil
+		default:
+		}
+		old := p.workers[slot]
+		p.workers[slot] = replacement
+		p.mu.Unlock()
+		old.stop()
+	}
+	p.recordStartup(replacements)
+	return nil
+}
+
+// HandleRequest forwards a request to one of the worker processes.
+func (p *ProcessWsgi) HandleRequest(w http.ResponseWriter, r *http.Request) error {
+	p.proxy.ServeHTTP(w, r)
+	return nil
+}
+
+// Cleanup stops the worker processes and removes the socket.
+func (p *ProcessWsgi) Cleanup() error {
+	p.mu.Lock()
+	select {
+	case <-p.closed:
+		p.mu.Unlock()
+		return nil
+	default:
+	}
+	close(p.closed)
+	workers := p.workers
+	p.mu.Unlock()
+
+	// Stop all of them at once, each one waits for its own requests
+	var wg sync.WaitGroup
+	for _, worker := range workers {
+		wg.Add(1)
+		go func(worker *processWorker) {
+			defer wg.Done()
+			worker.stop()
+		}(worker)
+	}
+	wg.Wait()
+	p.wg.Wait()
+
+	p.listener.Close()
+	return os.RemoveAll(p.socket_dir)
+}
+
+// processAddr is the address of the server that received a request, as
+// passed by the parent process.
+type processAddr string
+
+func (a processAddr) Network() string { return "tcp" }
+func (a processAddr) String() string  { return string(a) }
+
+// restoreProcessRequest undoes the changes of the hop from the parent process.
+func restoreProcessRequest(r *http.Request) *http.Request {
+	if proto := r.Header.Get(processProtoHeader); proto != "" {
+		if major, minor, ok := http.ParseHTTPVersion(proto); ok {
+			r.Proto, r.ProtoMajor, r.ProtoMinor = proto, major, minor
+		}
+	}
+	addr := r.Header.Get(processLocalAddrHeader)
+	r.Header.Del(processProtoHeader)
+	r.Header.Del(processLocalAddrHeader)
+	return r.WithContext(context.WithValue(r.Context(), http.LocalAddrContextKey, processAddr(addr)))
+}
+
+// writeProcessError writes the status of an error returned by HandleRequest,
+// in process Caddy would do it.
+func writeProcessError(w http.ResponseWriter, err error) {
+	var handler_err caddyhttp.HandlerError
+	if errors.As(err, &handler_err) && handler_err.StatusCode != 0 {
+		w.WriteHeader(handler_err.StatusCode)
+		return
+	}
+	w.WriteHeader(http.StatusInternalServerError)
+}
+
+var errWorkerRecycled = errors.New("python worker process served max_requests")
+
+// recycleListener stops accepting connections after max_requests, the parent
+// opens one connection per request.
+type recycleListener struct {
+	net.Listener
+	remaining int
+}
+
+// Accept is only called from the goroutine of http.Server.Serve.
+func (l *recycleListener) Accept() (net.Conn, error) {
+	if l.remaining == 0 {
+		return nil, errWorkerRecycled
+	}
+	l.remaining--
+	return l.Listener.Accept()
+}
+
+// cmdPythonWorker is the entrypoint of worker processes, it serves the app
+// until the parent closes the control pipe.
+func cmdPythonWorker(fs caddycmd.Flags) (int, error) {
+	var config processWorkerConfig
+	if err := json.Unmarshal([]byte(os.Getenv(processWorkerEnv)), &config); err != nil {
+		return caddy.ExitCodeFailedStartup, fmt.Errorf("invalid python worker config: %w", err)
+	}
+	app, err := NewWsgi(config.Module, config.VenvPath, config.Options)
+	if err != nil {
+		return caddy.ExitCodeFailedStartup, err
+	}
+	defer app.Cleanup()
+	if len(config.Warmup) > 0 {
+		if err := warmUp(app, &app.startup, config.Warmup); err != nil {
+			fmt.Fprintln(os.Stderr, "python worker process warmup failed:", err)
+		}
+	}
+	listener, err := net.FileListener(os.NewFile(processListenerFd, "listener"))
+	if err != nil {
+		return caddy.ExitCodeFailedStartup, err
+	}
+	if config.MaxRequests > 0 {
+		listener = &recycleListener{Listener: listener, remaining: config.MaxRequests}
+	}
+
+	server := &http.Server{}
+	var stop_once sync.Once
+	stopped := make(chan struct{})
+	stop := func() {
+		stop_once.Do(func() {
+			go func() {
+				ctx, cancel := context.WithTimeout(context.Background(), processShutdownTimeout)
+				defer cancel()
+				server.Shutdown(ctx)
+				close(stopped)
+			}()
+		})
+	}
+	server.Handler = http.HandlerFunc(func(w http.ResponseWriter, r *http.Request) {
+		if err := app.HandleRequest(w, restoreProcessRequest(r)); err != nil {
+			writeProcessError(w, err)
+		}
+	})
+
+	// The parent closes the control pipe to stop the worker, or when it dies
+	go func() {
+		io.Copy(io.Discard, os.NewFile(processControlFd, "control"))
+		stop()
+	}()
+
+	ready := os.NewFile(processReadyFd, "ready")
+	json.NewEncoder(ready).Encode(processWorkerStartup{
+		Import: time.Duration(app.startup.import_ns.Load()),
+		Warmup: time.Duration(app.startup.warmup_ns.Load()),
+	})
+	ready.Close()
+
+	err = server.Serve(listener)
+	if errors.Is(err, errWorkerRecycled) {
+		// Requests in flight finish and another process takes its place
+		stop()
+	} else if err != nil && !errors.Is(err, http.ErrServerClosed) {
+		return caddy.ExitCodeFailedQuit, err
+	}
+	<-stopped
+	return caddy.ExitCodeSuccess, nil
+}
@@ -0,0 +1,68 @@
+package caddysnake
+
+import (
+	"errors"
+	"net"
+	"net/http"
+	"net/http/httptest"
+	"testing"
+
+	"github.com/caddyserver/caddy/v2/modules/caddyhttp"
+)
+
+func TestRestoreProcessRequest(t *testing.T) {
+	r := httptest.NewRequest("GET", "/", nil)
+	r.Header.Set(processProtoHeader, "HTTP/2.0")
+	r.Header.Set(processLocalAddrHeader, "127.0.0.1:9080")
+
+	r = restoreProcessRequest(r)
+	if r.Proto != "HTTP/2.0" || r.ProtoMajor != 2 || r.ProtoMinor != 0 {
+		t.Errorf("expected HTTP/2.0, got %s", r.Proto)
+	}
+	addr, ok := r.Context().Value(http.LocalAddrContextKey).(net.Addr)
+	if !ok || addr.String() != "127.0.0.1:9080" {
+		t.Errorf("expected the local address of the parent, got %v", addr)
+	}
+	if r.Header.Get(processProtoHeader) != "" || r.Header.Get(processLocalAddrHeader) != "" {
+		t.Errorf("expected internal headers to be removed")
+	}
+}
+
+func TestWriteProcessError(t *testing.T) {
+	w := httptest.NewRecorder()
+	writeProcessError(w, caddyhttp.Error(http.StatusServiceUnavailable, errors.New("wsgi queue limit reached")))
+	if w.Code != http.StatusServiceUnavailable {
+		t.Errorf("expected 503, got %d", w.Code)
+	}
+
+	w = httptest.NewRecorder()
+	writeProcessError(w, errors.New("failed"))
+	if w.Code != http.StatusInternalServerError {
+		t.Errorf("expected 500, got %d", w.Code)
+	}
+}
+
+func TestRecycleListener(t *testing.T) {
+	inner, err := net.Listen("tcp", "127.0.0.1:0")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer inner.Close()
+	listener := &recycleListener{Listener: inner, remaining: 2}
+
+	for i := 0; i < 2; i++ {
+		conn, err := net.Dial("tcp", inner.Addr().String())
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer conn.Close()
+		accepted, err := listener.Accept()
+		if err != nil {
+			t.Fatalf("accept %d: %v", i, err)
+		}
+		accepted.Close()
+	}
+	if _, err := listener.Accept(); !errors.Is(err, errWorkerRecycled) {
+		t.Errorf("expected errWorkerRecycled, got %v", err)
+	}
+}
@@ -0,0 +1,262 @@
+package caddysnake
+
+import (
+	"bytes"
+	"encoding/json"
+	"errors"
+	"fmt"
+	"net/http"
+	"runtime"
+	"runtime/pprof"
+	"strconv"
+	"sync"
+	"sync/atomic"
+	"time"
+	"unsafe"
+
+	"github.com/caddyserver/caddy/v2"
+	"github.com/google/pprof/profile"
+)
+
+func init() {
+	caddy.RegisterModule(PythonProfiler{})
+}
+
+// PythonProfiler adds /debug/python/profile to the admin API. It runs the Go
+// CPU profiler for some seconds while it samples the Python stacks of the
+// requests, then it returns a single pprof profile where the Python frames
+// of each request are below the HandleRequest call that started it.
+//
+//	curl -o python.pprof "localhost:2019/debug/python/profile?seconds=10"
+//	go tool pprof -http :8080 python.pprof
+type PythonProfiler struct{}
+
+// CaddyModule returns the Caddy module information.
+func (PythonProfiler) CaddyModule() caddy.ModuleInfo {
+	return caddy.ModuleInfo{
+		ID:  "admin.api.python_profile",
+		New: func() caddy.Module { return new(PythonProfiler) },
+	}
+}
+
+// Routes returns the routes of the admin API.
+func (PythonProfiler) Routes() []caddy.AdminRoute {
+	return []caddy.AdminRoute{{
+		Pattern: "/debug/python/profile",
+		Handler: caddy.AdminHandlerFunc(handlePythonProfile),
+	}}
+}
+
+// profileSession keeps the Go stack of the requests that start while a
+// profile runs. Requests mostly share a few stacks, so they are stored once.
+type profileSession struct {
+	mu       sync.Mutex
+	stacks   map[string]int
+	frames   [][]uintptr
+	requests map[profileRequestKey]int
+}
+
+// profileRequestKey identifies a request, WSGI and ASGI ids are counted
+// separately.
+type profileRequestKey struct {
+	kind string
+	id   uint64
+}
+
+var (
+	profile_lock   sync.Mutex
+	active_profile atomic.Pointer[profileSession]
+)
+
+// profileRequest records the stack of the HandleRequest that calls it when a
+// profile runs, kind is "wsgi" or "asgi".
+func profileRequest(kind string, request_id uint64) {
+	session := active_profile.Load()
+	if session == nil {
+		return
+	}
+	pcs := make([]uintptr, 64)
+	// Skip runtime.Callers and profileRequest, the stack starts with
+	// HandleRequest
+	pcs = pcs[:runtime.Callers(2, pcs)]
+	key := unsafe.String((*byte)(unsafe.Pointer(&pcs[0])), len(pcs)*int(unsafe.Sizeof(pcs[0])))
+
+	session.mu.Lock()
+	defer session.mu.Unlock()
+	stack, ok := session.stacks[key]
+	if !ok {
+		stack = len(session.frames)
+		session.frames = append(session.frames, pcs)
+		session.stacks[key] = stack
+	}
+	session.requests[profileRequestKey{kind, request_id}] = stack
+}
+
+// pythonSample is a Python stack of a request that was seen count times, the
+// innermost frame goes first.
+type pythonSample struct {
+	Kind    string `json:"kind"`
+	Request uint64 `json:"request"`
+	Count   int64  `json:"count"`
+	Stack   []struct {
+		Name string `json:"name"`
+		File string `json:"file"`
+		Line int64  `json:"line"`
+	} `json:"stack"`
+}
+
+func handlePythonProfile(w http.ResponseWriter, r *http.Request) error {
+	if r.Method != http.MethodGet {
+		return caddy.APIError{
+			HTTPStatus: http.StatusMethodNotAllowed,
+			Err:        fmt.Errorf("method not allowed: %s", r.Method),
+		}
+	}
+	seconds, hz := 30, 100
+	for name, value := range map[string]*int{"seconds": &seconds, "hz": &hz} {
+		if param := r.URL.Query().Get(name); param != "" {
+			n, err := strconv.Atoi(param)
+			if err != nil || n <= 0 {
+				return caddy.APIError{
+					HTTPStatus: http.StatusBadRequest,
+					Err:        fmt.Errorf("invalid %s: %q", name, param),
+				}
+			}
+			*value = n
+		}
+	}
+	if !profile_lock.TryLock() {
+		return caddy.APIError{
+			HTTPStatus: http.StatusConflict,
+			Err:        errors.New("a python profile is already running"),
+		}
+	}
+	defer profile_lock.Unlock()
+
+	merged, err := runPythonProfile(r, time.Duration(seconds)*time.Second, hz)
+	if err != nil {
+		return caddy.APIError{HTTPStatus: http.StatusInternalServerError, Err: err}
+	}
+	w.Header().Set("Content-Type", "application/octet-stream")
+	w.Header().Set("Content-Disposition", `attachment; filename="python.pprof"`)
+	return merged.Write(w)
+}
+
+// runPythonProfile profiles Go and Python for duration, or until the client
+// goes away, and merges both profiles.
+func runPythonProfile(r *http.Request, duration time.Duration, hz int) (*profile.Profile, error) {
+	var cpu bytes.Buffer
+	if err := pprof.StartCPUProfile(&cpu); err != nil {
+		return nil, err
+	}
+	session := &profileSession{
+		stacks:   map[string]int{},
+		requests: map[profileRequestKey]int{},
+	}
+	active_profile.Store(session)
+	if !startPythonSampler(hz) {
+		active_profile.Store(nil)
+		pprof.StopCPUProfile()
+		return nil, errors.New("failed to start the python sampler")
+	}
+
+	timer := time.NewTimer(duration)
+	select {
+	case <-timer.C:
+	case <-r.Context().Done():
+		timer.Stop()
+	}
+
+	samples_json, err := stopPythonSampler()
+	active_profile.Store(nil)
+	pprof.StopCPUProfile()
+	if err != nil {
+		return nil, err
+	}
+	var samples []pythonSample
+	if err := json.Unmarshal(samples_json, &samples); err != nil {
+		return nil, err
+	}
+
+	go_profile, err := profile.Parse(&cpu)
+	if err != nil {
+		return nil, err
+	}
+	return profile.Merge([]*profile.Profile{go_profile, session.pythonProfile(go_profile, samples, hz)})
+}
+
+// pythonProfile converts the Python samples to a profile with the same
+// sample types as the Go one. Python stacks are sampled by wall clock, a
+// request that waits for I/O in Python is sampled as well.
+func (s *profileSession) pythonProfile(go_profile *profile.Profile, samples []pythonSample, hz int) *profile.Profile {
+	p := &profile.Profile{
+		SampleType:    go_profile.SampleType,
+		PeriodType:    go_profile.PeriodType,
+		Period:        go_profile.Period,
+		TimeNanos:     go_profile.TimeNanos,
+		DurationNanos: go_profile.DurationNanos,
+	}
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	functions := map[[2]string]*profile.Function{}
+	locations := map[string]*profile.Location{}
+	location := func(name string, file string, line int64) *profile.Location {
+		key := fmt.Sprintf("%s\x00%s\x00%d", name, file, line)
+		if l, ok := locations[key]; ok {
+			return l
+		}
+		function, ok := functions[[2]string{name, file}]
+		if !ok {
+			function = &profile.Function{
+				ID:         uint64(len(p.Function) + 1),
+				Name:       name,
+				SystemName: name,
+				Filename:   file,
+			}
+			functions[[2]string{name, file}] = function
+			p.Function = append(p.Function, function)
+		}
+		l := &profile.Location{
+			ID:   uint64(len(p.Location) + 1),
+			Line: []profile.Line{{Function: function, Line: line}},
+		}
+		locations[key] = l
+		p.Location = append(p.Location, l)
+		return l
+	}
+
+	period := int64(time.Second) / int64(hz)
+	for _, sample := range samples {
+		stack := make([]*profile.Location, 0, len(sample.Stack))
+		for _, frame := range sample.Stack {
+			stack = append(stack, location(frame.Name, frame.File, frame.Line))
+		}
+		// Requests that started before the profile have no Go stack, they
+		// are shown below their kind
+		if index, ok := s.requests[profileRequestKey{sample.Kind, sample.Request}]; ok {
+			frames := runtime.CallersFrames(s.frames[index])
+			for {
+				frame, more := frames.Next()
+				stack = append(stack, location(frame.Function, frame.File, int64(frame.Line)))
+				if !more {
+					break
+				}
+			}
+		} else {
+			stack = append(stack, location("python "+sample.Kind, "", 0))
+		}
+		values := make([]int64, len(p.SampleType))
+		for i, sample_type := range p.SampleType {
+			values[i] = sample.Count
+			if sample_type.Unit == "nanoseconds" {
+				values[i] *= period
+			}
+		}
+		p.Sample = append(p.Sample, &profile.Sample{
+			Location: stack,
+			Value:    values,
+			Label:    map[string][]string{"python": {sample.Kind}},
+		})
+	}
+	return p
+}
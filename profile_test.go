@@ -0,0 +1,72 @@
+package caddysnake
+
+import (
+	"encoding/json"
+	"strings"
+	"testing"
+
+	"github.com/google/pprof/profile"
+)
+
+func TestPythonProfile(t *testing.T) {
+	session := &profileSession{
+		stacks:   map[string]int{},
+		requests: map[profileRequestKey]int{},
+	}
+	active_profile.Store(session)
+	for id := uint64(1); id <= 3; id++ {
+		profileRequest("wsgi", id)
+	}
+	active_profile.Store(nil)
+	profileRequest("wsgi", 4)
+	if len(session.requests) != 3 || len(session.frames) != 1 {
+		t.Fatalf("expected 3 requests with the same stack, got %d with %d stacks", len(session.requests), len(session.frames))
+	}
+
+	var samples []pythonSample
+	err := json.Unmarshal([]byte(`[
+		{"kind": "wsgi", "request": 2, "count": 3, "stack": [
+			{"name": "query", "file": "db.py", "line": 10},
+			{"name": "app", "file": "main.py", "line": 3}
+		]},
+		{"kind": "asgi", "request": 2, "count": 1, "stack": [
+			{"name": "app", "file": "main.py", "line": 20}
+		]}
+	]`), &samples)
+	if err != nil {
+		t.Fatal(err)
+	}
+	go_profile := &profile.Profile{
+		SampleType: []*profile.ValueType{{Type: "samples", Unit: "count"}, {Type: "cpu", Unit: "nanoseconds"}},
+		PeriodType: &profile.ValueType{Type: "cpu", Unit: "nanoseconds"},
+		Period:     10000000,
+	}
+	p := session.pythonProfile(go_profile, samples, 100)
+	if err := p.CheckValid(); err != nil {
+		t.Fatal(err)
+	}
+	if len(p.Sample) != 2 {
+		t.Fatalf("expected 2 samples, got %d", len(p.Sample))
+	}
+
+	names := func(sample *profile.Sample) []string {
+		var names []string
+		for _, location := range sample.Location {
+			names = append(names, location.Line[0].Function.Name)
+		}
+		return names
+	}
+	wsgi := p.Sample[0]
+	if wsgi.Value[0] != 3 || wsgi.Value[1] != 30000000 {
+		t.Errorf("expected 3 samples of 10ms, got %v", wsgi.Value)
+	}
+	// Python frames go below the Go function that started the request
+	stack := names(wsgi)
+	if len(stack) < 3 || stack[0] != "query" || stack[1] != "app" || !strings.HasSuffix(stack[2], ".TestPythonProfile") {
+		t.Errorf("unexpected stack %v", stack)
+	}
+	// ASGI ids are separate, the request has no Go stack
+	if stack := names(p.Sample[1]); len(stack) != 2 || stack[1] != "python asgi" {
+		t.Errorf("unexpected stack %v", stack)
+	}
+}
@@ -0,0 +1,60 @@
+package caddysnake
+
+import (
+	"sync"
+	"sync/atomic"
+)
+
+// registryShards is the number of independent maps of a requestRegistry,
+// it must be a power of two.
+const registryShards = 64
+
+// requestRegistry maps the request ids that are passed through C back to the
+// state of each request. Consecutive ids are stored in different shards, so
+// concurrent requests and callbacks don't contend on a single lock. Ids are
+// never reused, a lookup of a finished request returns nil.
+type requestRegistry[T any] struct {
+	counter atomic.Uint64
+	shards  [registryShards]registryShard[T]
+}
+
+type registryShard[T any] struct {
+	sync.RWMutex
+	handlers map[uint64]*T
+	// Keep each shard in its own cache line
+	_ [32]byte
+}
+
+func (r *requestRegistry[T]) shard(id uint64) *registryShard[T] {
+	return &r.shards[id&(registryShards-1)]
+}
+
+// Register stores a handler and returns its id, ids start at 1.
+func (r *requestRegistry[T]) Register(handler *T) uint64 {
+	id := r.counter.Add(1)
+	s := r.shard(id)
+	s.Lock()
+	if s.handlers == nil {
+		s.handlers = map[uint64]*T{}
+	}
+	s.handlers[id] = handler
+	s.Unlock()
+	return id
+}
+
+// Lookup returns the handler of a request or nil if it was already deleted.
+func (r *requestRegistry[T]) Lookup(id uint64) *T {
+	s := r.shard(id)
+	s.RLock()
+	handler := s.handlers[id]
+	s.RUnlock()
+	return handler
+}
+
+// Delete removes a handler from the registry.
+func (r *requestRegistry[T]) Delete(id uint64) {
+	s := r.shard(id)
+	s.Lock()
+	delete(s.handlers, id)
+	s.Unlock()
+}
@@ -0,0 +1,45 @@
+package caddysnake
+
+import (
+	"sync"
+	"testing"
+)
+
+func TestRequestRegistry(t *testing.T) {
+	var registry requestRegistry[int]
+	value := 42
+
+	id := registry.Register(&value)
+	if id == 0 {
+		t.Fatalf("expected ids to start at 1")
+	}
+	if got := registry.Lookup(id); got != &value {
+		t.Errorf("expected to find the registered value, got %v", got)
+	}
+
+	registry.Delete(id)
+	if got := registry.Lookup(id); got != nil {
+		t.Errorf("expected nil after delete, got %v", got)
+	}
+}
+
+func TestRequestRegistry_Concurrent(t *testing.T) {
+	var registry requestRegistry[int]
+	var wg sync.WaitGroup
+	for g := 0; g < 8; g++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for i := 0; i < 1000; i++ {
+				value := i
+				id := registry.Register(&value)
+				if got := registry.Lookup(id); got == nil || *got != i {
+					t.Errorf("lookup of %d returned %v", id, got)
+					return
+				}
+				registry.Delete(id)
+			}
+		}()
+	}
+	wg.Wait()
+}
@@ -0,0 +1,278 @@
+package caddysnake
+
+import (
+	"encoding/json"
+	"fmt"
+	"hash/fnv"
+	"io/fs"
+	"net/http"
+	"os"
+	"path/filepath"
+	"slices"
+	"sort"
+	"strings"
+	"sync"
+	"time"
+
+	"github.com/caddyserver/caddy/v2"
+	"go.uber.org/zap"
+)
+
+func init() {
+	caddy.RegisterModule(PythonReloader{})
+}
+
+const (
+	// reloadDrainInterval is how often a replaced app is checked for
+	// requests in flight
+	reloadDrainInterval = 10 * time.Millisecond
+)
+
+// reloadPollInterval is how often the files of reload_watch are checked
+var reloadPollInterval = time.Second
+
+// reloadableApp is an app that can import its code again while it serves
+// requests.
+type reloadableApp interface {
+	AppServer
+	Reload() error
+}
+
+var (
+	_ reloadableApp = (*Wsgi)(nil)
+	_ reloadableApp = (*Asgi)(nil)
+	_ reloadableApp = (*ProcessWsgi)(nil)
+)
+
+// reloadableEntry is an app of a python handler, handlers that share an app
+// register it once each.
+type reloadableEntry struct {
+	pattern  string
+	handlers int
+	// watch counts the handlers that watch each path. One goroutine
+	// watches the paths of all the handlers of the app, stop ends it.
+	watch map[string]int
+	stop  chan struct{}
+}
+
+// watchedPaths returns the paths that the handlers of the app watch.
+func (e *reloadableEntry) watchedPaths() []string {
+	reloadable_lock.Lock()
+	defer reloadable_lock.Unlock()
+	paths := make([]string, 0, len(e.watch))
+	for path := range e.watch {
+		paths = append(paths, path)
+	}
+	sort.Strings(paths)
+	return paths
+}
+
+var (
+	reloadable_lock sync.Mutex
+	reloadable_apps = map[reloadableApp]*reloadableEntry{}
+)
+
+// registerReloadable registers a handler of an app, watch are the paths that
+// the handler reloads the app for. The first handler that watches paths
+// starts the watcher of the app.
+func registerReloadable(pattern string, app reloadableApp, watch []string, logger *zap.Logger) {
+	reloadable_lock.Lock()
+	defer reloadable_lock.Unlock()
+	entry, ok := reloadable_apps[app]
+	if !ok {
+		entry = &reloadableEntry{pattern: pattern, watch: map[string]int{}}
+		reloadable_apps[app] = entry
+	}
+	entry.handlers++
+	for _, path := range watch {
+		entry.watch[path]++
+	}
+	if len(watch) > 0 && entry.stop == nil {
+		entry.stop = make(chan struct{})
+		go watchReload(app, entry, logger.With(zap.String("app", pattern)), reloadPollInterval, entry.stop)
+	}
+}
+
+// unregisterReloadable removes a handler of an app with the paths it was
+// registered with, the watcher stops with the last handler.
+func unregisterReloadable(app AppServer, watch []string) {
+	reloadable, ok := app.(reloadableApp)
+	if !ok {
+		return
+	}
+	reloadable_lock.Lock()
+	defer reloadable_lock.Unlock()
+	if entry, ok := reloadable_apps[reloadable]; ok {
+		entry.handlers--
+		for _, path := range watch {
+			entry.watch[path]--
+			if entry.watch[path] == 0 {
+				delete(entry.watch, path)
+			}
+		}
+		if entry.handlers == 0 {
+			delete(reloadable_apps, reloadable)
+			if entry.stop != nil {
+				close(entry.stop)
+			}
+		}
+	}
+}
+
+// provisionReload makes an app reloadable from the admin API and watches the
+// files of reload_watch.
+func (f *CaddySnake) provisionReload(pattern string, app reloadableApp) {
+	if len(f.ReloadWatch) > 0 {
+		f.reload_paths = f.ReloadWatch
+		if f.VenvPath != "" {
+			f.reload_paths = append(f.reload_paths[:len(f.reload_paths):len(f.reload_paths)], f.VenvPath)
+		}
+	}
+	registerReloadable(pattern, app, f.reload_paths, f.logger)
+}
+
+// watchReload reloads an app when the files that its handlers watch change.
+// Editors and deploys write many files, the reload waits until they stop
+// changing for one poll.
+func watchReload(app reloadableApp, entry *reloadableEntry, logger *zap.Logger, interval time.Duration, stop <-chan struct{}) {
+	ticker := time.NewTicker(interval)
+	defer ticker.Stop()
+	paths := entry.watchedPaths()
+	last := reloadSignature(paths)
+	changed := false
+	for {
+		select {
+		case <-ticker.C:
+		case <-stop:
+			return
+		}
+		// Handlers that share the app can watch other paths, they start
+		// a new signature instead of a reload
+		if current := entry.watchedPaths(); !slices.Equal(current, paths) {
+			paths = current
+			last = reloadSignature(paths)
+			changed = false
+			continue
+		}
+		signature := reloadSignature(paths)
+		if signature != last {
+			last = signature
+			changed = true
+			continue
+		}
+		if !changed {
+			continue
+		}
+		changed = false
+		start := time.Now()
+		if err := app.Reload(); err != nil {
+			logger.Error("failed to reload python app", zap.Error(err))
+		} else {
+			logger.Info("reloaded python app", zap.Duration("duration", time.Since(start)))
+		}
+	}
+}
+
+// reloadSignature hashes the modification time and size of the Python files
+// under paths. Virtual environments are only checked for packages that were
+// installed or removed, which changes their site-packages directory.
+func reloadSignature(paths []string) uint64 {
+	h := fnv.New64a()
+	add := func(path string, info fs.FileInfo) {
+		fmt.Fprintf(h, "%s\x00%d\x00%d\x00", path, info.ModTime().UnixNano(), info.Size())
+	}
+	for _, root := range paths {
+		filepath.WalkDir(root, func(path string, d fs.DirEntry, err error) error {
+			// Files can be removed while they are walked
+			if err != nil {
+				return nil
+			}
+			if d.IsDir() {
+				if path != root && (d.Name() == "__pycache__" || d.Name() == "node_modules" || strings.HasPrefix(d.Name(), ".")) {
+					return filepath.SkipDir
+				}
+				if _, err := os.Stat(filepath.Join(path, "pyvenv.cfg")); err == nil {
+					if site_packages, err := findSitePackagesInVenv(path); err == nil {
+						if info, err := os.Stat(site_packages); err == nil {
+							add(site_packages, info)
+						}
+					}
+					return filepath.SkipDir
+				}
+				return nil
+			}
+			if strings.HasSuffix(path, ".py") {
+				if info, err := d.Info(); err == nil {
+					add(path, info)
+				}
+			}
+			return nil
+		})
+	}
+	return h.Sum64()
+}
+
+// PythonReloader adds /python/reload to the admin API. A POST reloads the
+// Python apps, or the one given by the app parameter, without dropping the
+// requests in flight.
+//
+//	curl -X POST "localhost:2019/python/reload?app=main:app"
+type PythonReloader struct{}
+
+// CaddyModule returns the Caddy module information.
+func (PythonReloader) CaddyModule() caddy.ModuleInfo {
+	return caddy.ModuleInfo{
+		ID:  "admin.api.python_reload",
+		New: func() caddy.Module { return new(PythonReloader) },
+	}
+}
+
+// Routes returns the routes of the admin API.
+func (PythonReloader) Routes() []caddy.AdminRoute {
+	return []caddy.AdminRoute{{
+		Pattern: "/python/reload",
+		Handler: caddy.AdminHandlerFunc(handlePythonReload),
+	}}
+}
+
+func handlePythonReload(w http.ResponseWriter, r *http.Request) error {
+	if r.Method != http.MethodPost {
+		return caddy.APIError{
+			HTTPStatus: http.StatusMethodNotAllowed,
+			Err:        fmt.Errorf("method not allowed: %s", r.Method),
+		}
+	}
+	pattern := r.URL.Query().Get("app")
+	type namedApp struct {
+		pattern string
+		app     reloadableApp
+	}
+	var apps []namedApp
+	reloadable_lock.Lock()
+	for app, entry := range reloadable_apps {
+		if pattern == "" || entry.pattern == pattern {
+			apps = append(apps, namedApp{entry.pattern, app})
+		}
+	}
+	reloadable_lock.Unlock()
+	if len(apps) == 0 {
+		return caddy.APIError{
+			HTTPStatus: http.StatusNotFound,
+			Err:        fmt.Errorf("no python app to reload: %q", pattern),
+		}
+	}
+	sort.Slice(apps, func(i, j int) bool { return apps[i].pattern < apps[j].pattern })
+
+	reloaded := []string{}
+	for _, app := range apps {
+		if err := app.app.Reload(); err != nil {
+			return caddy.APIError{
+				HTTPStatus: http.StatusInternalServerError,
+				Err:        fmt.Errorf("reloading %s: %w", app.pattern, err),
+			}
+		}
+		reloaded = append(reloaded, app.pattern)
+	}
+	w.Header().Set("Content-Type", "application/json")
+	return json.NewEncoder(w).Encode(map[string][]string{"reloaded": reloaded})
+}
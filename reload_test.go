@@ -0,0 +1,177 @@
+package caddysnake
+
+import (
+	"errors"
+	"net/http"
+	"net/http/httptest"
+	"os"
+	"path/filepath"
+	"sync/atomic"
+	"testing"
+	"time"
+
+	"github.com/caddyserver/caddy/v2"
+	"go.uber.org/zap"
+)
+
+func TestReloadSignature(t *testing.T) {
+	dir := t.TempDir()
+	site_packages := filepath.Join(dir, "venv", "lib", "python3.12", "site-packages")
+	if err := os.MkdirAll(site_packages, 0755); err != nil {
+		t.Fatal(err)
+	}
+	files := map[string]string{
+		"main.py":                                "app = None",
+		"README.md":                              "",
+		"__pycache__/main.cpython-312.pyc":       "",
+		"venv/pyvenv.cfg":                        "",
+		"venv/lib/python3.12/site-packages/a.py": "",
+	}
+	for name, content := range files {
+		path := filepath.Join(dir, name)
+		os.MkdirAll(filepath.Dir(path), 0755)
+		if err := os.WriteFile(path, []byte(content), 0644); err != nil {
+			t.Fatal(err)
+		}
+	}
+	modified := time.Now()
+	touch := func(name string) {
+		modified = modified.Add(time.Second)
+		if err := os.Chtimes(filepath.Join(dir, name), modified, modified); err != nil {
+			t.Fatal(err)
+		}
+	}
+	signature := reloadSignature([]string{dir})
+	for _, test := range []struct {
+		name    string
+		changes bool
+	}{
+		{"main.py", true},
+		{"README.md", false},
+		{"__pycache__/main.cpython-312.pyc", false},
+		// Packages are only checked for installs
+		{"venv/lib/python3.12/site-packages/a.py", false},
+		{"venv/lib/python3.12/site-packages", true},
+	} {
+		touch(test.name)
+		current := reloadSignature([]string{dir})
+		if changed := current != signature; changed != test.changes {
+			t.Errorf("%s: expected changed to be %v", test.name, test.changes)
+		}
+		signature = current
+	}
+}
+
+type fakeReloadable struct {
+	reloads int
+	err     error
+}
+
+func (f *fakeReloadable) Cleanup() error { return nil }
+func (f *fakeReloadable) HandleRequest(w http.ResponseWriter, r *http.Request) error {
+	return nil
+}
+func (f *fakeReloadable) Reload() error {
+	f.reloads++
+	return f.err
+}
+
+func TestPythonReload(t *testing.T) {
+	ok, broken := &fakeReloadable{}, &fakeReloadable{err: errors.New("failed to import module")}
+	registerReloadable("main:app", ok, nil, nil)
+	registerReloadable("main:app", ok, nil, nil)
+	registerReloadable("broken:app", broken, nil, nil)
+	defer unregisterReloadable(broken, nil)
+
+	reload := func(method string, target string) (int, string) {
+		w := httptest.NewRecorder()
+		err := handlePythonReload(w, httptest.NewRequest(method, target, nil))
+		var api_err caddy.APIError
+		if errors.As(err, &api_err) {
+			return api_err.HTTPStatus, api_err.Err.Error()
+		}
+		return w.Code, w.Body.String()
+	}
+	for _, test := range []struct {
+		method string
+		target string
+		status int
+		body   string
+	}{
+		{http.MethodGet, "/python/reload", http.StatusMethodNotAllowed, "method not allowed: GET"},
+		{http.MethodPost, "/python/reload?app=main:app", http.StatusOK, `{"reloaded":["main:app"]}` + "\n"},
+		{http.MethodPost, "/python/reload?app=other:app", http.StatusNotFound, `no python app to reload: "other:app"`},
+		{http.MethodPost, "/python/reload", http.StatusInternalServerError, "reloading broken:app: failed to import module"},
+	} {
+		status, body := reload(test.method, test.target)
+		if status != test.status || body != test.body {
+			t.Errorf("%s %s: got %d %q", test.method, test.target, status, body)
+		}
+	}
+	if ok.reloads != 1 || broken.reloads != 1 {
+		t.Errorf("expected one reload of each app, got %d and %d", ok.reloads, broken.reloads)
+	}
+
+	// The app stays registered while a handler uses it
+	unregisterReloadable(ok, nil)
+	if status, _ := reload(http.MethodPost, "/python/reload?app=main:app"); status != http.StatusOK {
+		t.Errorf("expected the app to be registered, got %d", status)
+	}
+	unregisterReloadable(ok, nil)
+	if status, _ := reload(http.MethodPost, "/python/reload?app=main:app"); status != http.StatusNotFound {
+		t.Errorf("expected the app to be unregistered, got %d", status)
+	}
+}
+
+// watchedReloadable counts the reloads of its watcher goroutine.
+type watchedReloadable struct {
+	fakeReloadable
+	watched_reloads atomic.Int32
+}
+
+func (f *watchedReloadable) Reload() error {
+	f.watched_reloads.Add(1)
+	return nil
+}
+
+func TestReloadWatchShared(t *testing.T) {
+	interval := reloadPollInterval
+	reloadPollInterval = 10 * time.Millisecond
+	defer func() { reloadPollInterval = interval }()
+	dir := t.TempDir()
+	main := filepath.Join(dir, "main.py")
+	if err := os.WriteFile(main, []byte("app = None"), 0644); err != nil {
+		t.Fatal(err)
+	}
+	modified := time.Now()
+	touch := func() {
+		modified = modified.Add(time.Second)
+		if err := os.Chtimes(main, modified, modified); err != nil {
+			t.Fatal(err)
+		}
+	}
+
+	// Two handlers share the app and watch the same directory
+	app := &watchedReloadable{}
+	registerReloadable("main:app", app, []string{dir}, zap.NewNop())
+	registerReloadable("main:app", app, []string{dir}, zap.NewNop())
+	// The watcher takes its first signature when it starts
+	time.Sleep(10 * reloadPollInterval)
+	touch()
+	for deadline := time.Now().Add(5 * time.Second); app.watched_reloads.Load() == 0 && time.Now().Before(deadline); {
+		time.Sleep(reloadPollInterval)
+	}
+	time.Sleep(10 * reloadPollInterval)
+	if n := app.watched_reloads.Load(); n != 1 {
+		t.Errorf("expected one reload for both handlers, got %d", n)
+	}
+
+	// The watcher stops with the last handler
+	unregisterReloadable(app, []string{dir})
+	unregisterReloadable(app, []string{dir})
+	touch()
+	time.Sleep(10 * reloadPollInterval)
+	if n := app.watched_reloads.Load(); n != 1 {
+		t.Errorf("expected no reload after the handlers were cleaned up, got %d", n)
+	}
+}
@@ -0,0 +1,66 @@
+package caddysnake
+
+import (
+	"context"
+	"errors"
+	"fmt"
+	"net"
+	"net/http"
+	"time"
+)
+
+// warmupUserAgent lets apps tell warmup requests apart from traffic.
+const warmupUserAgent = "caddysnake-warmup"
+
+// warmUp sends a GET request for each path to an app and discards the
+// responses. Apps leave work for their first requests, like compiling
+// templates or resolving URL patterns, which is done here before traffic
+// arrives. Paths that fail are reported, the rest are still sent.
+func warmUp(app AppServer, startup *appStartup, paths []string) error {
+	start := time.Now()
+	addr := &net.TCPAddr{IP: net.IPv4(127, 0, 0, 1)}
+	var errs []error
+	for _, path := range paths {
+		r, err := http.NewRequestWithContext(context.WithValue(context.Background(), http.LocalAddrContextKey, addr), http.MethodGet, "http://localhost"+path, nil)
+		if err != nil {
+			errs = append(errs, err)
+			continue
+		}
+		// Like the requests of http.Server, the body is never nil
+		r.Body = http.NoBody
+		r.RemoteAddr = "127.0.0.1:0"
+		r.RequestURI = path
+		r.Header.Set("User-Agent", warmupUserAgent)
+		w := &warmupWriter{header: http.Header{}, status: http.StatusOK}
+		if err := app.HandleRequest(w, r); err != nil {
+			errs = append(errs, fmt.Errorf("warmup %s: %w", path, err))
+		} else if w.status >= http.StatusInternalServerError {
+			errs = append(errs, fmt.Errorf("warmup %s: status %d", path, w.status))
+		}
+	}
+	startup.warmedUp(time.Since(start))
+	return errors.Join(errs...)
+}
+
+// warmupWriter discards the response of a warmup request.
+type warmupWriter struct {
+	header       http.Header
+	status       int
+	wrote_header bool
+}
+
+func (w *warmupWriter) Header() http.Header { return w.header }
+
+func (w *warmupWriter) WriteHeader(status int) {
+	if !w.wrote_header {
+		w.status = status
+		w.wrote_header = true
+	}
+}
+
+func (w *warmupWriter) Write(b []byte) (int, error) {
+	w.WriteHeader(http.StatusOK)
+	return len(b), nil
+}
+
+func (w *warmupWriter) Flush() {}
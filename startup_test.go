@@ -0,0 +1,63 @@
+package caddysnake
+
+import (
+	"errors"
+	"io"
+	"net"
+	"net/http"
+	"strings"
+	"testing"
+)
+
+type warmupApp struct {
+	paths []string
+}
+
+func (a *warmupApp) Cleanup() error { return nil }
+
+func (a *warmupApp) HandleRequest(w http.ResponseWriter, r *http.Request) error {
+	a.paths = append(a.paths, r.URL.RequestURI())
+	if _, ok := r.Context().Value(http.LocalAddrContextKey).(net.Addr); !ok {
+		return errors.New("missing local address")
+	}
+	if r.Method != http.MethodGet || r.UserAgent() != warmupUserAgent {
+		return errors.New("unexpected request")
+	}
+	if _, err := io.ReadAll(r.Body); err != nil {
+		return err
+	}
+	switch r.URL.Path {
+	case "/error":
+		return errors.New("app failed")
+	case "/broken":
+		w.WriteHeader(http.StatusBadGateway)
+	case "/missing":
+		w.WriteHeader(http.StatusNotFound)
+	}
+	w.Write([]byte("ok"))
+	return nil
+}
+
+func TestWarmUp(t *testing.T) {
+	app := &warmupApp{}
+	var startup appStartup
+	if err := warmUp(app, &startup, []string{"/", "/missing", "/search?q=1"}); err != nil {
+		t.Fatal(err)
+	}
+	if strings.Join(app.paths, " ") != "/ /missing /search?q=1" {
+		t.Errorf("unexpected requests %v", app.paths)
+	}
+	if startup.warmup_ns.Load() <= 0 {
+		t.Error("expected the warmup to be timed")
+	}
+
+	// Failures are reported, the other paths are still sent
+	app = &warmupApp{}
+	err := warmUp(app, &startup, []string{"/error", "/broken", "/"})
+	if err == nil || err.Error() != "warmup /error: app failed\nwarmup /broken: status 502" {
+		t.Errorf("unexpected error %v", err)
+	}
+	if len(app.paths) != 3 {
+		t.Errorf("expected 3 requests, got %v", app.paths)
+	}
+}
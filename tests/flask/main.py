@@ -1,5 +1,5 @@
 import wsgiref.validate
-from flask import Flask, request
+from flask import Flask, request, send_file
 
 
 app = Flask(__name__)
@@ -25,4 +25,10 @@ def delete_item(id):
     return "Deleted"
 
 
+@app.route("/file", methods=["GET"])
+def get_file():
+    # Served through wsgi.file_wrapper
+    return send_file(__file__, mimetype="text/plain")
+
+
 app = wsgiref.validate.validator(app)
@@ -37,6 +37,13 @@ def delete_item(id: str):
     return response.status_code == 200 and b"Deleted" in response.content
 
 
+def get_file():
+    response = requests.get(f"{BASE_URL}/file")
+    assert response.status_code == 200, "Get file failed"
+    with open(os.path.join(os.path.dirname(__file__), "main.py"), "rb") as f:
+        assert response.content == f.read(), "File content does not match"
+
+
 def item_lifecycle():
     id = str(uuid.uuid4())
     item = get_dummy_item()
@@ -71,4 +78,5 @@ def make_objects(max_workers: int, count: int):
 
 
 if __name__ == "__main__":
+    get_file()
     make_objects(max_workers=4, count=2_500)
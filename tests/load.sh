@@ -0,0 +1,60 @@
+#!/bin/sh
+# Load profile of the integration test apps. Run it from the directory of
+# simple, fastapi or django while its Caddy is running:
+#
+#   cd tests/simple && ./caddy run --config Caddyfile &
+#   ../load.sh
+#
+# It needs oha (https://github.com/hatoo/oha) and prints the throughput and
+# the p50/p99 latency of each request. DURATION and CONNECTIONS change how
+# long each request is sent and with how many connections at once.
+set -eu
+
+BASE_URL=${BASE_URL:-http://localhost:9080}
+DURATION=${DURATION:-10s}
+CONNECTIONS=${CONNECTIONS:-50}
+ITEM_ID=4f3a3a52-7f6b-4cba-a1a8-8d43b8fd7f51
+
+# run <name> <oha arguments...>
+run() {
+	name=$1
+	shift
+	oha --no-tui --json -z "$DURATION" -c "$CONNECTIONS" "$@" |
+		python3 -c '
+import json, sys
+result = json.load(sys.stdin)
+percentiles = result["latencyPercentiles"]
+print("%-16s %10.1f req/s %8.2f ms p50 %8.2f ms p99 %6.1f%% ok" % (
+    sys.argv[1],
+    result["summary"]["requestsPerSec"],
+    percentiles["p50"] * 1000,
+    percentiles["p99"] * 1000,
+    result["summary"]["successRate"] * 100,
+))
+' "$name"
+}
+
+case $(basename "$PWD") in
+simple)
+	curl -sf -X POST -d '{"name": "bench"}' "$BASE_URL/item/$ITEM_ID" >/dev/null
+	run get "$BASE_URL/item/$ITEM_ID"
+	run post -m POST -d '{"name": "bench"}' "$BASE_URL/item/load"
+	run stream "$BASE_URL/stream"
+	;;
+fastapi)
+	item='{"name": "bench", "description": "load profile", "blob": "'$(head -c 65536 /dev/zero | tr '\0' x)'"}'
+	curl -sf -X POST -H 'Content-Type: application/json' -d "$item" "$BASE_URL/item/$ITEM_ID" >/dev/null
+	run get "$BASE_URL/item/$ITEM_ID"
+	run post -m POST -H 'Content-Type: application/json' -d '{"name": "bench", "description": "load profile", "blob": null}' "$BASE_URL/item/load"
+	run stream "$BASE_URL/stream-item/$ITEM_ID"
+	;;
+django)
+	curl -sf -X POST -d '{"name": "bench"}' "$BASE_URL/item/store/$ITEM_ID" >/dev/null
+	run get "$BASE_URL/item/retrieve/$ITEM_ID"
+	run post -m POST -d '{"name": "bench"}' "$BASE_URL/item/store/$ITEM_ID"
+	;;
+*)
+	echo "run it from tests/simple, tests/fastapi or tests/django" >&2
+	exit 1
+	;;
+esac
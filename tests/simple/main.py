@@ -45,12 +45,21 @@ def app(environ: dict, start_response: Callable):
             body = store_item(item_id, content)
         elif method == "delete":
             body = delete_item(item_id)
+        elif method == "put":
+            # Echo the request body back, used to check binary uploads
+            body = environ["wsgi.input"].read(int(environ["CONTENT_LENGTH"]))
+            content_type = "application/octet-stream"
         else:
             status = "405"
             body = b"Method Not Allowed"
         response_headers = [("Content-Type", content_type)]
         start_response(status, response_headers)
         yield body
+    elif path == "/stream":
+        # Many small chunks, the response must be streamed to the client
+        start_response("200 OK", [("Content-Type", "text/plain")])
+        for i in range(10_000):
+            yield b"%d\n" % i
     else:
         start_response("404 Not Found", [("Content-type", "text/plain")])
         yield b"Not found"
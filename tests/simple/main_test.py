@@ -37,6 +37,33 @@ def delete_item(id: str):
     return response.status_code == 200 and b"Deleted" in response.content
 
 
+def echo_binary():
+    blob = os.urandom(2**20) + b"\x00" + os.urandom(2**10)
+    response = requests.put(f"{BASE_URL}/item/echo", data=blob)
+    assert response.status_code == 200, "Echo failed"
+    assert response.content == blob, "Binary body was not preserved"
+
+
+def stream_chunks():
+    response = requests.get(f"{BASE_URL}/stream", stream=True)
+    assert response.status_code == 200, "Stream failed"
+    expected = b"".join(b"%d\n" % i for i in range(10_000))
+    assert response.raw.read() == expected, "Streamed body does not match"
+
+
+def check_metrics():
+    response = requests.get(f"{BASE_URL}/metrics")
+    assert response.status_code == 200, "Metrics failed"
+    for name in [
+        "caddy_python_queue_wait_seconds_count",
+        "caddy_python_gil_wait_seconds_count",
+        "caddy_python_app_seconds_count",
+        "caddy_python_write_seconds_count",
+        "caddy_python_requests_in_flight",
+    ]:
+        assert f'{name}{{app="main:app"}}' in response.text, f"{name} is missing"
+
+
 def item_lifecycle():
     id = str(uuid.uuid4())
     item = get_dummy_item()
@@ -71,4 +98,7 @@ def make_objects(max_workers: int, count: int):
 
 
 if __name__ == "__main__":
+    echo_binary()
+    stream_chunks()
     make_objects(max_workers=4, count=2_500)
+    check_metrics()
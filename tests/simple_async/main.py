@@ -48,6 +48,23 @@ async def app(scope, receive, send):
             }
         )
         await send({"type": "http.response.body", "body": body})
+    elif path == "/stream":
+        await send(
+            {
+                "type": "http.response.start",
+                "status": 200,
+                "headers": [(b"Content-Type", b"text/plain")],
+            }
+        )
+        for i in range(1000):
+            await send(
+                {
+                    "type": "http.response.body",
+                    "body": b"line %d\n" % i,
+                    "more_body": True,
+                }
+            )
+        await send({"type": "http.response.body", "body": b""})
     else:
         await send(
             {
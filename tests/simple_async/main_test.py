@@ -46,6 +46,12 @@ def item_lifecycle():
     assert not delete_item(id), "Delete item should fail"
 
 
+def stream_lines():
+    response = requests.get(f"{BASE_URL}/stream")
+    expected = "".join(f"line {i}\n" for i in range(1000))
+    assert response.status_code == 200 and response.text == expected, "Stream failed"
+
+
 def make_objects(max_workers: int, count: int):
     start = time.time()
     failed = False
@@ -71,4 +77,5 @@ def make_objects(max_workers: int, count: int):
 
 
 if __name__ == "__main__":
+    stream_lines()
     make_objects(max_workers=4, count=2_500)